@@ -6,6 +6,7 @@
 #include <array>
 #include <cassert>
 #include "yuv_stream.hpp"
+#include "motion.hpp"
 
 using Block8x8 = std::array<std::array<double, 8>, 8>;
 using Block16x16 = std::array<std::array<double, 16>, 16>;
@@ -23,6 +24,19 @@ namespace dct {
         ERROR
     };
 
+    // Quantization step of the residual of B-frames relative to P-frames, B-frames are
+    // not used as references so their extra error does not carry over to later frames
+    const double B_frame_scale = 1.5;
+
+    // Quantizer scale of a frame (sent in every frame header), the quantization step of every
+    // block is multiplied by 2^((qscale - 32)/8). 32 is the step of the quality preset and every
+    // 8 steps double or halve it.
+    const u32 default_qscale = 32;
+    const u32 max_qscale = 63;
+    inline double qscale_to_scale(u32 qscale){
+        return std::pow(2.0, (int(qscale) - int(default_qscale)) / 8.0);
+    }
+
     enum Direction {
         right = 0,
         down,
@@ -110,21 +124,26 @@ namespace dct {
     Block8x8 transpose_block(const Block8x8& block);
     Block8x8 get_delta_block(const Block8x8& block1, const Block8x8& block2);
     Block8x8 add_delta_block(const Block8x8& block, const Block8x8& delta);
+    Block8x8 average_block(const Block8x8& block1, const Block8x8& block2);
     Block16x16 create_macroblock(const Block8x8& b1, const Block8x8& b2, const Block8x8& b3, const Block8x8& b4);
-    void get_prev_blocks(u32 macro_idx, YUVFrame420& prev_frame, const std::pair<u32, u32>& vector, std::vector<Block8x8>& prev_blocks);
+    void get_prev_blocks(u32 macro_idx, const motion::ReferenceFrame& reference, const std::pair<int, int>& vector, std::vector<Block8x8>& prev_blocks);
+    void get_prev_blocks(u32 macro_idx, const motion::ReferenceFrame& reference, const std::array<std::pair<int, int>, 4>& block_vectors, std::vector<Block8x8>& prev_blocks);
+    void get_downscaled_prev_blocks(u32 macro_idx, const motion::ReferenceFrame& reference, const std::array<std::pair<int, int>, 4>& block_vectors, u32 downscale, std::vector<Block8x8>& prev_blocks);
 
     /* ----- Compressor Functions ----- */
     void partition_Y_channel(std::vector<Block8x8>& blocks, u32 height, u32 width, const std::vector<std::vector<unsigned char>>& channel);
     void partition_C_channel(std::vector<Block8x8>& blocks, u32 height, u32 width, const std::vector<std::vector<unsigned char>>& channel);
     Block8x8 get_dct(const Block8x8 &block);
-    Block8x8 quantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block);
+    double get_multiplier(Quality quality, bool is_luminance, bool is_P_block);
+    Block8x8 quantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block, double scale = 1);
     Direction get_direction(u32 r, u32 c, Direction curr);
     Array64 block_to_array(const Block8x8& block);
 
     /* ----- Decompressor Functions ----- */
     Block8x8 array_to_block(const Array64& array);
-    Block8x8 unquantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block);
+    Block8x8 unquantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block, double scale = 1);
     Block8x8 get_inverse_dct(const Block8x8& block);
+    Block8x8 get_reduced_inverse_dct(const Block8x8& block, u32 size);
     void undo_partition_C_channel(const std::vector<Block8x8>& blocks, u32 height, u32 width, std::vector<std::vector<unsigned char>>& channel);
     void undo_partition_Y_channel(const std::vector<Block8x8>& blocks, u32 height, u32 width, std::vector<std::vector<unsigned char>>& channel);
 
@@ -0,0 +1,59 @@
+#ifndef EFFORT
+#define EFFORT
+
+#include <vector>
+#include <cstdint>
+
+using u32 = std::uint32_t;
+
+namespace effort{
+
+    // Encoder settings which trade speed for compression and can change between frames
+    struct Level {
+        int radius;                 // motion search radius
+        u32 early_exit_sad;         // SAD good enough to stop the motion search
+        bool full_search;           // scan the window when no candidate is good enough (else only refine the candidates)
+        u32 search_references;      // most recent references searched
+        bool partitions;            // try motion partitions
+        bool rdo;                   // rate-distortion mode decision
+        u32 skip_sad;               // skip a block of a P-frame without a search if its predicted vector is this good (0=never)
+    };
+
+    /* Picks the effort level of each frame in real-time mode.
+
+       Level 0 is the fastest and the highest level is the settings given on
+       the command line, every level in between gives up more of them (first
+       partitions, then RDO and the older references, then search radius and
+       finally the full search) and skips more blocks without a search.
+
+       The controller keeps how far the encoder is behind the input (the time
+       the frames took beyond 1/fps each, never below 0) and an average time
+       per frame for every level. It drops a level as soon as the encoder falls
+       behind or the average nears the budget, and goes back up only after a
+       while without lag and if the higher level is known (or assumed) to fit.
+    */
+    class EffortController{
+    public:
+        EffortController(double fps, const Level& top);
+
+        const Level& level() const{
+            return levels.at(current);
+        }
+        u32 level_index() const{
+            return current;
+        }
+        // Updates the level with the encode time of the frame which used the current level
+        void frame_done(double seconds);
+
+    private:
+        double budget;
+        std::vector<Level> levels;
+        std::vector<double> level_seconds;      // average time per frame of each level (0 if never used)
+        u32 current;
+        double lag;
+        u32 frames_at_level;
+    };
+
+} // namespace effort
+
+#endif
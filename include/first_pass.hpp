@@ -0,0 +1,61 @@
+#ifndef FIRST_PASS
+#define FIRST_PASS
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cassert>
+#include "yuv_stream.hpp"
+
+using u32 = std::uint32_t;
+using u8 = std::uint8_t;
+
+namespace first_pass{
+
+    // Frames are analysed at half the resolution, a macro-block becomes an 8x8 block
+    const u32 analysis_scale = 2;
+    // search range of the analysis in half resolution samples (16 full resolution samples)
+    const int search_radius = 8;
+
+    // Results of the first pass for one frame (in display order)
+    struct FrameCost {
+        bool keyframe {false};
+        bool scene_cut {false};
+        double intra_cost {0};      // sum over the macro-blocks of their intra cost
+        double cost {0};            // sum over the macro-blocks of the cheaper of their intra and inter cost
+        u32 intra_blocks {0};       // macro-blocks where intra is cheaper
+    };
+
+    /* Cheap analysis of every frame for the first pass of a two-pass encode.
+
+       The luma is averaged down to half resolution and every macro-block (an 8x8
+       block there) gets an intra cost, the sum of the absolute differences of
+       its samples from their mean, and an inter cost, the lowest SAD of an
+       integer search of the previous half resolution frame. Their sum follows
+       the bits the frame takes closely enough for the second pass to share
+       out the bits between frames.
+    */
+    class Analyzer{
+    public:
+        Analyzer(u32 width, u32 height);
+
+        // Analyses the next frame, keyframes only get the intra cost
+        FrameCost analyze(YUVFrame420& frame, bool keyframe);
+
+    private:
+        u32 intra_cost(u32 x, u32 y) const;
+        u32 inter_cost(u32 x, u32 y, u32 limit) const;
+
+        u32 width, height;
+        std::vector<u8> samples, previous_samples;
+        bool has_previous;
+    };
+
+    // The stats file is a text file with a header line and one line per frame
+    bool write_stats(const std::string& path, u32 width, u32 height, const std::vector<FrameCost>& frames);
+    // Returns false if the file can not be read or was written for another frame size
+    bool read_stats(const std::string& path, u32 width, u32 height, std::vector<FrameCost>& frames);
+
+} // namespace first_pass
+
+#endif
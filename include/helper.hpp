@@ -1,14 +1,25 @@
+#ifndef HELPER
+#define HELPER
+
 #include <queue>
 #include <vector>
 #include <string>
-#include <list>
 #include <algorithm>
 #include <cstdlib>
 #include <cassert>
+#include <limits>
+#include <array>
 #include "discrete_cosine_transform.hpp"
 #include "yuv_stream.hpp"
 #include "output_stream.hpp"
 #include "stream.hpp"
+#include "stats.hpp"
+#include "motion.hpp"
+
+namespace uvid{
+    struct EncoderParams;
+    class Decoder;
+}
 
 namespace helper{
     
@@ -25,245 +36,221 @@ namespace helper{
 
     // Returns the quality enum corresponding to the input string
     // If invalid returns Quality::ERROR
-    dct::Quality get_quality(std::string input_quality){
-        if(input_quality == "low")
-            return dct::Quality::low;
-        else if(input_quality == "medium")
-            return dct::Quality::medium;
-        else if(input_quality == "high")
-            return dct::Quality::high;
-        else
-            return dct::Quality::ERROR;
-    }
+    dct::Quality get_quality(std::string input_quality);
 
-    /* ----- Compressor Code ----- */
+    // Handles the "--stats [path]" option at argv[idx] (the report goes to stderr without a path)
+    // Returns false if argv[idx] is not the stats option
+    bool parse_stats_option(int argc, char** argv, int& idx);
 
-    bool find_motion_vector(const Block16x16& block, YUVFrame420& prev_frame, u32 macro_idx, std::pair<int,int>& vector, int radius = 8){
-        u32 macroblocks_wide = prev_frame.get_Width() / 16;
-
-        // (0,0) coordinate of active block in the frame
-        int B_x = (macro_idx % macroblocks_wide) * 16;
-        int B_y = (macro_idx / macroblocks_wide) * 16;
-
-        // Search region boundaries (radius of 8)
-        int v_x_min = (B_x-radius < 0)? 0 : B_x-radius;
-        int v_x_max = (B_x+radius < prev_frame.get_Width()) ? B_x+radius : prev_frame.get_Width();
-        int v_y_min = (B_y-radius < 0)? 0 : B_y-radius;
-        int v_y_max = (B_y+radius < prev_frame.get_Height()) ? B_y+radius : prev_frame.get_Height();
-
-        double min_avg_difference {INT32_MAX};
-        // Look for motion vectors
-        for(int v_x = v_x_min; v_x < v_x_max; v_x++){
-            for(int v_y = v_y_min; v_y < v_y_max; v_y++){
-                // calculate the AAD(v)
-                double avg_difference {};
-
-                for(u32 r = 0; r < 16 && r+v_y < prev_frame.get_Height(); r++){
-                    for(u32 c = 0; c < 16 && c+v_x < prev_frame.get_Width(); c++){
-                        int value = int(block.at(r).at(c)) - int(prev_frame.Y(c+v_x, r+v_y));
-                        avg_difference += std::abs(value);
-                    }
-                }
-                avg_difference/=256;
-                // update the minimum value
-                if(avg_difference < min_avg_difference){
-                    min_avg_difference = avg_difference;
-                    vector.first = v_x - B_x;
-                    vector.second= v_y - B_y;
-                }
-            }
-        }
-        // if a good enough vector is found return
-        if(min_avg_difference <= 50){
-            return true;
-        }
-        return false;
-    }
+    // Handles an encoder option of uvid_compress at argv[idx] (--refs, --bitrate, ...), shared with
+    // the encodes of uvid_batch. Returns false if argv[idx] is not one or its value is invalid.
+    bool parse_encoder_option(int argc, char** argv, int& idx, uvid::EncoderParams& params);
 
-    void compress_I_block(std::list<Block8x8>& compressed_blocks, std::list<Block8x8>& uncompressed_blocks, u32 C_idx, 
-    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks, dct::Quality quality){
-        u32 Y_idx = 4 * C_idx;
-        for(u32 count = 0; count < 4; count++){
-            // Take the DCT and quantize
-            Block8x8 quantized_block = dct::quantize_block(dct::get_dct(Y_blocks.at(Y_idx+count)), quality, true, false);
-            // Push in array format
-            compressed_blocks.push_back(quantized_block);
-            // Unquantize and take the inverse DCT
-            uncompressed_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, true, false)));
-        }
-
-        Block8x8 quantized_Cb_block = dct::quantize_block(dct::get_dct(Cb_blocks.at(C_idx)), quality, false, false);
-        compressed_blocks.push_back(quantized_Cb_block);
-        uncompressed_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(quantized_Cb_block, quality, false, false)));
-
-        Block8x8 quantized_Cr_block = dct::quantize_block(dct::get_dct(Cr_blocks.at(C_idx)), quality, false, false);
-        compressed_blocks.push_back(quantized_Cr_block);
-        uncompressed_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(quantized_Cr_block, quality, false, false)));
-    }
+    // Reads a frame rate given as n, n/d, n:d or a decimal number such as 29.97 into a fraction
+    // Returns false if it is not one of these or not above 0
+    bool parse_frame_rate(const std::string& input, u32& numerator, u32& denominator);
 
-    void compress_P_block(std::list<Block8x8>& compressed_blocks, std::list<Block8x8>& uncompressed_blocks, u32 macro_idx, 
-    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks, dct::Quality quality,
-    YUVFrame420& prev_frame, const std::pair<int, int>& vector){
-
-        std::vector<Block8x8> prev_blocks;
-        dct::get_prev_blocks(macro_idx, prev_frame, vector, prev_blocks);
-        // std::cerr<< "prev_blocks " << prev_blocks.size() << std::endl;
-        u32 Y_idx = 4 * macro_idx;
-        for(u32 count = 0; count < 4; count++){
-            //Get the delta values 
-            Block8x8 delta_block = dct::get_delta_block(Y_blocks.at(Y_idx+count), prev_blocks.at(count));
-            // Take the DCT and quantize the delta values
-            Block8x8 quantized_block = dct::quantize_block(dct::get_dct(delta_block), quality, true, true);
-            // Push in array format
-            compressed_blocks.push_back(quantized_block);
-            // Unquantize and take the inverse DCT of the delta values 
-            Block8x8 uncompressed_delta = dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, true, true));
-            // Unquantize and take the inverse DCT
-            uncompressed_blocks.push_back(dct::add_delta_block(prev_blocks.at(count), uncompressed_delta));
-        }
-
-        Block8x8 delta_block = dct::get_delta_block(Cb_blocks.at(macro_idx), prev_blocks.at(4));
-        Block8x8 quantized_block = dct::quantize_block(dct::get_dct(delta_block), quality, false, true);
-        compressed_blocks.push_back(quantized_block);
-        Block8x8 uncompressed_delta = dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, false, true));
-        uncompressed_blocks.push_back(dct::add_delta_block(prev_blocks.at(4), uncompressed_delta));
-
-        delta_block = dct::get_delta_block(Cr_blocks.at(macro_idx), prev_blocks.at(5));
-        quantized_block = dct::quantize_block(dct::get_dct(delta_block), quality, false, true);
-        compressed_blocks.push_back(quantized_block);
-        uncompressed_delta = dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, false, true));
-        uncompressed_blocks.push_back(dct::add_delta_block(prev_blocks.at(5), uncompressed_delta));
-    }
+    // Header of the Y4M output of a decoded stream (frame size and rate of the stream, progressive 4:2:0)
+    Y4MHeader y4m_header(const uvid::Decoder& decoder);
 
-    void push_motion_vectors(std::list<std::pair<int, int>>& motion_vectors, OutputBitStream& output_stream){
-        // Push number of motion vectors
-        output_stream.push_u16(motion_vectors.size());
-
-        // No motion vectors to push so return 
-        if(motion_vectors.size() == 0)
-            return;
-
-        // Push the first motion vector as u16
-        std::pair<int, int>& first_vector = motion_vectors.front();
-        stream::push_value_n(output_stream, first_vector.first, 4);
-        stream::push_value_n(output_stream, first_vector.second, 4);
-        std::pair<int, int> prev_vector = first_vector;
-        motion_vectors.pop_front();
-
-        // Push the rest of the motion vectors as delta values 
-        while(!motion_vectors.empty()){
-            std::pair<int, int>& curr_vector = motion_vectors.front();
-            stream::push_delta_value(output_stream, curr_vector.first-prev_vector.first);
-            stream::push_delta_value(output_stream, curr_vector.second-prev_vector.second);
-            prev_vector = curr_vector;
-            motion_vectors.pop_front();
-        }
-    }
+    /* ----- Compressor Code ----- */
 
-    void push_compressed_blocks(const std::list<bool>& flags, std::list<Block8x8>& compressed_blocks, OutputBitStream& output_stream){
-        for(bool block_type : flags){
-            // Push block-type bit (0=I-block and 1=P-block)
-            output_stream.push_bit(block_type);
-            // Push the macro block (in Y Cb Cr order)
-            for(u32 count = 0; count < 6; count++){
-                stream::push_quantized_array_delta(output_stream, dct::block_to_array(compressed_blocks.front()));
-                compressed_blocks.pop_front();
-            }
-        }
+    // Largest sum of absolute differences for which a macro-block is encoded as a P-block
+    // (average difference of at most 50)
+    const u32 max_P_block_sad = 50*256;
+
+    // Partitions one row of macro-blocks of the frame into 8x8 blocks (4 Y blocks per macro-block,
+    // then one Cb and one Cr block each), the blocks past the edges repeat the last samples
+    void partition_row(YUVFrame420& frame, u32 row, std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks);
+
+    // Writes a reconstructed 8x8 block of a plane (0=Y 1=Cb 2=Cr) at (x, y) of that plane into the
+    // frame, rounded and clamped, the samples past the edges are dropped. A smaller size only writes
+    // the top-left corner of the block (downscaled decoding).
+    void write_block(YUVFrame420& frame, u32 plane, u32 x, u32 y, const Block8x8& block, u32 size = 8);
+
+    // Settings of the motion search
+    struct SearchSettings {
+        int radius {8};
+        // a vector with a sum of absolute differences of at most this much (average difference
+        // of 4 by default) is good enough to stop searching
+        u32 early_exit_sad {4*256};
+        // also try splitting P-blocks into 16x8, 8x16 and 8x8 partitions
+        bool partitions {false};
+        // scan every position within the radius when no candidate is good enough,
+        // otherwise the best candidate is only refined
+        bool full_search {true};
+        // number of references searched (the most recent ones)
+        u32 search_references {UINT32_MAX};
+        // refine the best candidate in steps of the vector precision only (the candidates are already close)
+        bool finest_step_only {false};
+    };
+
+    // Settings which only refine candidates that are already close (the motion found by the
+    // shared analysis of renditions) by one step of the vector precision, without a full search
+    inline SearchSettings refine_settings(SearchSettings settings){
+        settings.full_search = false;
+        settings.finest_step_only = true;
+        return settings;
     }
 
-    YUVFrame420 reconstruct_prev_frame(std::list<Block8x8>& compressed_blocks, u32 num_macro_blocks, u32 height, u32 width){  
-        std::vector<Block8x8> Y_blocks, Cb_blocks, Cr_blocks;
-        for(u32 macro_count = 0; macro_count < num_macro_blocks; macro_count++){
-            for(u32 y_count = 0; y_count < 4; y_count++){
-                Y_blocks.push_back(compressed_blocks.front());
-                compressed_blocks.pop_front();
-            }
-            Cb_blocks.push_back(compressed_blocks.front());
-            compressed_blocks.pop_front();
-
-            Cr_blocks.push_back(compressed_blocks.front());
-            compressed_blocks.pop_front();
-        }
-
-        auto Y_matrix = helper::create_2d_vector<unsigned char>(height,width);
-        auto Cb_matrix = helper::create_2d_vector<unsigned char>(height/2 ,width/2);
-        auto Cr_matrix = helper::create_2d_vector<unsigned char>(height/2 ,width/2);
-        dct::undo_partition_Y_channel(Y_blocks, height, width, Y_matrix);
-        dct::undo_partition_C_channel(Cb_blocks, height/2 ,width/2, Cb_matrix);
-        dct::undo_partition_C_channel(Cr_blocks, height/2 ,width/2, Cr_matrix);
-
-        YUVFrame420 previous_frame {width, height};
-        for (u32 y = 0; y < height; y++)
-            for (u32 x = 0; x < width; x++)
-                previous_frame.Y(x,y) = Y_matrix.at(y).at(x);
-        for (u32 y = 0; y < height/2; y++)
-            for (u32 x = 0; x < width/2; x++){
-                previous_frame.Cb(x,y) = Cb_matrix.at(y).at(x);
-                previous_frame.Cr(x,y) = Cr_matrix.at(y).at(x);
-            }
-        return previous_frame;
-
+    // Searches the reference for the motion vector (in quarter-pel units) with the lowest
+    // sum of absolute differences. The candidates (e.g. the vector predicted from the neighbours
+    // and the vector of the co-located block in the previous frame) are tried first. If one of
+    // them is already good enough only its neighbourhood is searched, otherwise every integer
+    // position within the radius is until one is good enough. The best vector is then refined in
+    // half-pel and quarter-pel steps (as allowed by the precision of the reference).
+    // Positions are rejected without computing their SAD when the difference of the block sums
+    // already exceeds the best SAD (successive elimination), and the SAD of the others stops as
+    // soon as it exceeds the best one (partial distortion elimination).
+    // Returns the sum of absolute differences of the vector.
+    u32 find_motion_vector(const Block16x16& block, const motion::ReferenceFrame& reference, u32 macro_idx, std::pair<int,int>& vector,
+    const std::vector<std::pair<int,int>>& candidates = {}, const SearchSettings& settings = {});
+
+    // Tries to split the macro-block into partitions with their own vector, in the reference the
+    // 16x16 vector was found in. A single pass over the search window computes the SAD of the four
+    // 8x8 quarters at every position, and the best vector of each half is found from their sums.
+    // The best split (by integer-pel SAD plus the bits of its extra vectors) is refined in sub-pel
+    // steps and replaces the 16x16 vector if it is still cheaper.
+    // Returns the sum of absolute differences of the chosen partitions.
+    u32 find_partitions(const Block16x16& block, const motion::ReferenceFrame& reference, u32 macro_idx, u32 whole_sad,
+    const SearchSettings& settings, motion::BlockMotion& motion);
+
+    // Searches every reference and picks the one with the lowest sum of absolute differences,
+    // an older reference has to beat the newer ones by the cost of its longer index.
+    // Returns true if the best vector is good enough to encode the macro-block as a P-block.
+    bool find_reference(const Block16x16& block, const motion::ReferenceBuffer& references, u32 macro_idx,
+    const std::vector<std::pair<int,int>>& candidates, const SearchSettings& settings, motion::BlockMotion& motion);
+
+    // Refines the motion of a P-block which was found on the input frames (see motion_analysis.hpp):
+    // only its reference is searched, from its vector and the candidates (its vector is added to them).
+    // Returns true if the vector is good enough to encode the macro-block as a P-block.
+    bool refine_reference(const Block16x16& block, const motion::ReferenceBuffer& references, u32 macro_idx, const motion::BlockMotion& source,
+    std::vector<std::pair<int,int>>& candidates, const SearchSettings& settings, motion::BlockMotion& motion);
+
+    // Sum of absolute differences between the macro-block and the Y blocks of a prediction
+    u32 prediction_sad(const Block16x16& block, const std::vector<Block8x8>& prediction);
+
+    // Pushes the prediction of an inter macro-block, in a B-frame reference 0 is the future frame.
+    // With a downscale the references are that much smaller than the stream (see dct::get_prev_blocks).
+    void get_prediction(u32 macro_idx, const motion::ReferenceBuffer& references, const motion::BlockMotion& motion, std::vector<Block8x8>& prediction, u32 downscale = 1);
+
+    // In a B-frame reference 0 is the future frame and the others are past frames.
+    // Searches the past references and the future reference separately and then tries the
+    // average of both predictions, each mode pays for the bits of its mode code and index.
+    // Returns true if the best prediction is good enough to encode an inter macro-block.
+    // The average prediction is built in the given blocks, which the caller reuses.
+    bool find_B_prediction(const Block16x16& block, const motion::ReferenceBuffer& references, u32 macro_idx,
+    const std::vector<std::pair<int,int>>& forward_candidates, const std::vector<std::pair<int,int>>& backward_candidates,
+    const SearchSettings& settings, motion::BlockMotion& motion, std::vector<Block8x8>& average);
+
+    // What the encoding of a macro-block works in. The caller keeps it (one for each thread, the
+    // encoder one for each row) so that it is reused from one macro-block and frame to the next
+    // and only allocated for the first ones.
+    struct MacroblockScratch {
+        std::vector<std::pair<int,int>> forward_candidates, backward_candidates;
+        std::vector<Block8x8> prediction;
+        // the blocks of a mode tried by rd_compress_macroblock and of the best one so far
+        std::vector<Block8x8> compressed, uncompressed, best_compressed, best_uncompressed;
+    };
+
+    void compress_I_block(std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks, u32 C_idx,
+    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks, dct::Quality quality, double scale = 1);
+
+    // prev_blocks is the prediction of the macro-block (from dct::get_prev_blocks)
+    void compress_P_block(std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks, u32 block_idx,
+    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks, dct::Quality quality,
+    const std::vector<Block8x8>& prev_blocks, double scale = 1);
+
+    // Sends the type of a macro-block and for P-blocks their prediction mode (B-frames only),
+    // the index of their reference frame and their motion vectors. Vectors are sent in units of
+    // the precision as the difference from the median of the vectors of the neighbours.
+    // In a B-frame the index of the past reference is sent relative to reference 1.
+    // With partitions enabled P-blocks of P-frames also send their partition, the vector of the
+    // first partition is predicted from the neighbours and every other one from the partition before it.
+    // With skip enabled P-blocks of P-frames first send whether they are skipped, which ends the macro-block.
+    void push_block_motion(const motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, motion::Precision precision,
+    u32 num_references, bool B_frame, bool partitions, bool skip, OutputBitStream& output_stream);
+
+    // Number of bits push_block_motion sends for the macro-block
+    u32 block_motion_bits(const motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, motion::Precision precision,
+    u32 num_references, bool B_frame, bool partitions, bool skip);
+
+    // What the rate-distortion mode decision needs to know about the frame
+    struct RDSettings {
+        dct::Quality quality;
+        double I_scale;                 // quantizer scale of I-blocks
+        double P_scale;                 // quantizer scale of P-blocks (coarser in B-frames)
+        double lambda;                  // squared error worth one bit
+        motion::Precision precision;
+        u32 num_references;
+        bool B_frame;
+        bool partitions;
+        bool skip;                      // the stream has skipped blocks
+    };
+
+    // Squared error worth one bit, from the quantization step of the luma DC of P-blocks.
+    // It grows linearly with the step rather than with its square: the steps are so coarse that
+    // most of the error of a P-block comes from its prediction rather than from quantization.
+    // The factor was tuned on the synthetic clips.
+    inline double rd_lambda(dct::Quality quality, double scale){
+        const double lambda_factor = 0.2;
+        double step = scale * dct::get_multiplier(quality, true, true) * dct::luminance.at(0).at(0);
+        return lambda_factor * step;
     }
 
-    /*----- Decompressor Code -----*/
-    void decompress_I_block(std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks, dct::Quality quality, InputBitStream& input_stream){
-        for(u32 count = 0; count < 4; count++){
-            Block8x8 Y_block = dct::array_to_block(stream::read_quantized_array_delta(input_stream));
-            // Unquantize and take the inverse dct
-            Y_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(Y_block, quality, true, false)));
-        }
-        Block8x8 Cb_block = dct::array_to_block(stream::read_quantized_array_delta(input_stream));
-        Cb_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(Cb_block, quality, false, false)));
-
-        Block8x8 Cr_block = dct::array_to_block(stream::read_quantized_array_delta(input_stream));
-        Cr_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(Cr_block, quality, false, false)));
-    }
+    // Sum of squared differences between the source blocks of a macro-block and 6 reconstructed blocks
+    double macroblock_ssd(u32 block_idx, const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks,
+    const std::vector<Block8x8>& Cr_blocks, std::vector<Block8x8>::const_iterator reconstructed);
+
+    // Rate-distortion optimized mode decision. The macro-block is coded as an I-block, as
+    // the P-block found by the motion search (if the field marks it inter) and, in P-frames
+    // of a stream with skip, as a skipped block with the predicted vector. The bits of each
+    // are estimated from the code lengths and the one with the lowest distortion + lambda * bits
+    // is appended to the blocks, the field keeps its motion.
+    // block_idx is the index of the macro-block in the source blocks (its column for the blocks of one row).
+    void rd_compress_macroblock(motion::MotionField& field, u32 macro_idx, u32 block_idx, u32 macroblocks_wide, const motion::ReferenceBuffer& references,
+    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks,
+    const RDSettings& settings, MacroblockScratch& scratch, std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks);
+
+    // Skips the macro-block of a P-frame without a motion search if the prediction at its predicted
+    // vector in reference 0 has a sum of absolute differences of at most max_sad (luma only).
+    // Returns false and leaves the field and the blocks alone otherwise. The prediction is built in the given blocks.
+    bool try_skip_block(motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, const motion::ReferenceBuffer& references,
+    const Block16x16& block, u32 max_sad, std::vector<Block8x8>& prediction, std::vector<Block8x8>& uncompressed_blocks);
+
+    // Whether the samples of a macro-block (the part inside the frame) are the same in both frames
+    bool same_macroblock(YUVFrame420& frame, YUVFrame420& other, u32 macro_idx, u32 macroblocks_wide);
+    // Sends a macro-block which has not changed since reference 0 as a copy of it, without a search or
+    // a transform: in P-frames skipped if the predicted vector is (0,0), otherwise (and in B-frames,
+    // predicted backward) a P-block with no motion and blocks of zeros
+    void static_block(motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, const motion::ReferenceBuffer& references, bool B_frame,
+    std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks);
+
+    // Sends the macro-blocks of one row, the motion of each followed by its 6 blocks (in Y Cb Cr order) unless it is skipped
+    void push_compressed_row(const motion::MotionField& field, u32 row, u32 macroblocks_wide, motion::Precision precision, u32 num_references, bool B_frame,
+    bool partitions, bool skip, const std::vector<Block8x8>& compressed_blocks, OutputBitStream& output_stream);
+
+    // Writes the reconstructed blocks of one row of macro-blocks (6 per macro-block in Y Cb Cr order)
+    // into the frame, which is reused between frames
+    void reconstruct_row(const std::vector<Block8x8>& uncompressed_blocks, u32 row, u32 macroblocks_wide, YUVFrame420& frame);
 
-    void decompress_P_block(std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks, dct::Quality quality, InputBitStream& input_stream, 
-    u32 macro_idx, std::pair<int, int>& motion_vector, YUVFrame420& prev_frame){
+    /*----- Decompressor Code -----*/
 
-        std::vector<Block8x8> prev_blocks;
-        dct::get_prev_blocks(macro_idx, prev_frame, motion_vector, prev_blocks);
+    // Reads the 6 quantized blocks of a macro-block (in Y Cb Cr order)
+    void read_quantized_blocks(std::array<Block8x8, 6>& quantized_blocks, InputBitStream& input_stream);
 
-        for(u32 count = 0; count < 4; count++){
-            // Create a block of delta values
-            Block8x8 delta_block = dct::array_to_block(stream::read_quantized_array_delta(input_stream));
-            // Unquantize and take the inverse dct
-            delta_block = dct::get_inverse_dct(dct::unquantize_block(delta_block, quality, true, true));
-            // Add delta_values to previous block
-            Y_blocks.push_back(dct::add_delta_block(prev_blocks.at(count), delta_block));
-        }
+    // Rebuilds an I-block from the quantized blocks read by read_quantized_blocks. A block_size below 8
+    // only keeps that many of the lowest frequencies and rebuilds the blocks downscaled to that size.
+    void decompress_I_block(std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks, dct::Quality quality, const std::array<Block8x8, 6>& quantized_blocks,
+    double scale = 1, u32 block_size = 8);
 
-        Block8x8 delta_block = dct::array_to_block(stream::read_quantized_array_delta(input_stream));
-        delta_block = dct::get_inverse_dct(dct::unquantize_block(delta_block, quality, false, true));
-        Cb_blocks.push_back(dct::add_delta_block(prev_blocks.at(4), delta_block));
+    // prev_blocks is the prediction of the macro-block (from dct::get_prev_blocks)
+    void decompress_P_block(std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks, dct::Quality quality, const std::array<Block8x8, 6>& quantized_blocks,
+    const std::vector<Block8x8>& prev_blocks, double scale = 1, u32 block_size = 8);
 
-        delta_block = dct::array_to_block(stream::read_quantized_array_delta(input_stream));
-        delta_block = dct::get_inverse_dct(dct::unquantize_block(delta_block, quality, false, true));
-        Cr_blocks.push_back(dct::add_delta_block(prev_blocks.at(5), delta_block));
-    }
+    // Reads the motion of a macro-block sent by push_block_motion into the field
+    void read_block_motion(motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, motion::Precision precision,
+    u32 num_references, bool B_frame, bool partitions, bool skip, InputBitStream& input_stream);
+} // namespace helper
 
-    void read_motion_vectors(std::list<std::pair<int, int>>& motion_vectors, InputBitStream& input_stream){
-        // push number of motiocln vectors
-        int num_vectors = input_stream.read_u16();
-
-        std::pair<int, int> first_vector;
-        if (num_vectors > 0){
-            first_vector.first = stream::read_value_n(input_stream, 4);
-            first_vector.second = stream::read_value_n(input_stream, 4);
-            motion_vectors.push_back(first_vector);
-            num_vectors--;
-        }
-
-        std::pair<int, int> prev_vector = first_vector;
-        while(num_vectors > 0){
-            std::pair<int, int> curr_vector;
-            curr_vector.first = stream::read_delta_value(input_stream) + prev_vector.first;
-            curr_vector.second = stream::read_delta_value(input_stream) + prev_vector.second;
-            motion_vectors.push_back(curr_vector);
-            prev_vector = curr_vector;
-            num_vectors--;
-        }
-    }
-}
+#endif
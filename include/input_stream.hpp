@@ -28,7 +28,7 @@ using u64 = std::uint64_t;
 class InputBitStream{
 public:
     /* Constructor */
-    InputBitStream( std::istream& input_stream ): bitvec{0}, numbits{8}, infile{input_stream}, done{false}, last_real_bit{0} {
+    InputBitStream( std::istream& input_stream ): bitvec{0}, numbits{8}, numbytes{0}, infile{input_stream}, done{false} {
 
     }
 
@@ -64,22 +64,30 @@ public:
     /* Read a single bit b (stored as the LSB of an unsigned int)
        from the stream */
     unsigned int read_bit(){
-        //This has been set up to emit an infinite number of copies
-        //of the last bit once EOF is reached (so if the last bit
-        //in the file is a 1, any subsequent call to read_bit will
-        //return 1).
+        //Once EOF is reached every read returns 0, so a stream which
+        //was cut short ends (a 0 frame flag) instead of decoding an
+        //endless run of 1 bits.
         if (numbits == 8)
             input_byte();
-        if (!done)
-            last_real_bit = (bitvec>>(numbits++))&0x1;
-        
-        return last_real_bit;
+        if (done)
+            return 0;
+        return (bitvec>>(numbits++))&0x1;
     }
 
     /* Flush the currently stored bits*/
     void flush_to_byte(){
         numbits = 8; //Force the next read to read a byte from the input file
     }
+
+    /* True once a read went past the end of the input */
+    bool exhausted() const{
+        return done;
+    }
+
+    /* Total number of bits read so far */
+    u64 bits_read() const{
+        return 8*numbytes + numbits - 8;
+    }
 private:
     void input_byte(){
         char c;
@@ -90,12 +98,13 @@ private:
         }
         bitvec = (unsigned char)c;
         numbits = 0;
+        numbytes++;
     }
     u32 bitvec;
     u32 numbits;
+    u64 numbytes;
     std::istream& infile;
     bool done;
-    unsigned int last_real_bit;
 };
 
 
@@ -0,0 +1,244 @@
+#ifndef MOTION
+#define MOTION
+
+#include <vector>
+#include <deque>
+#include <utility>
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cassert>
+#include "yuv_stream.hpp"
+
+using u32 = std::uint32_t;
+using u8 = std::uint8_t;
+
+namespace motion {
+
+    // Precision of the motion vectors in the bitstream.
+    // Vectors are always stored in quarter-pel units, the precision limits which of them are used.
+    enum Precision {
+        integer = 0,
+        half,
+        quarter,
+        ERROR
+    };
+
+    Precision get_precision(const std::string& input_precision);
+
+    // Prediction of an inter macro-block in a B-frame (P-frames only use forward prediction)
+    enum PredictionMode {
+        forward = 0,        // from a past frame
+        backward,           // from the future frame
+        bidirectional       // average of both
+    };
+
+    // Partition of an inter macro-block of a P-frame, every partition has its own vector
+    enum Partition {
+        whole = 0,      // one 16x16 partition
+        horizontal,     // two 16x8 partitions (top and bottom)
+        vertical,       // two 8x16 partitions (left and right)
+        quarters        // four 8x8 partitions (one per Y block)
+    };
+
+    inline u32 num_partitions(Partition partition){
+        return (partition == whole) ? 1 : (partition == quarters) ? 4 : 2;
+    }
+
+    // partition which covers the 8x8 Y block (0=top-left 1=top-right 2=bottom-left 3=bottom-right)
+    inline u32 partition_of_block(Partition partition, u32 block){
+        if(partition == horizontal)
+            return block / 2;
+        if(partition == vertical)
+            return block % 2;
+        if(partition == quarters)
+            return block;
+        return 0;
+    }
+
+    // Motion of one macro-block, vectors are in quarter-pel units
+    struct BlockMotion {
+        bool inter {false};                 // false for I-blocks
+        PredictionMode mode {forward};
+        u32 reference_idx {0};              // reference of the forward vector
+        std::pair<int, int> vector {0, 0};  // forward vector (the only one in P-frames), the vector of the first partition
+        std::pair<int, int> backward_vector {0, 0};
+        Partition partition {whole};
+        // skipped blocks (P-frames only) use reference 0, the predicted vector and no residual
+        bool skip {false};
+        // vectors of the partitions in order when the macro-block is partitioned
+        std::array<std::pair<int, int>, 4> partition_vectors {};
+    };
+
+    // forward vector of each of the 4 Y blocks of the macro-block
+    inline std::array<std::pair<int, int>, 4> block_vectors(const BlockMotion& motion){
+        if(motion.partition == whole)
+            return {motion.vector, motion.vector, motion.vector, motion.vector};
+        std::array<std::pair<int, int>, 4> vectors;
+        for(u32 block = 0; block < 4; block++)
+            vectors[block] = motion.partition_vectors[partition_of_block(motion.partition, block)];
+        return vectors;
+    }
+
+    // Motion of every macro-block of a frame in row major order
+    using MotionField = std::vector<BlockMotion>;
+
+    // Component-wise median of the vectors of the left, top and top-right (top-left in the
+    // last column) neighbours of the macro-block. Neighbours outside the frame or without a
+    // vector in that direction count as (0,0), except on the first row where the left
+    // neighbour is the prediction.
+    std::pair<int, int> predict_vector(const MotionField& field, u32 macro_idx, u32 macroblocks_wide, bool backward);
+
+    // number of quarter-pel units in one unit of the coded vector
+    inline int precision_step(Precision precision){
+        return 4 >> precision;
+    }
+
+    // Samples of one plane surrounded by a border of replicated edge samples, so that
+    // motion compensation can read up to "border" samples outside of the frame without checks
+    class Plane{
+    public:
+        Plane(u32 width, u32 height, u32 border): width{width}, height{height}, border{border}, stride{width + 2*border} {
+            data.resize(stride * (height + 2*border));
+        }
+        u8& at(int x, int y){
+            return data[(y + border) * stride + (x + border)];
+        }
+        u8 at(int x, int y) const{
+            return data[(y + border) * stride + (x + border)];
+        }
+        const u8* row(int y) const{
+            return &data[(y + border) * stride + border];
+        }
+        // copies the edge samples of the frame into the border
+        void extend_edges();
+
+        u32 get_Width() const{
+            return width;
+        }
+        u32 get_Height() const{
+            return height;
+        }
+
+    private:
+        u32 width, height, border, stride;
+        std::vector<u8> data;
+    };
+
+    /* A reconstructed frame used for motion compensation.
+
+       set_frame() copies the frame into padded planes and, for sub-pel precision,
+       computes the three half-pel luma planes once with the 6-tap filter
+       (1, -5, 20, 20, -5, 1)/32. Quarter-pel luma samples are the rounded average
+       of the neighbouring integer/half-pel samples and chroma samples are bilinear
+       interpolated at eighth-pel positions, both computed on demand.
+
+       With search enabled (compressor only) it also computes the integral image
+       of the padded luma plane, so the sum of any 16x16 block costs four lookups
+       (used to eliminate motion search candidates before computing their SAD).
+    */
+    class ReferenceFrame{
+    public:
+        ReferenceFrame(u32 width, u32 height, bool search = false);
+
+        void set_frame(YUVFrame420& frame, Precision precision);
+        // copies the integer samples back out into a frame of the same size
+        void get_frame(YUVFrame420& frame) const;
+
+        // luma sample at quarter-pel position (qx, qy)
+        int luma(int qx, int qy) const;
+        // chroma sample (plane 0=Cb 1=Cr) at eighth-pel position (ex, ey) of the chroma plane
+        int chroma(u32 plane, int ex, int ey) const;
+        // sample of a plane (0=Y 1=Cb 2=Cr) at position (x, y) in 1/units of a sample, bilinear interpolated
+        // from the integer samples (the finer vectors of downscaled decoding)
+        int bilinear(u32 plane, int x, int y, int units) const;
+
+        // Sum of absolute differences of a 16x16 block against the reference at integer position (x, y).
+        // The sum stops early once it reaches the limit (the result is then only known to be >= limit).
+        u32 sad_16x16(const std::array<std::array<u8, 16>, 16>& block, int x, int y, u32 limit = UINT32_MAX) const;
+        // the same at quarter-pel position (qx, qy)
+        u32 sad_16x16_subpel(const std::array<std::array<u8, 16>, 16>& block, int qx, int qy, u32 limit = UINT32_MAX) const;
+        // sum of the 16x16 luma samples at integer position (x, y), from the integral image (search only)
+        u32 sum_16x16(int x, int y) const;
+        // sums of absolute differences of the four 8x8 quarters of a 16x16 block against the reference
+        // at integer position (x, y), their sum is the SAD of the whole block
+        void sad_8x8_quarters(const std::array<std::array<u8, 16>, 16>& block, int x, int y, std::array<u32, 4>& sads) const;
+        // sum of absolute differences of the part of a 16x16 block starting at (left, top) with the given size,
+        // where the whole block is at quarter-pel position (qx, qy)
+        u32 sad_region_subpel(const std::array<std::array<u8, 16>, 16>& block, int qx, int qy, int left, int top, int cols, int rows) const;
+
+        u32 get_Width() const{
+            return width;
+        }
+        u32 get_Height() const{
+            return height;
+        }
+        Precision get_precision() const{
+            return precision;
+        }
+
+    private:
+        // sample at half-pel position (hx, hy)
+        int half_sample(int hx, int hy) const{
+            return luma_planes[((hy & 1) << 1) | (hx & 1)].at(hx >> 1, hy >> 1);
+        }
+
+        u32 width, height;
+        Precision precision;
+        // 0=integer 1=horizontal half-pel 2=vertical half-pel 3=centre half-pel
+        std::array<Plane, 4> luma_planes;
+        std::array<Plane, 2> chroma_planes;
+        // integral[y * integral_stride + x] is the sum of the padded luma samples above and to the left of (x, y)
+        // (counted from the corner of the border), allowed to wrap around
+        std::vector<u32> integral;
+        u32 integral_stride;
+        // the last rows of unclipped horizontal filter output, kept between frames to avoid reallocating them
+        std::vector<int> filter_rows;
+    };
+
+    /* The reconstructed frames available for prediction.
+
+       The most recent num_short_term frames are kept, plus (if enabled) one
+       long-term frame which stays until another frame is marked long-term.
+       All ReferenceFrames are allocated by the constructor, push() overwrites
+       the slot of a frame which is no longer referenced.
+
+       Reference index 0 is the most recent frame, followed by the older
+       short-term frames and then the long-term frame (unless it is still
+       one of the short-term frames). The compressor and decompressor push
+       the same frames so both see the same indices.
+    */
+    class ReferenceBuffer{
+    public:
+        ReferenceBuffer(u32 width, u32 height, u32 num_short_term, bool long_term, bool search = false);
+
+        void push(YUVFrame420& frame, Precision precision, bool mark_long_term);
+        // drops every reference (at keyframes), the frames stay allocated
+        void clear(){
+            short_term.clear();
+            long_term = -1;
+            active.clear();
+        }
+
+        // number of references currently available
+        u32 size() const{
+            return active.size();
+        }
+        const ReferenceFrame& at(u32 index) const{
+            return pool.at(active.at(index));
+        }
+
+    private:
+        u32 num_short_term;
+        std::vector<ReferenceFrame> pool;
+        // slots of the short-term frames, most recent first
+        std::deque<u32> short_term;
+        // slot of the long-term frame (-1 if there is none)
+        int long_term;
+        // slots in reference index order
+        std::vector<u32> active;
+    };
+
+} // namespace motion
+
+#endif
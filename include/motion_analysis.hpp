@@ -0,0 +1,78 @@
+#ifndef MOTION_ANALYSIS
+#define MOTION_ANALYSIS
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "yuv_stream.hpp"
+#include "motion.hpp"
+#include "helper.hpp"
+#include "uvid.hpp"
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+namespace motion_analysis{
+
+    /* Motion search shared by the renditions of one input (the same video
+       encoded at several qualities).
+
+       The renditions send the same frames in the same order, only their
+       reconstructions differ, so the motion is searched once per frame on
+       the original frames: the analysis keeps references of the input
+       frames like those of an encoder and runs the full search against
+       them. Each rendition then only tries the vector found for the
+       macro-block (next to its usual candidates) against its own
+       reconstruction and refines it by a pixel and the sub-pixel steps.
+
+       Every Encoder given the analysis (EncoderParams::analysis) attaches
+       to it and asks for each frame it sends. The first to ask searches the
+       frame, the result is kept until every encoder has moved past it. The
+       encoders must be driven from one thread and get the same frames, they
+       must have the same frame size and options apart from the quality and
+       rate control.
+    */
+    class SharedAnalysis{
+    public:
+        SharedAnalysis();
+
+        // Called by each encoder, false if its options do not match the first encoder's
+        bool attach(const uvid::EncoderParams& params);
+
+        // Motion of the frame_idx-th frame sent (counted in the order frames are sent) as found
+        // on the input frames. The field is valid until the next call.
+        const motion::MotionField& frame(u64 frame_idx, YUVFrame420& frame, bool B_frame, bool keyframe, bool mark_long_term);
+
+        // Frames searched, once for all renditions
+        u64 frames_searched() const{
+            return num_searched;
+        }
+
+    private:
+        struct AnalysedFrame {
+            u64 frame_idx;
+            u32 remaining;      // encoders which have not asked for it yet
+            motion::MotionField field;
+        };
+
+        void search(YUVFrame420& frame, bool B_frame, bool keyframe, bool mark_long_term, motion::MotionField& field);
+
+        u32 num_users;
+        uvid::EncoderParams params;
+        u32 macroblocks_wide;
+        helper::SearchSettings settings;
+        std::unique_ptr<motion::ReferenceBuffer> references;
+        motion::MotionField previous_field;
+        // only a few frames are kept at a time, they are dropped from the front
+        std::vector<AnalysedFrame> frames;
+        // reused from one frame to the next: the fields of the frames dropped, the blocks of the
+        // row being searched and the buffers of its macro-blocks
+        std::vector<motion::MotionField> spare_fields;
+        std::vector<Block8x8> Y_blocks, Cb_blocks, Cr_blocks;
+        helper::MacroblockScratch scratch;
+        u64 num_searched;
+    };
+
+} // namespace motion_analysis
+
+#endif
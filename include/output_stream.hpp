@@ -28,7 +28,7 @@ using u64 = std::uint64_t;
 class OutputBitStream{
 public:
     /* Constructor */
-    OutputBitStream( std::ostream& output_stream ): bitvec{0}, numbits{0}, outfile{output_stream} {
+    OutputBitStream( std::ostream& output_stream ): bitvec{0}, numbits{0}, numbytes{0}, outfile{output_stream} {
 
     }
 
@@ -89,15 +89,22 @@ public:
             push_bit(fill_bit);
     }
 
+    /* Total number of bits pushed so far (including those not yet output) */
+    u64 bits_written() const{
+        return 8*numbytes + numbits;
+    }
+
 
 private:
     void output_byte(){
         outfile.put((unsigned char)bitvec);
         bitvec = 0;
         numbits = 0;
+        numbytes++;
     }
     u32 bitvec;
     u32 numbits;
+    u64 numbytes;
     std::ostream& outfile;
 };
 
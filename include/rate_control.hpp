@@ -0,0 +1,118 @@
+#ifndef RATE_CONTROL
+#define RATE_CONTROL
+
+#include <string>
+#include <array>
+#include <vector>
+#include <cstdint>
+#include "first_pass.hpp"
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+namespace rate{
+
+    enum Mode {
+        constant_quality = 0,   // every frame uses the same qscale
+        cbr,                    // constant bitrate, the qscale follows the target
+        vbr,                    // the qscale of constant quality, raised only to keep the buffer from overflowing
+        two_pass,               // second pass, the bits are shared out between frames with the first pass costs
+        ERROR
+    };
+
+    Mode get_mode(const std::string& input_mode);
+
+    // Every 8x8 block costs at least 36 bits whatever its quantizer (sign and 16 bits
+    // for the DC and the first AC value followed by the end of block symbol)
+    const u32 min_block_bits = 36;
+
+    /* Chooses the qscale of each frame before it is encoded and is told how many
+       bits it took afterwards.
+
+       The bits of a frame are modelled as the cost of its blocks at the coarsest
+       quantizer plus a complexity divided by scale^1.3, with one complexity for
+       keyframes, P-frames and B-frames which is updated after every frame. The
+       first P-frame after a keyframe has its own complexity, as it predicts from
+       a reference quantized far more coarsely than the following ones.
+
+       The buffer is the decoder buffer of a constant rate channel: the channel
+       adds bitrate/fps bits per frame and decoding a frame removes its bits.
+       The controller keeps the bits the decoder is still waiting for (fullness,
+       half the buffer at the start as the decoder waits for half of it to fill)
+       and never picks a qscale which is predicted to push them past the buffer
+       size, so the decoder never runs out of data. CBR also aims the fullness
+       at half the buffer, VBR only uses it as a cap.
+
+       In the second pass of a two-pass encode the bits of the whole video are
+       known in advance (bitrate times the number of frames of the first pass).
+       Each frame gets an offset from a common qscale which grows with its first
+       pass cost (complex frames cost more bits for the same gain, so they get
+       a coarser quantizer, qscale ~ cost^0.4 as in MPEG-4 style rate control),
+       keyframes get a finer one. Before every frame the common qscale is solved
+       for so that the predicted bits of the frames not sent yet use up the bits
+       left, where the complexity of a frame is its first pass cost times a
+       ratio learned from the frames already sent. A buffer is only enforced
+       when its size is given.
+    */
+    class RateController{
+    public:
+        // A buffer size of 0 means no buffer
+        RateController(Mode mode, u32 base_qscale, double bitrate_kbps, double fps, double buffer_kbits, u32 num_blocks);
+
+        // Costs of every frame (in display order) from the first pass, for two_pass
+        void set_first_pass(const std::vector<first_pass::FrameCost>& frames);
+
+        // frame_idx is the display order index of the frame
+        u32 frame_qscale(u32 frame_idx, bool keyframe, bool B_frame);
+        // Updates the model and the buffer with the bits of the frame encoded with the last qscale
+        void frame_done(u64 bits);
+        // A frame which repeats the one before it (without frame_qscale) only fills the buffer, it
+        // says nothing about the complexity of the frames
+        void frame_repeated(u32 frame_idx, u64 bits);
+
+        double get_fullness() const{
+            return fullness;
+        }
+        // frames which did not fit in the buffer (the model was wrong or even the coarsest qscale did not fit)
+        u32 get_overflows() const{
+            return num_overflows;
+        }
+
+    private:
+        double predicted_bits(u32 type, u32 qscale) const;
+        u32 planned_qscale() const;
+
+        Mode mode;
+        u32 base_qscale;
+        double fps;
+        double bits_per_frame;
+        double buffer_bits;
+        double floor_bits;
+        // 0=keyframe 1=P-frame 2=B-frame 3=first P-frame after a keyframe
+        std::array<double, 4> complexity;
+        std::array<bool, 4> has_complexity;
+        std::array<u32, 4> last_qscale;
+        double fullness;
+        u32 num_overflows;
+        u32 type;
+        // type of the last keyframe or P-frame
+        u32 last_type;
+        u32 qscale;
+
+        // two_pass: first pass cost and qscale offset of every frame, whether it was sent,
+        // the sum of cost/scale(offset)^1.3 of the frames not sent yet and the bits of
+        // complexity per unit of first pass cost (keyframes and other frames)
+        std::vector<first_pass::FrameCost> pass_frames;
+        std::vector<double> pass_offset;
+        std::vector<bool> pass_sent;
+        std::array<double, 2> pass_sum;
+        std::array<double, 2> complexity_per_cost;
+        double remaining_bits;
+        u32 remaining_frames;
+        std::array<u32, 2> num_sent;
+        u32 frame_idx;
+    };
+
+} // namespace rate
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef READ_AHEAD
+#define READ_AHEAD
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include "yuv_stream.hpp"
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+namespace read_ahead{
+
+    /* Reads frames on a background thread ahead of the encoder.
+
+       The frames are read into a ring of depth + 1 buffers which are
+       allocated once: the reader thread fills up to depth of them while the
+       encoder works on the one it was handed last. The ring is a single
+       producer/single consumer queue of two counters, the frames read and the
+       frames released by the encoder, so handing a frame over takes no lock.
+       A side which has to wait (the encoder on an empty ring, the reader on a
+       full one) sleeps on the other side's counter.
+    */
+    class AsyncReader{
+    public:
+        // With y4m the frames come after FRAME lines, the stream header must have been read already
+        AsyncReader(std::istream& stream, u32 width, u32 height, u32 depth, bool y4m = false);
+        // Waits for the read in progress, the stream should be at its end by then
+        ~AsyncReader();
+        AsyncReader(const AsyncReader&) = delete;
+        AsyncReader& operator=(const AsyncReader&) = delete;
+
+        // Releases the previous frame and returns the next one, nullptr at the end of the input.
+        // The frame belongs to the caller until the next call, its contents may be swapped out.
+        YUVFrame420* next_frame();
+        // Number of times the encoder found no frame ready
+        u64 waits() const{
+            return num_waits;
+        }
+
+    private:
+        void run();
+
+        // set in the frames read counter once the input ended
+        static const u64 end_of_input = u64(1) << 63;
+
+        YUVStreamReader reader;
+        std::vector<YUVFrame420> buffers;
+        std::atomic<u64> frames_read;
+        std::atomic<u64> frames_released;
+        std::atomic<bool> stopping;
+        bool holding;
+        u64 num_waits;
+        std::thread worker;
+    };
+
+} // namespace read_ahead
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SCENE
+#define SCENE
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cassert>
+#include "yuv_stream.hpp"
+
+using u32 = std::uint32_t;
+
+namespace scene{
+
+    // Thumbnails are the average of 8x8 blocks of luma samples
+    const u32 thumbnail_scale = 8;
+    const u32 histogram_bins = 32;
+
+    /* Cheap scene change detection, run on each frame right after it is read.
+
+       Every frame is reduced to a thumbnail of its luma and a luma histogram,
+       which are compared with those of the previous frame. A cut needs both a
+       large average difference between the thumbnails (motion alone moves
+       little at this scale) and a large histogram difference (which is blind
+       to motion but not to lighting changes of the same scene).
+    */
+    class SceneDetector{
+    public:
+        SceneDetector(u32 width, u32 height);
+
+        // Returns true if the frame starts a new scene
+        bool is_scene_cut(YUVFrame420& frame);
+
+        // Measures of the last frame passed to is_scene_cut
+        double get_thumbnail_difference() const{
+            return thumbnail_difference;
+        }
+        double get_histogram_difference() const{
+            return histogram_difference;
+        }
+
+    private:
+        u32 width, height, thumbnail_width, thumbnail_height;
+        std::vector<u32> thumbnail, previous_thumbnail;
+        std::array<u32, histogram_bins> histogram, previous_histogram;
+        bool has_previous;
+        double thumbnail_difference, histogram_difference;
+    };
+
+} // namespace scene
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef STATS
+#define STATS
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+using u64 = std::uint64_t;
+
+/* Instrumentation for the compressor and decompressor.
+
+   The STATS_* macros below are the only way the codec should touch this
+   namespace. When the build does not define UVID_STATS they expand to
+   nothing, so none of the timers or counters are compiled in. When it is
+   defined, nothing is recorded unless stats::enable() was called (the
+   --stats option), so the runtime cost is a single branch per macro.
+*/
+namespace stats{
+
+    // Stages timed with a ScopedTimer (seconds and number of calls are reported)
+    enum Stage {
+        read = 0,
+        analysis,
+        partition,
+        motion_search,
+        transform,
+        entropy,
+        reconstruct,
+        write,
+        NUM_STAGES
+    };
+
+    enum Counter {
+        frames = 0,
+        keyframes,
+        skipped_frames,
+        repeated_frames,
+        scene_cuts,
+        I_blocks,
+        P_blocks,
+        partitioned_blocks,
+        skipped_blocks,
+        static_blocks,
+        Y_bits,
+        Cb_bits,
+        Cr_bits,
+        motion_vector_bits,
+        block_flag_bits,
+        reference_index_bits,
+        partition_bits,
+        escape_symbols,
+        early_exits,
+        search_candidates,
+        candidates_eliminated,
+        candidates_aborted,
+        input_waits,
+        shared_searches,
+#ifdef UVID_COUNT_ALLOCATIONS
+        frame_allocations,      // heap allocations while the frames after the first were encoded
+#endif
+        NUM_COUNTERS
+    };
+
+    // Latency of the frames (count, mean and maximum are reported). The compressor measures from
+    // the frame being pushed to its bytes being handed out, the decompressor from the bytes being
+    // pushed to the frame being reconstructed.
+    enum Latency {
+        first_row = 0,      // until the first row of macro-blocks
+        frame,              // until the whole frame
+        NUM_LATENCIES
+    };
+
+    extern bool active;
+
+    // Enables recording, the report goes to stderr if path is "-" and to the file otherwise
+    void enable(const std::string& path);
+    void add_time(Stage stage, std::chrono::steady_clock::duration elapsed);
+    void count(Counter counter, u64 amount);
+    void count_motion_vector(int x, int y);
+    void count_delta(int delta);
+    // frames encoded at each effort level (real-time mode)
+    void count_effort(unsigned int level);
+    void add_latency(Latency latency, std::chrono::steady_clock::duration elapsed);
+    // Heap allocations of every thread so far while recording. They are only counted in programs
+    // built with UVID_COUNT_ALLOCATIONS, whose operator new (allocation_count.cpp) calls count_allocation.
+    u64 allocations();
+    void count_allocation();
+    // Writes the JSON report (if enabled)
+    void report(const std::string& program);
+
+    class ScopedTimer{
+    public:
+        ScopedTimer(Stage stage): stage{stage} {
+            if(active)
+                start = std::chrono::steady_clock::now();
+        }
+        ~ScopedTimer(){
+            if(active)
+                add_time(stage, std::chrono::steady_clock::now() - start);
+        }
+    private:
+        Stage stage;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // Nothing is recorded while a Pause is alive
+    class Pause{
+    public:
+        Pause(): was_active{active} {
+            active = false;
+        }
+        ~Pause(){
+            active = was_active;
+        }
+    private:
+        bool was_active;
+    };
+
+} // namespace stats
+
+#ifdef UVID_STATS
+    #define STATS_TIMER(stage) stats::ScopedTimer stats_timer_##stage {stats::stage}
+    #define STATS_COUNT(counter, amount) do{ if(stats::active) stats::count(stats::counter, (amount)); }while(0)
+    #define STATS_MOTION_VECTOR(x, y) do{ if(stats::active) stats::count_motion_vector((x), (y)); }while(0)
+    #define STATS_DELTAS(deltas) do{ if(stats::active) for(int delta_ : (deltas)) stats::count_delta(delta_); }while(0)
+    #define STATS_EFFORT(level) do{ if(stats::active) stats::count_effort(level); }while(0)
+    #define STATS_LATENCY(latency, elapsed) do{ if(stats::active) stats::add_latency(stats::latency, (elapsed)); }while(0)
+    // Bits of a stream between a STATS_BITS_BEGIN and a STATS_BITS_END of the same mark, the
+    // position is its bits_written() or bits_read()
+    #define STATS_BITS_BEGIN(mark, position) u64 stats_bits_##mark = (position)
+    #define STATS_BITS_END(mark, counter, position) STATS_COUNT(counter, (position) - stats_bits_##mark)
+    #define STATS_ACTIVE (stats::active)
+    #define STATS_PAUSE() stats::Pause stats_pause_
+#else
+    #define STATS_TIMER(stage) do{}while(0)
+    #define STATS_COUNT(counter, amount) do{}while(0)
+    #define STATS_MOTION_VECTOR(x, y) do{}while(0)
+    #define STATS_DELTAS(deltas) do{}while(0)
+    #define STATS_EFFORT(level) do{}while(0)
+    #define STATS_LATENCY(latency, elapsed) do{}while(0)
+    #define STATS_BITS_BEGIN(mark, position) do{}while(0)
+    #define STATS_BITS_END(mark, counter, position) do{}while(0)
+    #define STATS_ACTIVE false
+    #define STATS_PAUSE() do{}while(0)
+#endif
+
+// Heap allocations between the two go to the counter, with UVID_COUNT_ALLOCATIONS only
+#if defined(UVID_STATS) && defined(UVID_COUNT_ALLOCATIONS)
+    #define STATS_ALLOCATIONS_BEGIN(mark) u64 stats_allocations_##mark = stats::allocations()
+    #define STATS_ALLOCATIONS_END(mark, counter) STATS_COUNT(counter, stats::allocations() - stats_allocations_##mark)
+#else
+    #define STATS_ALLOCATIONS_BEGIN(mark) do{}while(0)
+    #define STATS_ALLOCATIONS_END(mark, counter) do{}while(0)
+#endif
+
+#endif
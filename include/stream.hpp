@@ -8,20 +8,35 @@
 #include "input_stream.hpp"
 #include "discrete_cosine_transform.hpp"
 
-// extern std::map<int,int> delta_frequency;
-// extern std::map<int,int> RLE_frequency;
-
-
 namespace stream{
 
-    void print_histograms();
+    // Parameters sent once at the start of the stream
+    struct Header {
+        dct::Quality quality;
+        u16 height;
+        u16 width;
+        motion::Precision precision;
+        u32 num_references;     // short-term reference frames (1 to 8)
+        bool long_term;         // frames can be marked as the long-term reference
+        u32 max_B_frames;       // most B-frames between two reference frames (0 to 7)
+        bool partitions;        // P-blocks of P-frames can be split into partitions
+        bool skip;              // P-blocks of P-frames can be skipped
+        bool low_latency;       // the frame header and every row of macro-blocks end on a byte
+        bool repeat;            // frames can repeat reference 0
+        u16 fps_numerator;      // frame rate as a fraction, for the players
+        u16 fps_denominator;
+    };
+
     void huffman_print();
 
     /* ----- Compressor code -----*/
 
-    void push_header(OutputBitStream& stream, dct::Quality q, u16 height, u16 width);
+    void push_header(OutputBitStream& stream, const Header& header);
     void push_value(OutputBitStream& stream, int num);
     void push_value_n(OutputBitStream& stream, int value, u16 num_bits);
+    void push_reference_index(OutputBitStream& stream, u32 index, u32 num_references);
+    void push_prediction_mode(OutputBitStream& stream, motion::PredictionMode mode);
+    void push_partition(OutputBitStream& stream, motion::Partition partition);
     void push_delta_value(OutputBitStream& stream, int num);
     void push_quantized_array(OutputBitStream& stream, const Array64& array);
     u32 push_RLE_zeros(OutputBitStream& stream, const Array64& array, u32 start);
@@ -29,11 +44,23 @@ namespace stream{
     Array64 quantized_to_delta(const Array64& quantized);
     void push_quantized_array_delta(OutputBitStream& stream, const Array64& array);
 
+    /* ----- Bit cost estimation -----*/
+    // Number of bits the push functions above would write, without writing them
+
+    u32 reference_index_bits(u32 index, u32 num_references);
+    u32 prediction_mode_bits(motion::PredictionMode mode);
+    u32 partition_bits(motion::Partition partition);
+    u32 delta_value_bits(int num);
+    u32 quantized_array_delta_bits(const Array64& array);
+
     /* ----- Decompressor code -----*/
 
-    void read_header(InputBitStream& stream, dct::Quality& quality, u16& height, u16& width);
+    void read_header(InputBitStream& stream, Header& header);
     int read_value(InputBitStream& stream);
     int read_value_n(InputBitStream& stream, u16 num_bits);
+    u32 read_reference_index(InputBitStream& stream, u32 num_references);
+    motion::PredictionMode read_prediction_mode(InputBitStream& stream);
+    motion::Partition read_partition(InputBitStream& stream);
     int read_delta_value(InputBitStream& stream);
     Array64 read_quantized_array(InputBitStream& stream);
     Array64 delta_to_quantized(const Array64& delta);
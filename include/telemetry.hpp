@@ -0,0 +1,72 @@
+#ifndef TELEMETRY
+#define TELEMETRY
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+namespace telemetry{
+
+    // One record is produced by the compressor for every frame (in the order they are sent)
+    struct FrameRecord {
+        u32 frame;
+        double latency_ms;
+        u64 bits;
+        u32 I_blocks;
+        u32 P_blocks;
+        u32 bad_motion_vectors;
+        bool intra_frame;       // a keyframe, every macro-block was forced to be an I-block
+        bool scene_cut;         // the scene change detector fired on this frame
+        bool B_frame;
+        u32 qscale;
+        u64 buffer_bits;        // bits the decoder buffer is still waiting for after the frame (rate control only)
+    };
+
+    /* Writes one JSON line per FrameRecord to a file, a named pipe or an
+       inherited file descriptor ("fd:<n>").
+
+       Records are formatted and written by a background thread. push() never
+       blocks on I/O: when the queue is full (e.g. nobody has opened the other
+       end of a named pipe yet) the record is dropped and counted instead.
+    */
+    class TelemetryWriter{
+    public:
+        TelemetryWriter(const std::string& destination, std::size_t capacity = 1024);
+        ~TelemetryWriter();
+        TelemetryWriter(const TelemetryWriter&) = delete;
+        TelemetryWriter& operator=(const TelemetryWriter&) = delete;
+
+        void push(const FrameRecord& record);
+        // Writes the remaining records and stops the background thread
+        void finish();
+        u64 dropped() const{
+            return num_dropped;
+        }
+
+    private:
+        void run();
+        bool open_destination();
+        void write_record(const FrameRecord& record);
+
+        std::string destination;
+        std::size_t capacity;
+        int fd;
+        bool owns_fd;
+        std::vector<FrameRecord> queue;
+        std::mutex queue_mutex;
+        std::condition_variable queue_ready;
+        bool stopping;
+        std::atomic<u64> num_dropped;
+        std::thread worker;
+    };
+
+} // namespace telemetry
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef THREAD_POOL
+#define THREAD_POOL
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+namespace thread_pool{
+
+    /* A work-stealing pool which the streams of one process share.
+
+       Every worker has its own queue of tasks. A task submitted from a worker
+       goes into that worker's queue and is taken from the back by it (the
+       newest task first, its data is still in the cache), a task submitted
+       from any other thread goes round-robin into the queues. A worker with
+       an empty queue steals the oldest task of another queue. Workers with
+       nothing to do sleep until a task is submitted.
+
+       A thread which needs the results of tasks waits with wait_until, which
+       runs queued tasks in the meantime, so a task may wait for the tasks it
+       submitted without taking a worker away from them.
+    */
+    class ThreadPool{
+    public:
+        explicit ThreadPool(u32 num_threads);
+        // Stops the workers, tasks still queued are not run
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        void submit(std::function<void()> task);
+        // Runs queued tasks until done() returns true, done is checked again after every task
+        // which ends and should be cheap
+        void wait_until(const std::function<bool()>& done);
+
+        u32 size() const{
+            return workers.size();
+        }
+        // Tasks which were taken from another worker's queue
+        u64 steals() const{
+            return num_steals.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        void run(u32 worker_idx);
+        // Runs one task, its own queue first (from the back) and then the other queues
+        // (from the front). Returns false if every queue was empty.
+        bool run_one(u32 queue_idx);
+        void task_done();
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+        std::atomic<u64> pending;       // tasks queued which have not been taken
+        std::atomic<u32> num_waiting;   // threads sleeping in wait_until
+        std::atomic<u32> next_queue;
+        std::atomic<u64> num_steals;
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+        bool stopping;
+    };
+
+} // namespace thread_pool
+
+#endif
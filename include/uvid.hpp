@@ -0,0 +1,148 @@
+#ifndef UVID
+#define UVID
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cassert>
+#include <cstdint>
+#include "yuv_stream.hpp"
+#include "discrete_cosine_transform.hpp"
+#include "motion.hpp"
+#include "rate_control.hpp"
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+namespace thread_pool{
+    class ThreadPool;
+}
+namespace motion_analysis{
+    class SharedAnalysis;
+}
+
+/* The codec as a library (libuvid), which uvid_compress and uvid_decompress
+   are command line front ends of.
+
+   An Encoder takes raw frames with push_frame and gives out the stream in
+   packets with pull_packet, a Decoder takes packets with push_packet and
+   gives out the frames in display order with pull_frame. Packets can be cut
+   anywhere, the decoder keeps what it was given until a whole frame is there.
+   Every Encoder and Decoder is independent, so many streams can run in one
+   process (the --stats counters are shared and only make sense for one).
+
+   Given a thread pool, an Encoder or Decoder splits the work on a frame into
+   rows of macro-blocks which run as tasks of the pool, the output is the
+   same as without one. The calls on one Encoder or Decoder must still come
+   from one thread at a time.
+*/
+namespace uvid{
+
+    // The options of uvid_compress
+    struct EncoderParams {
+        u32 width {0};
+        u32 height {0};
+        dct::Quality quality {dct::Quality::medium};
+        motion::Precision precision {motion::Precision::quarter};
+        u32 num_references {2};
+        u32 long_term_interval {0};     // 0 = no long-term reference
+        u32 max_B_frames {0};
+        u32 keyint_min {8};
+        u32 keyint_max {250};
+        bool partitions {false};
+        bool rdo {false};
+        u32 early_exit {4};             // average difference which stops the motion search
+        double realtime_fps {0};        // 0 = no real-time mode
+        // macro-blocks of P-frames which are the same as in the input of the previous reference frame are
+        // copied without a search, and P-frames which are the same altogether repeat it in a few bits
+        bool static_skip {false};
+        u32 qscale {dct::default_qscale};
+        rate::Mode rate_mode {rate::Mode::constant_quality};   // cbr or vbr, a bitrate alone means cbr
+        double bitrate_kbps {0};
+        double vbv_kbits {0};           // 0 = one second of the bitrate
+        u32 fps_numerator {30};         // frame rate, stored in the stream and used by the rate control
+        u32 fps_denominator {1};
+        u32 pass {0};                   // 1 = analysis only (no packets), 2 = uses the first pass
+        std::string pass_path {"uvid_pass.log"};
+        double target_kbytes {0};       // size of the output of the second pass, instead of a bitrate
+        std::string telemetry_path {};
+        std::string recon_path {};
+        // byte-aligns every row of macro-blocks so that it can be sent (and decoded) before the rest
+        // of the frame, row_sent is then called on the thread pushing the frame after each row and
+        // pull_packet gives the row's bytes
+        bool low_latency {false};
+        std::function<void()> row_sent {};
+        thread_pool::ThreadPool* pool {nullptr};   // runs the rows of macro-blocks, nullptr = the calling thread
+        // motion search shared with the encoders of the other renditions of the input (motion_analysis.hpp)
+        std::shared_ptr<motion_analysis::SharedAnalysis> analysis {};
+    };
+
+    class Encoder{
+    public:
+        // Throws std::invalid_argument for inconsistent parameters and std::runtime_error
+        // if the first pass statistics of a second pass can not be read
+        explicit Encoder(const EncoderParams& params);
+        ~Encoder();
+        Encoder(const Encoder&) = delete;
+        Encoder& operator=(const Encoder&) = delete;
+
+        // Copies the next frame from its planes (width*height luma samples, then a quarter of that for Cb and Cr)
+        void push_frame(const u8* Y, const u8* Cb, const u8* Cr);
+        // Takes the next frame without copying, the frame gets the buffers of one the encoder is done with
+        void push_frame(YUVFrame420& frame);
+        // Sends the frames still waiting for B-frames and ends the stream (writes the first pass
+        // statistics in the first pass, throws std::runtime_error if they can not be written)
+        void finish();
+        // Moves the bytes of the stream produced since the last call into packet, false if there are none
+        bool pull_packet(std::vector<u8>& packet);
+
+        // Frames which did not fit in the decoder buffer (rate control)
+        u32 buffer_overflows() const;
+        // Telemetry records which were dropped
+        u64 telemetry_dropped() const;
+
+    private:
+        class Impl;
+        std::unique_ptr<Impl> impl;
+    };
+
+    class Decoder{
+    public:
+        // The rows of a frame are reconstructed on the pool if there is one. A downscale of 2, 4 or 8
+        // decodes frames of 1/2, 1/4 or 1/8 of the size (1/8 from the DC coefficients alone), much
+        // faster than decoding the whole frames. Throws std::invalid_argument for any other downscale.
+        // With keyframes_only only the keyframes are output, the other frames are skipped unread
+        // (or decoded and dropped in a low-latency stream, which does not send the frame lengths).
+        explicit Decoder(thread_pool::ThreadPool* pool = nullptr, u32 downscale = 1, bool keyframes_only = false);
+        ~Decoder();
+        Decoder(const Decoder&) = delete;
+        Decoder& operator=(const Decoder&) = delete;
+
+        // Appends the next bytes of the stream
+        void push_packet(const u8* data, std::size_t size);
+        // No more packets will come, a stream cut short ends at the last whole frame
+        void finish();
+        // The frame size (of the decoded frames, after the downscale) is known once the header has been pushed
+        bool has_header() const;
+        u32 width() const;
+        u32 height() const;
+        // Frame rate of the stream as a fraction
+        u32 fps_numerator() const;
+        u32 fps_denominator() const;
+        // Decodes the next frame in display order into frame (which should have the size of the
+        // stream, its buffers are swapped rather than copied). Returns false if more packets
+        // are needed or the stream has ended.
+        bool pull_frame(YUVFrame420& frame);
+        // The end of the stream was decoded and every frame was pulled
+        bool done() const;
+
+    private:
+        class Impl;
+        std::unique_ptr<Impl> impl;
+    };
+
+} // namespace uvid
+
+#endif
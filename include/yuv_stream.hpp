@@ -9,6 +9,10 @@
    Note that the stream does not have the resolution encoded into it in any way (so that must be
    provided externally somehow).
 
+   The readers and writers also handle YUV4MPEG2 (.y4m) streams, the same frames with a header
+   line giving the resolution and frame rate, e.g. "YUV4MPEG2 W352 H288 F30000:1001 Ip A1:1 C420jpeg",
+   and a "FRAME" line in front of each frame. Only 4:2:0 streams can be read.
+
    Recall that YUV is a misnomer (it's actually YCbCr since YUV is an analog encoding)
 
    B. Bird - 2023-07-08
@@ -18,8 +22,11 @@
 #define YUV_STREAM_HPP
 
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <array>
+#include <cassert>
 
 class YUVStreamReader;
 class YUVStreamWriter;
@@ -57,6 +64,17 @@ public:
         return Cr_data.at(y*width/chroma_ratio_x + x);
     }
 
+    //Whole planes in row major order (for copying frames in and out)
+    unsigned char* Y_plane(){
+        return Y_data.data();
+    }
+    unsigned char* Cb_plane(){
+        return Cb_data.data();
+    }
+    unsigned char* Cr_plane(){
+        return Cr_data.data();
+    }
+
     unsigned int get_Width() const {
         return width;
     }
@@ -74,9 +92,85 @@ private:
 
 using YUVFrame420 = YUVFrame<2,2>;
 
+//Tags of the header line of a Y4M stream
+struct Y4MHeader{
+    unsigned int width {0};
+    unsigned int height {0};
+    unsigned int fps_numerator {30};
+    unsigned int fps_denominator {1};
+    char interlace {'p'};                   //p = progressive, t/b = top/bottom field first, m = mixed
+    unsigned int aspect_numerator {0};      //pixel aspect ratio, 0:0 = unknown
+    unsigned int aspect_denominator {0};
+    std::string colorspace {"420jpeg"};
+};
+
+//Reads the header line of a Y4M stream, returns false (with the reason in error) if the
+//stream is not Y4M or not 4:2:0
+inline bool read_y4m_header(std::istream& stream, Y4MHeader& header, std::string& error){
+    std::string line;
+    if(!std::getline(stream, line) || line.compare(0, 10, "YUV4MPEG2 ") != 0){
+        error = "not a YUV4MPEG2 stream";
+        return false;
+    }
+    std::istringstream tags {line.substr(10)};
+    for(std::string tag; tags >> tag;){
+        std::istringstream value {tag.substr(1)};
+        char separator = 0;
+        switch(tag.at(0)){
+            case 'W':
+                value >> header.width;
+                break;
+            case 'H':
+                value >> header.height;
+                break;
+            case 'F':
+                value >> header.fps_numerator >> separator >> header.fps_denominator;
+                if(!value || separator != ':' || header.fps_numerator == 0 || header.fps_denominator == 0){
+                    error = "invalid frame rate " + tag;
+                    return false;
+                }
+                break;
+            case 'I':
+                header.interlace = tag.size() > 1 ? tag.at(1) : '?';
+                break;
+            case 'A':
+                value >> header.aspect_numerator >> separator >> header.aspect_denominator;
+                if(!value || separator != ':')
+                    header.aspect_numerator = header.aspect_denominator = 0;
+                break;
+            case 'C':
+                header.colorspace = tag.substr(1);
+                break;
+            default:
+                //X tags (application specific) and unknown tags are skipped
+                break;
+        }
+    }
+    if(header.width == 0 || header.height == 0){
+        error = "the header has no resolution";
+        return false;
+    }
+    //420jpeg, 420mpeg2 and 420paldv only differ in where the chroma samples sit
+    if(header.colorspace != "420" && header.colorspace != "420jpeg" && header.colorspace != "420mpeg2" && header.colorspace != "420paldv"){
+        error = "only 4:2:0 streams with 8-bit samples are supported (C" + header.colorspace + ")";
+        return false;
+    }
+    return true;
+}
+
+inline void write_y4m_header(std::ostream& stream, const Y4MHeader& header){
+    stream << "YUV4MPEG2 W" << header.width << " H" << header.height << " F" << header.fps_numerator << ":" << header.fps_denominator
+           << " I" << header.interlace;
+    if(header.aspect_numerator > 0 && header.aspect_denominator > 0)
+        stream << " A" << header.aspect_numerator << ":" << header.aspect_denominator;
+    stream << " C" << header.colorspace << "\n";
+}
+
 class YUVStreamReader{
 public:
-    YUVStreamReader(std::istream& stream, unsigned int width, unsigned int height): input_stream{stream}, active_frame{width,height}, frame_counter{0U} {
+    //With y4m set, every frame is expected to come after a FRAME line (the stream header must have been read already)
+    YUVStreamReader(std::istream& stream, unsigned int width, unsigned int height, bool y4m = false):
+        input_stream{stream}, active_frame{width,height}, frame_counter{0U}, y4m{y4m} {
         
     }
 
@@ -85,38 +179,55 @@ public:
     }
 
     bool read_next_frame(){
+        return read_frame(active_frame);
+    }
+
+    //Reads the next frame into a frame of the same size owned by the caller
+    bool read_frame(YUVFrame420& frame){
+        if(y4m && !read_frame_header())
+            return false;
         frame_counter++;
-        return read_into_array(active_frame.Y_data) && 
-               read_into_array(active_frame.Cb_data) && 
-               read_into_array(active_frame.Cr_data);
+        return read_into_array(frame.Y_data) && 
+               read_into_array(frame.Cb_data) && 
+               read_into_array(frame.Cr_data);
     }
 
 private:
+    //The FRAME line may have tags of its own, they are skipped
+    bool read_frame_header(){
+        std::string line;
+        if(!std::getline(input_stream, line))
+            return false;
+        return line.compare(0, 5, "FRAME") == 0;
+    }
     bool read_into_array(std::vector<unsigned char>& A){
-        //input_stream.read(&A.at(0),A.size());
-        //return (bool)input_stream;
-        char c;
-        unsigned int i = 0;
-        while(i < A.size() && input_stream.get(c))
-            A.at(i++) = (unsigned char)c;
-        return i == A.size();
+        input_stream.read(reinterpret_cast<char*>(A.data()), A.size());
+        return (unsigned int)input_stream.gcount() == A.size();
     }
     std::istream& input_stream;
     YUVFrame420 active_frame;
     unsigned int frame_counter;
+    bool y4m;
 };
 
 class YUVStreamWriter{
 public:
-    YUVStreamWriter(std::ostream& stream, unsigned int width, unsigned int height): output_stream{stream}, active_frame{width,height}, frame_counter{0U} {
+    YUVStreamWriter(std::ostream& stream, unsigned int width, unsigned int height): output_stream{stream}, active_frame{width,height}, frame_counter{0U}, y4m{false} {
         
     }
+    //Writes a Y4M stream, the header line is written right away
+    YUVStreamWriter(std::ostream& stream, const Y4MHeader& header): output_stream{stream}, active_frame{header.width,header.height}, frame_counter{0U}, y4m{true} {
+        write_y4m_header(output_stream, header);
+    }
 
     YUVFrame420& frame(){
         return active_frame;
     }
 
     bool write_frame(){
+        frame_counter++;
+        if(y4m)
+            output_stream << "FRAME\n";
         return write_from_array(active_frame.Y_data) && 
                write_from_array(active_frame.Cb_data) && 
                write_from_array(active_frame.Cr_data);
@@ -124,15 +235,13 @@ public:
 
 private:
     bool write_from_array(std::vector<unsigned char> const& A){
-        //output_stream.write(&A.at(0), A.size());
-        //return output_stream
-        for(unsigned char c: A)
-            output_stream.put(c);
-        return true;
+        output_stream.write(reinterpret_cast<const char*>(A.data()), A.size());
+        return (bool)output_stream;
     }
     std::ostream& output_stream;
     YUVFrame420 active_frame;
     unsigned int frame_counter;
+    bool y4m;
 };
 
 #endif
\ No newline at end of file
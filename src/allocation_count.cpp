@@ -0,0 +1,27 @@
+/* allocation_count.cpp
+
+   Replaces operator new of a front end built with UVID_COUNT_ALLOCATIONS
+   so that --stats counts the heap allocations of the whole process. It is
+   linked into the programs and never into the library, an application
+   using the library keeps its own allocator. The sized, array and nothrow
+   forms all end up here.
+*/
+
+#include <cstdlib>
+#include <new>
+#include "stats.hpp"
+
+void* operator new(std::size_t size){
+    stats::count_allocation();
+    if(void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept{
+    std::free(memory);
+}
@@ -0,0 +1,542 @@
+#include <deque>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include "uvid.hpp"
+#include "input_stream.hpp"
+#include "stream.hpp"
+#include "helper.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace uvid{
+
+    namespace{
+        // Reads the bytes of the stream which have been pushed so far
+        class ByteBuffer: public std::streambuf{
+        public:
+            ByteBuffer(const std::vector<u8>& bytes, std::size_t start){
+                char* begin = const_cast<char*>(reinterpret_cast<const char*>(bytes.data()));
+                setg(begin + start, begin + start, begin + bytes.size());
+            }
+        };
+
+        // Everything a frame sends, read before anything is reconstructed so that a frame
+        // which is not complete yet can be read again once more bytes have come
+        struct FrameData {
+            bool B_frame;
+            u32 num_B_frames;
+            bool keyframe;
+            bool mark_long_term;
+            bool skipped;           // not decoded (only keyframes are)
+            bool repeat;            // a copy of reference 0, nothing else is sent
+            u32 qscale;
+            u64 end;                // in bits from the front of the buffer, where the next frame starts (not set by low-latency frames)
+            u64 first_row_end;      // in bytes from the start of the stream, for the latency stats
+            motion::MotionField field;
+            std::vector<std::array<Block8x8, 6>> blocks;    // the quantized blocks of each macro-block (unused if skipped)
+        };
+
+        // consumed bytes are dropped from the front of the buffer once there are this many
+        const std::size_t compact_bytes = 1 << 16;
+    }
+
+    class Decoder::Impl{
+    public:
+        Impl(thread_pool::ThreadPool* pool, u32 downscale, bool keyframes_only): finished{false}, has_header{false}, width{0}, height{0}, pool{pool}, downscale{downscale},
+            keyframes_only{keyframes_only}, end_of_stream{false}, bit_position{0}, bytes_dropped{0}, frame_started{false}, rows_read{0}, delayed_keyframe{false}, num_B_frames_pending{0} {
+        }
+
+        void push_packet(const u8* data, std::size_t size){
+            bytes.insert(bytes.end(), data, data + size);
+            if(STATS_ACTIVE)
+                arrivals.emplace_back(bytes_dropped + bytes.size(), std::chrono::steady_clock::now());
+            if(!has_header)
+                read_header();
+        }
+        void finish(){
+            finished = true;
+        }
+        bool pull_frame(YUVFrame420& frame);
+        bool done() const{
+            return end_of_stream && ready.empty();
+        }
+
+        bool finished;
+        bool has_header;
+        stream::Header header;
+        u32 width, height;          // of the decoded frames, the stream's divided by the downscale
+
+    private:
+        bool read_header();
+        bool read_frame();
+        bool parse_frame(FrameData& data);
+        bool read_frame_header(FrameData& data, InputBitStream& input_stream);
+        void read_row(FrameData& data, u32 row, InputBitStream& input_stream);
+        bool read_aligned(const std::function<void(InputBitStream&)>& read);
+        bool read_rows();
+        void decode_frame(FrameData& data);
+        void start_frame(const FrameData& data);
+        YUVFrame420& target_frame(const FrameData& data);
+        void finish_frame(const FrameData& data, YUVFrame420& frame);
+        void decode_blocks(const FrameData& data, YUVFrame420& frame, u32 first_row, u32 end_row);
+        void decode_row(const FrameData& data, u32 row, YUVFrame420& frame);
+        void decode_macroblock(const FrameData& data, u32 macro_idx, std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks);
+        void compact();
+        YUVFrame420 free_frame();
+        std::chrono::steady_clock::time_point arrival(u64 end);
+
+        thread_pool::ThreadPool* pool;
+        // Reduced resolution decoding (1/2, 1/4 or 1/8): every block keeps only its lowest frequencies
+        // and the references are kept at the reduced size, so P-frames do not drift from the I-frames
+        u32 downscale;
+        // Only the keyframes are output. The other frames of a stream with frame lengths are skipped
+        // without being read, those of a low-latency stream (which has none) are still decoded.
+        bool keyframes_only;
+        std::vector<u8> bytes;
+        bool end_of_stream;
+        u64 bit_position;           // in bits, where the next frame starts in bytes
+        u64 bytes_dropped;          // from the front of bytes so far
+        // with --stats, the bytes pushed so far (counted from the start of the stream) after each packet and when it came
+        std::deque<std::pair<u64, std::chrono::steady_clock::time_point>> arrivals;
+        u32 macroblocks_wide;
+        u32 num_macro_blocks;
+        std::unique_ptr<motion::ReferenceBuffer> references;
+        FrameData frame_data;
+
+        // A low-latency frame is read and reconstructed a row at a time as its bytes come in, into
+        // current_frame (or delayed_frame if B-frames follow it)
+        bool frame_started;
+        u32 rows_read;
+        std::unique_ptr<YUVFrame420> current_frame;
+
+        // A reference frame which is followed by B-frames is output after them
+        std::unique_ptr<YUVFrame420> delayed_frame;
+        bool delayed_keyframe;
+        u32 num_B_frames_pending;
+        std::deque<YUVFrame420> ready;
+        std::vector<YUVFrame420> free_frames;
+    };
+
+    bool Decoder::Impl::read_header(){
+        ByteBuffer buffer {bytes, 0};
+        std::istream input {&buffer};
+        InputBitStream input_stream {input};
+        stream::read_header(input_stream, header);
+        if(input_stream.exhausted())
+            return false;
+        bit_position = input_stream.bits_read();
+
+        // calculate number of macro blocks expected
+        u32 scaled_height = header.height/2;
+        u32 scaled_width = header.width/2;
+        u32 C_blocks_wide = (scaled_width%8 == 0) ? scaled_width/8 : (scaled_width/8)+1;
+        u32 C_blocks_high = (scaled_height%8 == 0) ? scaled_height/8 : (scaled_height/8)+1;
+        macroblocks_wide = C_blocks_wide;
+        num_macro_blocks = C_blocks_wide * C_blocks_high;
+
+        // rounded up to even sizes for the chroma planes
+        width = ((header.width + downscale - 1) / downscale + 1) / 2 * 2;
+        height = ((header.height + downscale - 1) / downscale + 1) / 2 * 2;
+        references = std::make_unique<motion::ReferenceBuffer>(width, height, header.num_references, header.long_term);
+        delayed_frame = std::make_unique<YUVFrame420>(width, height);
+        if(header.low_latency)
+            current_frame = std::make_unique<YUVFrame420>(width, height);
+        frame_data.blocks.resize(num_macro_blocks);
+        has_header = true;
+        return true;
+    }
+
+    // Reads the frame which starts at bit_position, returns false (and changes nothing the next
+    // frames depend on) if it goes past the bytes pushed so far. The end of the stream is a frame
+    // flag of 0. The length of the frame tells whether all of it has been pushed before anything
+    // else is read, and lets the frames which are not decoded be skipped (data.skipped).
+    bool Decoder::Impl::parse_frame(FrameData& data){
+        if(bit_position / 8 > bytes.size())
+            return false;
+        ByteBuffer buffer {bytes, bit_position / 8};
+        std::istream input {&buffer};
+        InputBitStream input_stream {input};
+        input_stream.read_bits(bit_position % 8);
+
+        if(!read_frame_header(data, input_stream)){
+            if(input_stream.exhausted())
+                return false;
+            end_of_stream = true;
+            return true;
+        }
+        if(input_stream.exhausted())
+            return false;
+        data.skipped = keyframes_only && !data.keyframe;
+        if(data.skipped || data.repeat){
+            data.first_row_end = bytes_dropped + (data.end + 7) / 8;
+            bit_position = data.end;
+            return true;
+        }
+        if(8 * bytes.size() < data.end)
+            return false;
+        u32 num_rows = num_macro_blocks / macroblocks_wide;
+        for(u32 row = 0; row < num_rows && !input_stream.exhausted(); row++){
+            read_row(data, row, input_stream);
+            if(row == 0)
+                data.first_row_end = bytes_dropped + bit_position / 8 + (input_stream.bits_read() + 7) / 8;
+        }
+        if(input_stream.exhausted())
+            return false;
+        bit_position = data.end;
+        return true;
+    }
+
+    // False if the frame flag is 0, the end of the stream (or if it was not pushed yet)
+    bool Decoder::Impl::read_frame_header(FrameData& data, InputBitStream& input_stream){
+        if(!input_stream.read_bit())
+            return false;
+        // a repeated frame only sends whether it is a B-frame
+        data.repeat = header.repeat && input_stream.read_bit();
+        // the length of the frame (not sent in low-latency streams) is the number of bytes after it
+        if(!data.repeat && !header.low_latency){
+            input_stream.flush_to_byte();
+            u32 length = input_stream.read_u32();
+            data.end = 8 * (bit_position / 8) + input_stream.bits_read() + 8 * u64(length);
+        }
+        data.B_frame = false;
+        data.num_B_frames = 0;
+        if(header.max_B_frames > 0){
+            data.B_frame = input_stream.read_bit();
+            if(!data.B_frame)
+                data.num_B_frames = input_stream.read_bits(3);
+        }
+        if(data.repeat){
+            data.keyframe = false;
+            data.mark_long_term = false;
+            data.end = 8 * (bit_position / 8) + input_stream.bits_read();
+            return true;
+        }
+        // nothing after a keyframe is predicted from the frames before it
+        data.keyframe = !data.B_frame && input_stream.read_bit();
+        data.mark_long_term = header.long_term && !data.B_frame && input_stream.read_bit();
+        data.qscale = input_stream.read_bits(6);
+        data.field.assign(num_macro_blocks, motion::BlockMotion{});
+        return true;
+    }
+
+    // The motion and quantized blocks of the macro-blocks of a row
+    void Decoder::Impl::read_row(FrameData& data, u32 row, InputBitStream& input_stream){
+        u32 num_references = data.keyframe ? 0 : references->size();
+        for(u32 macro_idx = row * macroblocks_wide; macro_idx < (row + 1) * macroblocks_wide && !input_stream.exhausted(); macro_idx++){
+            helper::read_block_motion(data.field, macro_idx, macroblocks_wide, header.precision, num_references, data.B_frame, header.partitions, header.skip, input_stream);
+            const motion::BlockMotion& motion = data.field.at(macro_idx);
+            if(!motion.inter || !motion.skip)
+                helper::read_quantized_blocks(data.blocks.at(macro_idx), input_stream);
+        }
+    }
+
+    // Low-latency streams pad the frame header and every row to a byte. Reads the part which starts
+    // at bit_position and moves past its padding, or returns false (and leaves bit_position) if it
+    // goes past the bytes pushed so far. With --stats it is checked first so that its counts are
+    // only recorded once.
+    bool Decoder::Impl::read_aligned(const std::function<void(InputBitStream&)>& read){
+        auto bytes_used = [&]{
+            ByteBuffer buffer {bytes, bit_position / 8};
+            std::istream input {&buffer};
+            InputBitStream input_stream {input};
+            input_stream.read_bits(bit_position % 8);
+            read(input_stream);
+            return input_stream.exhausted() ? u64(0) : (input_stream.bits_read() + 7) / 8;
+        };
+        if(STATS_ACTIVE && !finished){
+            STATS_PAUSE();
+            if(bytes_used() == 0)
+                return false;
+        }
+        u64 num_bytes = bytes_used();
+        if(num_bytes == 0)
+            return false;
+        bit_position = (bit_position / 8 + num_bytes) * 8;
+        return true;
+    }
+
+    // Reads and reconstructs the rows of the current frame which have been pushed, true once the
+    // frame is done (or the stream has ended)
+    bool Decoder::Impl::read_rows(){
+        if(!frame_started){
+            bool frame_coming = false;
+            if(!read_aligned([&](InputBitStream& input_stream){ frame_coming = read_frame_header(frame_data, input_stream); }))
+                return false;
+            if(!frame_coming){
+                end_of_stream = true;
+                return true;
+            }
+            frame_started = true;
+            rows_read = 0;
+            start_frame(frame_data);
+            if(frame_data.repeat){
+                // a repeated frame is a copy of reference 0
+                frame_started = false;
+                frame_data.first_row_end = bytes_dropped + bit_position / 8;
+                references->at(0).get_frame(target_frame(frame_data));
+                finish_frame(frame_data, target_frame(frame_data));
+                if(STATS_ACTIVE){
+                    STATS_LATENCY(first_row, std::chrono::steady_clock::now() - arrival(frame_data.first_row_end));
+                    STATS_LATENCY(frame, std::chrono::steady_clock::now() - arrival(frame_data.first_row_end));
+                }
+                return true;
+            }
+        }
+        u32 num_rows = num_macro_blocks / macroblocks_wide;
+        u32 first_row = rows_read;
+        while(rows_read < num_rows && read_aligned([&](InputBitStream& input_stream){ read_row(frame_data, rows_read, input_stream); })){
+            if(rows_read == 0)
+                frame_data.first_row_end = bytes_dropped + bit_position / 8;
+            rows_read++;
+        }
+        if(rows_read == first_row)
+            return false;
+        decode_blocks(frame_data, target_frame(frame_data), first_row, rows_read);
+        if(first_row == 0 && STATS_ACTIVE)
+            STATS_LATENCY(first_row, std::chrono::steady_clock::now() - arrival(frame_data.first_row_end));
+        if(rows_read < num_rows)
+            return false;
+        frame_started = false;
+        finish_frame(frame_data, target_frame(frame_data));
+        if(STATS_ACTIVE)
+            STATS_LATENCY(frame, std::chrono::steady_clock::now() - arrival(bytes_dropped + bit_position / 8));
+        return true;
+    }
+
+    YUVFrame420 Decoder::Impl::free_frame(){
+        if(free_frames.empty())
+            return YUVFrame420{width, height};
+        YUVFrame420 frame = std::move(free_frames.back());
+        free_frames.pop_back();
+        return frame;
+    }
+
+    // When the packet which completed the bytes up to end (counted from the start of the stream) was pushed
+    std::chrono::steady_clock::time_point Decoder::Impl::arrival(u64 end){
+        while(arrivals.size() > 1 && arrivals.front().first < end)
+            arrivals.pop_front();
+        return arrivals.empty() ? std::chrono::steady_clock::now() : arrivals.front().second;
+    }
+
+    void Decoder::Impl::decode_macroblock(const FrameData& data, u32 macro_idx, std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks){
+        dct::Quality quality = header.quality;
+        double scale = dct::qscale_to_scale(data.qscale);
+        const motion::BlockMotion& motion = data.field.at(macro_idx);
+        if(!motion.inter){
+            // I-block
+            STATS_COUNT(I_blocks, 1);
+            helper::decompress_I_block(Y_blocks, Cb_blocks, Cr_blocks, quality, data.blocks.at(macro_idx), scale, 8 / downscale);
+        }else if(motion.skip){
+            // skipped block, the prediction is the block
+            STATS_COUNT(P_blocks, 1);
+            std::vector<Block8x8> prediction;
+            helper::get_prediction(macro_idx, *references, motion, prediction, downscale);
+            Y_blocks.insert(Y_blocks.end(), prediction.begin(), prediction.begin() + 4);
+            Cb_blocks.push_back(prediction.at(4));
+            Cr_blocks.push_back(prediction.at(5));
+        }else{
+            //P-block
+            STATS_COUNT(P_blocks, 1);
+            std::vector<Block8x8> prediction;
+            helper::get_prediction(macro_idx, *references, motion, prediction, downscale);
+            helper::decompress_P_block(Y_blocks, Cb_blocks, Cr_blocks, quality, data.blocks.at(macro_idx), prediction, data.B_frame ? scale * dct::B_frame_scale : scale, 8 / downscale);
+        }
+    }
+
+    // The macro-blocks only depend on the references, so each row is reconstructed straight into
+    // the frame. On a pool every row is a task (the first runs on the calling thread).
+    void Decoder::Impl::decode_blocks(const FrameData& data, YUVFrame420& frame, u32 first_row, u32 end_row){
+        if(!pool || end_row - first_row == 1){
+            for(u32 row = first_row; row < end_row; row++)
+                decode_row(data, row, frame);
+            return;
+        }
+        std::atomic<u32> rows_done {0};
+        u32 num_rows = end_row - first_row;
+        for(u32 row = first_row + 1; row < end_row; row++)
+            pool->submit([&, this, row]{
+                decode_row(data, row, frame);
+                // the frame may be gone as soon as the last row is counted
+                rows_done.fetch_add(1);
+            });
+        decode_row(data, first_row, frame);
+        rows_done.fetch_add(1);
+        pool->wait_until([&rows_done, num_rows]{ return rows_done.load() == num_rows; });
+    }
+
+    // The rows write to separate parts of the frame
+    void Decoder::Impl::decode_row(const FrameData& data, u32 row, YUVFrame420& frame){
+        std::vector<Block8x8> Y_blocks, Cb_blocks, Cr_blocks;
+        for(u32 col = 0; col < macroblocks_wide; col++)
+            decode_macroblock(data, row * macroblocks_wide + col, Y_blocks, Cb_blocks, Cr_blocks);
+        STATS_TIMER(reconstruct);
+        u32 size = 8 / downscale;
+        for(u32 col = 0; col < macroblocks_wide; col++){
+            for(u32 block = 0; block < 4; block++)
+                helper::write_block(frame, 0, 2 * size * col + size * (block % 2), 2 * size * row + size * (block / 2), Y_blocks.at(4 * col + block), size);
+            helper::write_block(frame, 1, size * col, size * row, Cb_blocks.at(col), size);
+            helper::write_block(frame, 2, size * col, size * row, Cr_blocks.at(col), size);
+        }
+    }
+
+    void Decoder::Impl::decode_frame(FrameData& data){
+        start_frame(data);
+        if(data.skipped)
+            return;
+        // Create and write into frame
+        if(data.num_B_frames == 0 || keyframes_only)
+            ready.push_back(free_frame());
+        YUVFrame420& active_frame = (data.num_B_frames > 0 && !keyframes_only) ? *delayed_frame : ready.back();
+        // a repeated frame is a copy of reference 0
+        if(data.repeat)
+            references->at(0).get_frame(active_frame);
+        else
+            decode_blocks(data, active_frame, 0, num_macro_blocks / macroblocks_wide);
+        // nothing is predicted from the keyframes when the frames between them are skipped
+        if(!keyframes_only)
+            finish_frame(data, active_frame);
+        if(STATS_ACTIVE){
+            STATS_LATENCY(first_row, std::chrono::steady_clock::now() - arrival(data.first_row_end));
+            STATS_LATENCY(frame, std::chrono::steady_clock::now() - arrival(bytes_dropped + (bit_position + 7) / 8));
+        }
+    }
+
+    void Decoder::Impl::start_frame(const FrameData& data){
+        if(data.skipped){
+            STATS_COUNT(skipped_frames, 1);
+            return;
+        }
+        STATS_COUNT(frames, 1);
+        if(data.repeat)
+            STATS_COUNT(repeated_frames, 1);
+        if(data.keyframe){
+            STATS_COUNT(keyframes, 1);
+            references->clear();
+        }
+    }
+
+    // The frame a low-latency frame is reconstructed into
+    YUVFrame420& Decoder::Impl::target_frame(const FrameData& data){
+        return (data.num_B_frames > 0) ? *delayed_frame : *current_frame;
+    }
+
+    // Keeps the reconstructed frame as a reference (unless it is repeated) and hands it out, the frame
+    // is the back of ready unless it is low-latency or followed by B-frames. Low-latency frames which are not keyframes
+    // are only kept as references with keyframes_only.
+    void Decoder::Impl::finish_frame(const FrameData& data, YUVFrame420& frame){
+        {
+            STATS_TIMER(reconstruct);
+            if(!data.B_frame && !data.repeat)
+                // downscaled references are interpolated from the integer samples
+                references->push(frame, downscale > 1 ? motion::integer : header.precision, data.mark_long_term);
+        }
+        if(header.low_latency && data.num_B_frames == 0 && (data.keyframe || !keyframes_only)){
+            ready.push_back(free_frame());
+            std::swap(ready.back(), frame);
+        }
+        if(data.num_B_frames > 0){
+            num_B_frames_pending = data.num_B_frames;
+            delayed_keyframe = data.keyframe;
+        }else{
+            // the delayed reference frame follows the last of its B-frames
+            if(data.B_frame && num_B_frames_pending > 0 && --num_B_frames_pending == 0 && (delayed_keyframe || !keyframes_only)){
+                YUVFrame420 delayed = free_frame();
+                delayed = *delayed_frame;
+                ready.push_back(std::move(delayed));
+            }
+        }
+    }
+
+    // Decodes the next frame if all of it has been pushed
+    bool Decoder::Impl::read_frame(){
+        if(!has_header && !read_header())
+            return false;
+        if(header.low_latency){
+            if(!read_rows())
+                return false;
+            compact();
+            return true;
+        }
+        // A frame which is not complete yet is read again later, its length is checked before its
+        // rows are read so that their counts are only recorded once
+        if(!parse_frame(frame_data))
+            return false;
+        if(!end_of_stream)
+            decode_frame(frame_data);
+        compact();
+        return true;
+    }
+
+    // A skipped frame can end past the bytes pushed so far, the rest of it is dropped as it comes
+    void Decoder::Impl::compact(){
+        if(bit_position / 8 >= compact_bytes || bit_position / 8 > bytes.size()){
+            u64 drop = std::min<u64>(bit_position / 8, bytes.size());
+            bytes_dropped += drop;
+            bytes.erase(bytes.begin(), bytes.begin() + drop);
+            bit_position -= 8 * drop;
+        }
+    }
+
+    bool Decoder::Impl::pull_frame(YUVFrame420& frame){
+        while(ready.empty() && !end_of_stream && read_frame()){
+        }
+        // a stream which was cut short ends at the last whole frame
+        if(ready.empty() && finished && !end_of_stream)
+            end_of_stream = true;
+        if(ready.empty())
+            return false;
+        std::swap(frame, ready.front());
+        if(ready.front().get_Width() == width && ready.front().get_Height() == height)
+            free_frames.push_back(std::move(ready.front()));
+        ready.pop_front();
+        return true;
+    }
+
+    Decoder::Decoder(thread_pool::ThreadPool* pool, u32 downscale, bool keyframes_only): impl{std::make_unique<Impl>(pool, downscale, keyframes_only)} {
+        if(downscale != 1 && downscale != 2 && downscale != 4 && downscale != 8)
+            throw std::invalid_argument("the downscale must be 1, 2, 4 or 8");
+    }
+
+    Decoder::~Decoder() = default;
+
+    void Decoder::push_packet(const u8* data, std::size_t size){
+        impl->push_packet(data, size);
+    }
+
+    void Decoder::finish(){
+        impl->finish();
+    }
+
+    bool Decoder::has_header() const{
+        return impl->has_header;
+    }
+
+    u32 Decoder::width() const{
+        return impl->width;
+    }
+
+    u32 Decoder::height() const{
+        return impl->height;
+    }
+
+    u32 Decoder::fps_numerator() const{
+        return impl->header.fps_numerator;
+    }
+
+    u32 Decoder::fps_denominator() const{
+        return impl->header.fps_denominator;
+    }
+
+    bool Decoder::pull_frame(YUVFrame420& frame){
+        return impl->pull_frame(frame);
+    }
+
+    bool Decoder::done() const{
+        return impl->done();
+    }
+
+} // namespace uvid
@@ -97,6 +97,15 @@ namespace dct{
         return result;
     }
 
+    // Returns the rounded average of two blocks of samples
+    Block8x8 average_block(const Block8x8& block1, const Block8x8& block2){
+        Block8x8 result;
+        for (u32 r = 0; r < 8; r++)
+            for(u32 c = 0; c < 8; c++)
+                result.at(r).at(c) = (int(block1.at(r).at(c)) + int(block2.at(r).at(c)) + 1) >> 1;
+        return result;
+    }
+
     Block16x16 create_macroblock(const Block8x8& b1, const Block8x8& b2, const Block8x8& b3, const Block8x8& b4){
         Block16x16 macroblock;
         for(u32 b1_r = 0; b1_r < 8; b1_r++){
@@ -122,55 +131,83 @@ namespace dct{
         return macroblock;
     }
 
-    void get_prev_blocks(u32 macro_idx, YUVFrame420& prev_frame, const std::pair<u32, u32>& vector, std::vector<Block8x8>& prev_blocks){
+    // Pushes the motion compensated prediction of a macro-block (4 Y blocks, 1 Cb and 1 Cr block)
+    // The vector is in quarter-pel units, chroma uses the same vector at eighth-pel precision
+    void get_prev_blocks(u32 macro_idx, const motion::ReferenceFrame& reference, const std::pair<int, int>& vector, std::vector<Block8x8>& prev_blocks){
+        get_prev_blocks(macro_idx, reference, {vector, vector, vector, vector}, prev_blocks);
+    }
+
+    // Each Y block is predicted with its own vector and each quarter of the chroma blocks with the
+    // vector of the Y block it covers
+    void get_prev_blocks(u32 macro_idx, const motion::ReferenceFrame& reference, const std::array<std::pair<int, int>, 4>& block_vectors, std::vector<Block8x8>& prev_blocks){
         
-        u32 macroblocks_wide = prev_frame.get_Width() / 16;
+        u32 macroblocks_wide = (reference.get_Width() + 15) / 16;
 
         // (0,0) coordinate of active block in the frame
-        u32 B_x = (macro_idx % macroblocks_wide) * 16;
-        u32 B_y = (macro_idx / macroblocks_wide) * 16;
+        int B_x = (macro_idx % macroblocks_wide) * 16;
+        int B_y = (macro_idx / macroblocks_wide) * 16;
 
-        // (0,0) coordinate of compare block
-        u32 P_x = B_x + vector.first;
-        u32 P_y = B_y + vector.second;
-       
         Block8x8 block;
-        // Push back Y blocks
-        // Top-left Y 8x8 sub-block
-        for(u32 r = 0; r < 8; r++)
-            for(u32 c = 0; c < 8; c++)
-                block.at(r).at(c) = prev_frame.Y(P_x+c, P_y+r);
-        prev_blocks.push_back(block);
-        
-        // Top-right 8x8 sub-block
-        for(u32 r = 0; r < 8; r++)
-            for(u32 c = 0; c < 8; c++)
-                block.at(r).at(c) = prev_frame.Y(P_x+8+c, P_y+r);
-        prev_blocks.push_back(block);
-
-        // Bottom-left 8x8 sub-block
-        for(u32 r = 0; r < 8; r++)
-            for(u32 c = 0; c < 8; c++)
-                block.at(r).at(c) = prev_frame.Y(P_x+c, P_y+8+r);
-        prev_blocks.push_back(block);
-
-        // Bottom-right 8x8 sub-block
-        for(u32 r = 0; r < 8; r++)
-            for(u32 c = 0; c < 8; c++)
-                block.at(r).at(c) = prev_frame.Y(P_x+8+c, P_y+8+r);
-        prev_blocks.push_back(block);
+        // Push back Y blocks (top-left, top-right, bottom-left, bottom-right)
+        for(int sub_r = 0; sub_r < 16; sub_r += 8){
+            for(int sub_c = 0; sub_c < 16; sub_c += 8){
+                // quarter-pel coordinate of compare block
+                const std::pair<int, int>& vector = block_vectors.at((sub_r/8)*2 + sub_c/8);
+                int Q_x = 4*B_x + vector.first;
+                int Q_y = 4*B_y + vector.second;
+                for(int r = 0; r < 8; r++)
+                    for(int c = 0; c < 8; c++)
+                        block.at(r).at(c) = reference.luma(Q_x + 4*(sub_c+c), Q_y + 4*(sub_r+r));
+                prev_blocks.push_back(block);
+            }
+        }
 
-        //Push back Cb block
-        for(u32 r = 0; r < 8; r++)
-            for(u32 c = 0; c < 8; c++)
-                block.at(r).at(c) = prev_frame.Cb((P_x+c)/2,(P_y+r)/2);
-        prev_blocks.push_back(block);
+        // Push back Cb block then Cr block
+        for(u32 plane = 0; plane < 2; plane++){
+            for(int r = 0; r < 8; r++)
+                for(int c = 0; c < 8; c++){
+                    // eighth-pel coordinate of the chroma compare block
+                    const std::pair<int, int>& vector = block_vectors[(r/4)*2 + c/4];
+                    int E_x = 8*(B_x/2) + vector.first;
+                    int E_y = 8*(B_y/2) + vector.second;
+                    block.at(r).at(c) = reference.chroma(plane, E_x + 8*c, E_y + 8*r);
+                }
+            prev_blocks.push_back(block);
+        }
+    }
 
-        // Push back Cr block
-        for(u32 r = 0; r < 8; r++)
-            for(u32 c = 0; c < 8; c++)
-                block.at(r).at(c) = prev_frame.Cr((P_x+c)/2,(P_y+r)/2);
-        prev_blocks.push_back(block);
+    // The prediction of a macro-block in a reference downscaled by 2, 4 or 8 (see uvid::Decoder), each
+    // block is 8/downscale wide in the top-left corner of its Block8x8. The vectors are not rounded,
+    // the samples are bilinear interpolated at their position in 1/(4*downscale) of a luma sample
+    void get_downscaled_prev_blocks(u32 macro_idx, const motion::ReferenceFrame& reference, const std::array<std::pair<int, int>, 4>& block_vectors, u32 downscale, std::vector<Block8x8>& prev_blocks){
+        // the reference is at least 1/downscale of the frame
+        u32 macroblocks_wide = (reference.get_Width() * downscale + 15) / 16;
+        int size = 8 / downscale;
+        int units = 4 * downscale;
+
+        // (0,0) coordinate of active block in the reference
+        int B_x = (macro_idx % macroblocks_wide) * 2 * size;
+        int B_y = (macro_idx / macroblocks_wide) * 2 * size;
+
+        Block8x8 block {};
+        for(int sub_r = 0; sub_r < 2 * size; sub_r += size){
+            for(int sub_c = 0; sub_c < 2 * size; sub_c += size){
+                const std::pair<int, int>& vector = block_vectors.at((sub_r/size)*2 + sub_c/size);
+                for(int r = 0; r < size; r++)
+                    for(int c = 0; c < size; c++)
+                        block.at(r).at(c) = reference.bilinear(0, units*(B_x+sub_c+c) + vector.first, units*(B_y+sub_r+r) + vector.second, units);
+                prev_blocks.push_back(block);
+            }
+        }
+        // chroma vectors are in eighth-pel units, one for each quarter of the block
+        for(u32 plane = 1; plane <= 2; plane++){
+            for(int r = 0; r < size; r++)
+                for(int c = 0; c < size; c++){
+                    const std::pair<int, int>& vector = block_vectors[(2*r/size)*2 + 2*c/size];
+                    block.at(r).at(c) = reference.bilinear(plane, 2*units*(B_x/2+c) + vector.first, 2*units*(B_y/2+r) + vector.second, 2*units);
+                }
+            prev_blocks.push_back(block);
+        }
     }
 
     /* ----- Compressor Functions ----- */
@@ -273,8 +310,9 @@ namespace dct{
     }
 
     // returns the quantized block calculated using the provided quantization matrix at the provided quality 
-    Block8x8 quantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block){
-        double multiplier = get_multiplier(quality, is_luminance, is_P_block);
+    // (scale multiplies the quantization step, B-frames use a coarser step)
+    Block8x8 quantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block, double scale){
+        double multiplier = scale * get_multiplier(quality, is_luminance, is_P_block);
 
         Block8x8 result;
         if(is_luminance){
@@ -354,8 +392,8 @@ namespace dct{
     }
 
     // returns the unquantized block calculated using the provided quantization matrix at the provided quality 
-    Block8x8 unquantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block){
-        double multiplier = get_multiplier(quality, is_luminance, is_P_block);
+    Block8x8 unquantize_block(const Block8x8& block, Quality quality, bool is_luminance, bool is_P_block, double scale){
+        double multiplier = scale * get_multiplier(quality, is_luminance, is_P_block);
 
         Block8x8 result;
         if (is_luminance){
@@ -376,6 +414,44 @@ namespace dct{
         return multiply_block(result, c_matrix);
     }
 
+    // The inverse dct of only the lowest size x size frequencies (size 1, 2, 4 or 8), which is the block
+    // downscaled by 8/size, in the top-left corner of the result. A size of 1 is the DC alone.
+    Block8x8 get_reduced_inverse_dct(const Block8x8& block, u32 size){
+        if(size == 8)
+            return get_inverse_dct(block);
+        Block8x8 result {};
+        // the coefficients of a size-point dct of the average samples are size/8 of those of the 8-point dct
+        double factor = size / 8.0;
+        if(size == 1){
+            result[0][0] = factor * block[0][0];
+            return result;
+        }
+        // the c_matrix for n = 2 and n = 4
+        static const std::array<Block8x8, 2> c_matrices = []{
+            std::array<Block8x8, 2> matrices {};
+            for(u32 n: {2u, 4u})
+                for(u32 r = 0; r < n; r++)
+                    for(u32 col = 0; col < n; col++)
+                        matrices[n / 4][r][col] = (r == 0) ? std::sqrt(1.0/n) : std::sqrt(2.0/n) * std::cos(((2*col+1) * r * M_PI)/(2*n));
+            return matrices;
+        }();
+        const Block8x8& c = c_matrices[size / 4];
+        // [C]_transpose [A] [C] on the top-left corner
+        Block8x8 temp {};
+        for(u32 r = 0; r < size; r++)
+            for(u32 col = 0; col < size; col++)
+                for(u32 idx = 0; idx < size; idx++)
+                    temp[r][col] += c[idx][r] * block[idx][col];
+        for(u32 r = 0; r < size; r++)
+            for(u32 col = 0; col < size; col++){
+                double sum = 0;
+                for(u32 idx = 0; idx < size; idx++)
+                    sum += temp[r][idx] * c[idx][col];
+                result[r][col] = factor * sum;
+            }
+        return result;
+    }
+
     // given a vector of blocks in row major order color reconstructs the channel matrix
     void undo_partition_C_channel(const std::vector<Block8x8>& blocks, u32 height, u32 width, std::vector<std::vector<unsigned char>>& channel){
         u32 idx = 0;
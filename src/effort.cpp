@@ -0,0 +1,73 @@
+#include <algorithm>
+#include "effort.hpp"
+#include "stats.hpp"
+
+namespace effort{
+
+    namespace{
+        // a level is dropped when the encoder is this many frames behind or the average nears the budget
+        const double max_lag = 0.5;
+        const double drop_fraction = 0.95;
+        // a level is raised after this many frames without lag when its average is expected to fit
+        const u32 raise_after = 15;
+        const double raise_fraction = 0.8;
+        // weight of the last frame in the average of a level
+        const double average_weight = 0.2;
+    }
+
+    EffortController::EffortController(double fps, const Level& top): budget{1.0 / fps}, current{0}, lag{0}, frames_at_level{0} {
+        // every level only gives up effort relative to the one above it
+        Level level = top;
+        level.partitions = false;
+        level.skip_sad = 256;
+        Level no_partitions = level;
+
+        level.rdo = false;
+        level.search_references = 1;
+        level.early_exit_sad = std::max(level.early_exit_sad, 6u * 256);
+        level.skip_sad = 2 * 256;
+        Level one_reference = level;
+
+        level.radius = std::min(level.radius, 4);
+        level.early_exit_sad = std::max(level.early_exit_sad, 8u * 256);
+        level.skip_sad = 3 * 256;
+        Level small_radius = level;
+
+        level.full_search = false;
+        level.skip_sad = 4 * 256;
+        Level candidates_only = level;
+
+        levels = {candidates_only, small_radius, one_reference, no_partitions, top};
+        level_seconds.assign(levels.size(), 0);
+        // start at full effort, the first frames show how fast it is
+        current = levels.size() - 1;
+    }
+
+    void EffortController::frame_done(double seconds){
+        STATS_EFFORT(current);
+        double& average = level_seconds.at(current);
+        average = (average == 0) ? seconds : (1 - average_weight) * average + average_weight * seconds;
+        lag = std::max(0.0, lag + seconds - budget);
+        frames_at_level++;
+
+        // the lag only counts while it is still growing, the level below needs a few frames to catch up
+        bool behind = lag > max_lag * budget && seconds > budget;
+        if(current > 0 && (behind || average > drop_fraction * budget)){
+            current--;
+            frames_at_level = 0;
+            return;
+        }
+        if(current + 1 < levels.size() && lag == 0 && frames_at_level >= raise_after){
+            // a level which has not been used yet is assumed to fit
+            double& above = level_seconds.at(current + 1);
+            if(above < raise_fraction * budget){
+                current++;
+            }else{
+                // the content may have become easier since, so the old average slowly fades
+                above *= 0.9;
+            }
+            frames_at_level = 0;
+        }
+    }
+
+} // namespace effort
@@ -0,0 +1,740 @@
+#include <fstream>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <numeric>
+#include "uvid.hpp"
+#include "output_stream.hpp"
+#include "stream.hpp"
+#include "helper.hpp"
+#include "stats.hpp"
+#include "telemetry.hpp"
+#include "scene.hpp"
+#include "first_pass.hpp"
+#include "effort.hpp"
+#include "thread_pool.hpp"
+#include "motion_analysis.hpp"
+
+namespace uvid{
+
+    namespace{
+        // Collects the bytes of the stream until they are pulled as a packet
+        class PacketBuffer: public std::streambuf{
+        public:
+            std::vector<u8> bytes;
+        protected:
+            int_type overflow(int_type c) override{
+                if(c != traits_type::eof())
+                    bytes.push_back(u8(c));
+                return c;
+            }
+        };
+
+        // The second pass needs the first pass and either a bitrate or a size (which is
+        // the same bitrate over the frames of the first pass)
+        std::vector<first_pass::FrameCost> read_first_pass(const EncoderParams& params){
+            std::vector<first_pass::FrameCost> pass_frames;
+            if(params.pass != 2)
+                return pass_frames;
+            if(params.bitrate_kbps <= 0 && params.target_kbytes <= 0)
+                throw std::invalid_argument("the second pass needs a bitrate or a target size");
+            if(!first_pass::read_stats(params.pass_path, params.width, params.height, pass_frames) || pass_frames.empty())
+                throw std::runtime_error("Unable to read the first pass statistics from " + params.pass_path);
+            return pass_frames;
+        }
+
+        double frame_rate(const EncoderParams& params){
+            return double(params.fps_numerator) / params.fps_denominator;
+        }
+
+        EncoderParams checked_params(EncoderParams params, const std::vector<first_pass::FrameCost>& pass_frames){
+            if(params.width == 0 || params.height == 0 || params.width % 2 || params.height % 2 || params.width > 0xffff || params.height > 0xffff)
+                throw std::invalid_argument("the frame size must be even and at most 65535");
+            if(params.fps_numerator == 0 || params.fps_denominator == 0)
+                throw std::invalid_argument("the frame rate must be above 0");
+            u32 divisor = std::gcd(params.fps_numerator, params.fps_denominator);
+            params.fps_numerator /= divisor;
+            params.fps_denominator /= divisor;
+            if(params.fps_numerator > 0xffff || params.fps_denominator > 0xffff)
+                throw std::invalid_argument("the frame rate must be a fraction of numbers up to 65535");
+            if(params.pass == 2){
+                if(params.target_kbytes > 0)
+                    params.bitrate_kbps = 8 * params.target_kbytes * frame_rate(params) / pass_frames.size();
+                params.rate_mode = rate::Mode::two_pass;
+            // A bitrate turns on the rate control (CBR unless VBR was asked for)
+            }else if((params.rate_mode != rate::Mode::constant_quality) != (params.bitrate_kbps > 0)){
+                if(params.bitrate_kbps <= 0)
+                    throw std::invalid_argument("the rate control needs a bitrate");
+                params.rate_mode = rate::Mode::cbr;
+            }
+            if(params.analysis && params.pass > 0)
+                throw std::invalid_argument("renditions can not be encoded in two passes");
+            if(params.vbv_kbits <= 0 && params.rate_mode != rate::Mode::two_pass)
+                params.vbv_kbits = params.bitrate_kbps;
+            // B-frames need a past and a future reference
+            if(params.max_B_frames > 0 && params.num_references < 2)
+                params.num_references = 2;
+            return params;
+        }
+
+        u32 macroblocks_across(u32 size){
+            u32 scaled = size/2;
+            return (scaled%8 == 0) ? scaled/8 : (scaled/8)+1;
+        }
+    }
+
+    class Encoder::Impl{
+    public:
+        Impl(const EncoderParams& input_params);
+
+        // The frame in the lookahead which the next pushed frame goes into
+        YUVFrame420& next_slot(){
+            return lookahead.at(num_buffered);
+        }
+        void frame_pushed();
+        void finish();
+
+        std::vector<u8>& packet_bytes(){
+            return packet_buffer.bytes;
+        }
+        u32 buffer_overflows() const{
+            return rate_controller.get_overflows();
+        }
+        u64 telemetry_dropped() const{
+            return telemetry_writer ? telemetry_writer->dropped() : 0;
+        }
+
+    private:
+        // The source blocks of the row being encoded
+        struct RowBlocks {
+            std::vector<Block8x8> Y, Cb, Cr;
+        };
+
+        // What the macro-blocks of one row produce, each row is sent and reconstructed as soon as
+        // it is done and the rows before it have been sent. There is one for each row in flight,
+        // row r uses row_outputs[r % row_outputs.size()], and they are reused by every frame, so
+        // once the first frames have grown them encoding a frame allocates nothing.
+        struct RowOutput {
+            std::vector<Block8x8> compressed_blocks;
+            std::vector<Block8x8> uncompressed_blocks;
+            u32 num_P_blocks {0};
+            u32 num_bad_motion_vectors {0};
+            RowBlocks blocks;
+            helper::MacroblockScratch scratch;
+        };
+
+        // The frame being encoded, shared by the tasks of its rows
+        struct FrameContext {
+            YUVFrame420& source;
+            YUVFrame420& recon;     // the rows are reconstructed into it once they are sent
+            std::chrono::steady_clock::time_point pushed;   // when the frame was pushed, for the latency stats
+            motion::MotionField& field;
+            const helper::SearchSettings& search;
+            const helper::RDSettings& rd_settings;
+            bool B_frame;
+            bool intra_frame;
+            bool rdo;
+            u32 skip_sad;
+            const motion::MotionField* source_field;    // motion found on the input frames, nullptr without renditions
+            const std::vector<bool>* static_blocks;     // macro-blocks unchanged since reference 0, nullptr without --static
+            std::vector<RowOutput>& row_outputs;
+            // macro-blocks done in each row and rows done, only used on the pool
+            std::vector<std::atomic<u32>>& progress;
+            std::atomic<u32> rows_done {0};
+            // rows started, rows whose row above is far enough to start them and rows sent, a row
+            // only starts once the row which used its output before has been sent
+            std::mutex start_mutex {};
+            u32 rows_started {1};
+            u32 rows_ready {1};
+            u32 rows_sent {0};
+            // summed up as the rows are sent
+            u32 num_P_blocks {0};
+            u32 num_bad_motion_vectors {0};
+        };
+
+        void encode_frame(YUVFrame420& active_frame, u32 display_idx, bool B_frame, u32 num_B_frames, bool keyframe, bool scene_cut,
+            std::chrono::steady_clock::time_point pushed);
+        void encode_rows(FrameContext& frame);
+        void encode_row(FrameContext& frame, u32 row);
+        void start_next_row(FrameContext& frame);
+        void encode_macroblock(FrameContext& frame, u32 macro_idx, RowOutput& output);
+        void send_row(FrameContext& frame, u32 row);
+        void repeat_frame(u32 display_idx, bool B_frame, u32 num_B_frames, bool scene_cut, std::chrono::steady_clock::time_point pushed, std::chrono::steady_clock::time_point frame_start, u64 frame_start_bits);
+        void encode_group(u32 count, bool keyframe);
+        bool is_keyframe(u32 frame_idx, bool scene_cut) const{
+            return frame_idx == 0 || (scene_cut && frame_idx - last_keyframe >= params.keyint_min) || frame_idx - last_keyframe >= params.keyint_max;
+        }
+
+        std::vector<first_pass::FrameCost> pass_frames;
+        EncoderParams params;
+        u32 width, height;
+        u32 macroblocks_wide;
+        u32 num_macro_blocks;
+        u32 num_rows;
+        helper::SearchSettings search_settings;
+        bool long_term;
+        // the real-time mode skips blocks without a search when it runs out of time, --static those
+        // which have not changed
+        bool skip_blocks;
+        PacketBuffer packet_buffer;
+        std::ostream packet_stream;
+        OutputBitStream output_stream;
+
+        // To manage previous frames
+        YUVFrame420 previous_frame;
+        YUVFrame420 B_frame_recon;
+        motion::MotionField previous_field;
+        motion::ReferenceBuffer references;
+        // The motion and row outputs of the frame being encoded, kept from one frame to the next
+        motion::MotionField field;
+        std::vector<RowOutput> row_outputs;
+        std::vector<std::atomic<u32>> progress;
+        rate::RateController rate_controller;
+        // With --static, the input of the last reference frame and which macro-blocks of the frame
+        // being encoded are the same as in it
+        std::unique_ptr<YUVFrame420> static_source;
+        std::vector<bool> static_blocks;
+
+        // Scene cuts become keyframes unless the previous keyframe is too recent
+        scene::SceneDetector detector;
+        u32 last_keyframe;
+        std::unique_ptr<first_pass::Analyzer> analyzer;
+
+        // The reconstructed frames must match the decompressor output exactly
+        std::ofstream recon_file;
+        std::unique_ptr<YUVStreamWriter> recon_writer;
+        std::unique_ptr<effort::EffortController> effort_controller;
+        std::unique_ptr<telemetry::TelemetryWriter> telemetry_writer;
+
+        // Frames wait in the lookahead until the next reference frame has been read, the frames
+        // before it are then sent as B-frames after it. The lookahead is allocated once.
+        std::vector<YUVFrame420> lookahead;
+        std::vector<bool> scene_cuts;
+        std::vector<std::chrono::steady_clock::time_point> push_times;
+        u32 num_buffered;
+        u32 display_idx;
+        u64 frames_sent;
+    };
+
+    Encoder::Impl::Impl(const EncoderParams& input_params):
+        pass_frames{read_first_pass(input_params)}, params{checked_params(input_params, pass_frames)},
+        width{params.width}, height{params.height}, macroblocks_wide{macroblocks_across(width)}, num_macro_blocks{macroblocks_wide * macroblocks_across(height)}, num_rows{macroblocks_across(height)},
+        long_term{params.long_term_interval > 0}, skip_blocks{params.rdo || params.realtime_fps > 0 || params.static_skip}, packet_stream{&packet_buffer}, output_stream{packet_stream},
+        previous_frame{width, height}, B_frame_recon{width, height}, previous_field(num_macro_blocks),
+        references{width, height, params.num_references, long_term, true}, field(num_macro_blocks), row_outputs(1),
+        rate_controller{params.rate_mode, params.qscale, params.bitrate_kbps, frame_rate(params), params.vbv_kbits, 6u * num_macro_blocks}, detector{width, height}, last_keyframe{0},
+        lookahead(params.max_B_frames + 1, YUVFrame420{width, height}), scene_cuts(params.max_B_frames + 1, false),
+        push_times(params.max_B_frames + 1), num_buffered{0}, display_idx{0}, frames_sent{0} {
+        search_settings.partitions = params.partitions;
+        search_settings.early_exit_sad = 256 * params.early_exit;
+        if(params.analysis && !params.analysis->attach(params))
+            throw std::invalid_argument("renditions need the same frame size and prediction options");
+
+        // The first pass only reads the input, finds the keyframes the same way as the second
+        // pass and writes the cost of every frame, no video is output
+        if(params.pass == 1){
+            analyzer = std::make_unique<first_pass::Analyzer>(width, height);
+            return;
+        }
+
+        stream::push_header(output_stream, {params.quality, u16(height), u16(width), params.precision, params.num_references, long_term, params.max_B_frames,
+            search_settings.partitions, skip_blocks, params.low_latency, params.static_skip, u16(params.fps_numerator), u16(params.fps_denominator)});
+        if(params.pass == 2)
+            rate_controller.set_first_pass(pass_frames);
+
+        if(!params.recon_path.empty()){
+            recon_file.open(params.recon_path, std::ios::binary);
+            recon_writer = std::make_unique<YUVStreamWriter>(recon_file, width, height);
+        }
+
+        // The settings given are the highest effort level of the real-time mode
+        if(params.realtime_fps > 0)
+            effort_controller = std::make_unique<effort::EffortController>(params.realtime_fps,
+                effort::Level{search_settings.radius, search_settings.early_exit_sad, true, UINT32_MAX, search_settings.partitions, params.rdo, 0});
+
+        // the rows of a frame only run as a wavefront on a pool, with a row in flight for every
+        // worker and the calling thread
+        if(params.pool && num_rows > 1){
+            progress = std::vector<std::atomic<u32>>(num_rows);
+            row_outputs.resize(std::min(params.pool->size() + 1, num_rows));
+        }
+
+        if(params.static_skip){
+            static_source = std::make_unique<YUVFrame420>(width, height);
+            static_blocks.resize(num_macro_blocks);
+        }
+
+        // Per-frame records are written by a background thread
+        if(!params.telemetry_path.empty())
+            telemetry_writer = std::make_unique<telemetry::TelemetryWriter>(params.telemetry_path);
+    }
+
+    // Scene cuts are found as the frames come in
+    void Encoder::Impl::frame_pushed(){
+        if(analyzer){
+            STATS_TIMER(analysis);
+            u32 frame_idx = pass_frames.size();
+            bool scene_cut = detector.is_scene_cut(next_slot());
+            bool keyframe = is_keyframe(frame_idx, scene_cut);
+            if(keyframe)
+                last_keyframe = frame_idx;
+            pass_frames.push_back(analyzer->analyze(next_slot(), keyframe));
+            pass_frames.back().scene_cut = scene_cut;
+            return;
+        }
+
+        u32 frame_idx = display_idx + num_buffered;
+        bool scene_cut = false;
+        {
+            STATS_TIMER(analysis);
+            scene_cut = detector.is_scene_cut(lookahead.at(num_buffered));
+        }
+        if(scene_cut)
+            STATS_COUNT(scene_cuts, 1);
+        scene_cuts.at(num_buffered) = scene_cut;
+        push_times.at(num_buffered) = std::chrono::steady_clock::now();
+        num_buffered++;
+        if(is_keyframe(frame_idx, scene_cut)){
+            // the frames before the keyframe can not be predicted from it
+            if(num_buffered > 1)
+                encode_group(num_buffered - 1, false);
+            encode_group(1, true);
+            last_keyframe = frame_idx;
+            return;
+        }
+        if(num_buffered == lookahead.size())
+            encode_group(num_buffered, false);
+    }
+
+    void Encoder::Impl::finish(){
+        if(analyzer){
+            if(!first_pass::write_stats(params.pass_path, width, height, pass_frames))
+                throw std::runtime_error("Unable to write the first pass statistics to " + params.pass_path);
+            return;
+        }
+        if(num_buffered > 0)
+            encode_group(num_buffered, false);
+        {
+            STATS_TIMER(write);
+            output_stream.push_bit(0); //Flag to indicate end of data
+            output_stream.flush_to_byte();
+        }
+        if(telemetry_writer)
+            telemetry_writer->finish();
+    }
+
+    // Sends the first count frames of the lookahead, the last of them as the reference frame
+    void Encoder::Impl::encode_group(u32 count, bool keyframe){
+        u32 reference_idx = count - 1;
+        encode_frame(lookahead.at(reference_idx), display_idx + reference_idx, false, reference_idx, keyframe, scene_cuts.at(reference_idx), push_times.at(reference_idx));
+        for(u32 idx = 0; idx < reference_idx; idx++)
+            encode_frame(lookahead.at(idx), display_idx + idx, true, 0, false, scene_cuts.at(idx), push_times.at(idx));
+        if(recon_writer){
+            recon_writer->frame() = previous_frame;
+            recon_writer->write_frame();
+        }
+        // swapping frames moves their buffers without copying
+        for(u32 idx = count; idx < num_buffered; idx++){
+            std::swap(lookahead.at(idx - count), lookahead.at(idx));
+            scene_cuts.at(idx - count) = scene_cuts.at(idx);
+            push_times.at(idx - count) = push_times.at(idx);
+        }
+        num_buffered -= count;
+        display_idx += count;
+    }
+
+    // Sends one frame. B-frames are predicted from the past references and the future
+    // reference frame (reference 0) and are not used as references themselves.
+    // num_B_frames is the number of B-frames which are sent after a reference frame
+    // but come before it in display order. Keyframes only contain I-blocks and drop
+    // all references, so that no later frame depends on a frame before them.
+    void Encoder::Impl::encode_frame(YUVFrame420& active_frame, u32 display_idx, bool B_frame, u32 num_B_frames, bool keyframe, bool scene_cut,
+        std::chrono::steady_clock::time_point pushed){
+        STATS_COUNT(frames, 1);
+        STATS_ALLOCATIONS_BEGIN(frame);
+        dct::Quality quality = params.quality;
+        motion::Precision precision = params.precision;
+        auto frame_start = std::chrono::steady_clock::now();
+        u64 frame_start_bits = output_stream.bits_written();
+        // Flag to indicate that this frame becomes the long-term reference
+        bool mark_long_term = long_term && !B_frame && display_idx % params.long_term_interval == 0;
+        // The renditions of an input share one full search, each only refines the vectors found
+        const motion::MotionField* source_field = nullptr;
+        if(params.analysis)
+            source_field = &params.analysis->frame(frames_sent, active_frame, B_frame, keyframe, mark_long_term);
+        frames_sent++;
+        // With --static the macro-blocks are first compared with the input of reference 0 (the future
+        // reference of B-frames), a frame which is the same everywhere is sent as a repeat of it
+        bool static_frame = static_source && !keyframe;
+        bool repeat = false;
+        if(static_frame){
+            STATS_TIMER(analysis);
+            u32 num_static = 0;
+            for(u32 macro_idx = 0; macro_idx < num_macro_blocks; macro_idx++){
+                static_blocks.at(macro_idx) = helper::same_macroblock(active_frame, *static_source, macro_idx, macroblocks_wide);
+                num_static += static_blocks.at(macro_idx);
+            }
+            repeat = num_static == num_macro_blocks && !mark_long_term;
+        }
+        output_stream.push_bit(1);
+        if(static_source)
+            output_stream.push_bit(repeat);
+        if(repeat){
+            repeat_frame(display_idx, B_frame, num_B_frames, scene_cut, pushed, frame_start, frame_start_bits);
+            return;
+        }
+        // Streams which are not low-latency send the length of every frame in bytes (filled in
+        // once the frame is done, its bytes are only pulled then), so a decoder can skip frames
+        std::size_t length_idx = 0;
+        if(!params.low_latency){
+            output_stream.flush_to_byte();
+            length_idx = packet_bytes().size();
+            output_stream.push_u32(0);
+        }
+        if(params.max_B_frames > 0){
+            output_stream.push_bit(B_frame);
+            if(!B_frame)
+                output_stream.push_bits(num_B_frames, 3);
+        }
+        if(!B_frame){
+            output_stream.push_bit(keyframe);
+            if(keyframe){
+                STATS_COUNT(keyframes, 1);
+                references.clear();
+            }
+        }
+        if(long_term && !B_frame)
+            output_stream.push_bit(mark_long_term);
+        // quantizer scale of the frame
+        u32 frame_qscale = rate_controller.frame_qscale(display_idx, keyframe, B_frame);
+        output_stream.push_bits(frame_qscale, 6);
+        // in low-latency streams every row starts on a byte
+        if(params.low_latency)
+            output_stream.flush_to_byte();
+        double scale = dct::qscale_to_scale(frame_qscale);
+        double P_scale = B_frame ? scale * dct::B_frame_scale : scale;
+        // the effort level only changes how the blocks are chosen, not the syntax of the frame
+        helper::SearchSettings frame_search = search_settings;
+        bool frame_rdo = params.rdo;
+        u32 skip_sad = 0;
+        if(effort_controller){
+            const effort::Level& level = effort_controller->level();
+            frame_search.radius = level.radius;
+            frame_search.early_exit_sad = level.early_exit_sad;
+            frame_search.full_search = level.full_search;
+            frame_search.search_references = level.search_references;
+            frame_search.partitions = search_settings.partitions && level.partitions;
+            frame_rdo = params.rdo && level.rdo;
+            skip_sad = level.skip_sad;
+        }
+        helper::RDSettings rd_settings {quality, scale, P_scale, helper::rd_lambda(quality, P_scale), precision, references.size(), B_frame, search_settings.partitions, skip_blocks};
+
+        // The frame is partitioned, encoded, sent and reconstructed one row of macro-blocks at a
+        // time, only the rows in flight hold blocks. B-frames are output right away, reference frames
+        // after the B-frames which come before them.
+        field.assign(num_macro_blocks, motion::BlockMotion{});
+        bool intra_frame = keyframe;
+        YUVFrame420& recon = B_frame ? B_frame_recon : previous_frame;
+        FrameContext context {active_frame, recon, pushed, field, frame_search, rd_settings, B_frame, intra_frame, frame_rdo, skip_sad, source_field,
+            static_frame ? &static_blocks : nullptr, row_outputs, progress};
+        encode_rows(context);
+        u32 num_P_blocks = context.num_P_blocks;
+        u32 num_bad_motion_vectors = context.num_bad_motion_vectors;
+        // the co-located vectors for the next frame
+        if(!B_frame)
+            previous_field.swap(field);
+
+        if(B_frame && recon_writer){
+            recon_writer->frame() = B_frame_recon;
+            recon_writer->write_frame();
+        }else if(!B_frame){
+            references.push(previous_frame, precision, mark_long_term);
+            if(static_source)
+                *static_source = active_frame;
+        }
+
+        if(!params.low_latency){
+            output_stream.flush_to_byte();
+            u32 frame_length = packet_bytes().size() - length_idx - 4;
+            for(u32 idx = 0; idx < 4; idx++)
+                packet_bytes().at(length_idx + idx) = u8(frame_length >> (8 * idx));
+            // without low latency the bytes of the frame are only handed out once it is done
+            STATS_LATENCY(first_row, std::chrono::steady_clock::now() - pushed);
+            STATS_LATENCY(frame, std::chrono::steady_clock::now() - pushed);
+        }
+        u64 frame_bits = output_stream.bits_written() - frame_start_bits;
+        rate_controller.frame_done(frame_bits);
+        if(frames_sent > 1)
+            STATS_ALLOCATIONS_END(frame, frame_allocations);
+        if(effort_controller){
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - frame_start;
+            effort_controller->frame_done(seconds.count());
+        }
+        if(telemetry_writer){
+            std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - frame_start;
+            telemetry_writer->push({display_idx, latency.count(), frame_bits, num_macro_blocks - num_P_blocks, num_P_blocks,
+                u32(num_bad_motion_vectors), intra_frame, scene_cut, B_frame, frame_qscale, u64(rate_controller.get_fullness())});
+        }
+    }
+
+    // A repeated frame only sends whether it is a B-frame (and the B-frames before a reference frame).
+    // It is shown as a copy of reference 0 and not kept as a reference, the B-frames before a repeated
+    // reference frame are predicted from the references before it, which have the same input.
+    // pushed is only read by the latency stats, frame_start and frame_start_bits by the telemetry and rate control.
+    void Encoder::Impl::repeat_frame(u32 display_idx, bool B_frame, u32 num_B_frames, bool scene_cut, [[maybe_unused]] std::chrono::steady_clock::time_point pushed,
+        std::chrono::steady_clock::time_point frame_start, u64 frame_start_bits){
+        STATS_COUNT(repeated_frames, 1);
+        if(params.max_B_frames > 0){
+            output_stream.push_bit(B_frame);
+            if(!B_frame)
+                output_stream.push_bits(num_B_frames, 3);
+        }
+        // the reconstruction of the last reference frame is reference 0
+        if(B_frame && recon_writer){
+            recon_writer->frame() = previous_frame;
+            recon_writer->write_frame();
+        }
+        if(params.low_latency){
+            output_stream.flush_to_byte();
+            if(params.row_sent)
+                params.row_sent();
+        }
+        STATS_LATENCY(first_row, std::chrono::steady_clock::now() - pushed);
+        STATS_LATENCY(frame, std::chrono::steady_clock::now() - pushed);
+        u64 frame_bits = output_stream.bits_written() - frame_start_bits;
+        rate_controller.frame_repeated(display_idx, frame_bits);
+        if(telemetry_writer){
+            std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - frame_start;
+            telemetry_writer->push({display_idx, latency.count(), frame_bits, 0, num_macro_blocks, 0, false, scene_cut, B_frame, 0, u64(rate_controller.get_fullness())});
+        }
+    }
+
+    // On a pool the rows run as a wavefront: a macro-block is predicted from the blocks to its
+    // left, above and above to the right, so a row can go as far as two blocks behind the row
+    // above it. Each row starts the next one once it is two blocks in and the row output of the
+    // next row is free. The rows are sent in order by the calling thread, which runs other rows
+    // while it waits for the next one.
+    void Encoder::Impl::encode_rows(FrameContext& frame){
+        if(frame.progress.empty()){
+            for(u32 row = 0; row < num_rows; row++){
+                encode_row(frame, row);
+                send_row(frame, row);
+            }
+            return;
+        }
+        for(std::atomic<u32>& done: frame.progress)
+            done.store(0);
+        encode_row(frame, 0);
+        for(u32 row = 0; row < num_rows; row++){
+            std::atomic<u32>& progress = frame.progress.at(row);
+            params.pool->wait_until([&progress, this]{ return progress.load(std::memory_order_acquire) == macroblocks_wide; });
+            send_row(frame, row);
+        }
+        params.pool->wait_until([&frame, this]{ return frame.rows_done.load() == num_rows; });
+    }
+
+    // Only one row is started at a time, by the row above it or by sending the row which used
+    // its output before
+    void Encoder::Impl::start_next_row(FrameContext& frame){
+        std::lock_guard<std::mutex> lock(frame.start_mutex);
+        u32 row = frame.rows_started;
+        if(row >= num_rows || row >= frame.rows_ready || row >= frame.rows_sent + frame.row_outputs.size())
+            return;
+        frame.rows_started++;
+        params.pool->submit([this, &frame, row]{ encode_row(frame, row); });
+    }
+
+    // Sends the motion and compressed blocks of each macro-block of the row and reconstructs it.
+    // A low-latency row is padded to a byte and handed out right away.
+    void Encoder::Impl::send_row(FrameContext& frame, u32 row){
+        RowOutput& output = frame.row_outputs.at(row % frame.row_outputs.size());
+        {
+            STATS_TIMER(entropy);
+            helper::push_compressed_row(frame.field, row, macroblocks_wide, frame.rd_settings.precision, references.size(), frame.B_frame,
+                search_settings.partitions, skip_blocks, output.compressed_blocks, output_stream);
+        }
+        if(params.low_latency){
+            output_stream.flush_to_byte();
+            if(params.row_sent)
+                params.row_sent();
+            if(row == 0)
+                STATS_LATENCY(first_row, std::chrono::steady_clock::now() - frame.pushed);
+            if(row + 1 == num_rows)
+                STATS_LATENCY(frame, std::chrono::steady_clock::now() - frame.pushed);
+        }
+        helper::reconstruct_row(output.uncompressed_blocks, row, macroblocks_wide, frame.recon);
+        frame.num_P_blocks += output.num_P_blocks;
+        frame.num_bad_motion_vectors += output.num_bad_motion_vectors;
+        // the output is free for the row which uses it next
+        if(!frame.progress.empty()){
+            {
+                std::lock_guard<std::mutex> lock(frame.start_mutex);
+                frame.rows_sent = row + 1;
+            }
+            start_next_row(frame);
+        }
+    }
+
+    void Encoder::Impl::encode_row(FrameContext& frame, u32 row){
+        RowOutput& output = frame.row_outputs.at(row % frame.row_outputs.size());
+        output.compressed_blocks.clear();
+        output.uncompressed_blocks.clear();
+        output.num_P_blocks = 0;
+        output.num_bad_motion_vectors = 0;
+        bool wavefront = !frame.progress.empty();
+        // Separate Y Cb and Cr channels and partition them into 8x8 blocks
+        RowBlocks& blocks = output.blocks;
+        // a row which is unchanged everywhere needs none of its blocks
+        bool static_row = frame.static_blocks && std::all_of(frame.static_blocks->begin() + row * macroblocks_wide,
+            frame.static_blocks->begin() + (row + 1) * macroblocks_wide, [](bool same){ return same; });
+        if(!static_row)
+            helper::partition_row(frame.source, row, blocks.Y, blocks.Cb, blocks.Cr);
+        u32 start_next = std::min(2u, macroblocks_wide);
+        for(u32 col = 0; col < macroblocks_wide; col++){
+            if(wavefront && row > 0){
+                std::atomic<u32>& above = frame.progress.at(row - 1);
+                u32 needed = std::min(col + 2, macroblocks_wide);
+                for(u32 done = above.load(std::memory_order_acquire); done < needed; done = above.load(std::memory_order_acquire))
+                    above.wait(done, std::memory_order_acquire);
+            }
+            encode_macroblock(frame, row * macroblocks_wide + col, output);
+            if(!wavefront)
+                continue;
+            frame.progress.at(row).store(col + 1, std::memory_order_release);
+            frame.progress.at(row).notify_one();
+            if(col + 1 == start_next && row + 1 < num_rows){
+                {
+                    std::lock_guard<std::mutex> lock(frame.start_mutex);
+                    frame.rows_ready = row + 2;
+                }
+                start_next_row(frame);
+            }
+        }
+        // the frame may be gone as soon as the last row is counted
+        if(wavefront)
+            frame.rows_done.fetch_add(1);
+    }
+
+    void Encoder::Impl::encode_macroblock(FrameContext& frame, u32 macro_idx, RowOutput& output){
+        const helper::RDSettings& rd_settings = frame.rd_settings;
+        motion::MotionField& field = frame.field;
+        const RowBlocks& blocks = output.blocks;
+        helper::MacroblockScratch& scratch = output.scratch;
+        if(frame.static_blocks && frame.static_blocks->at(macro_idx)){
+            helper::static_block(field, macro_idx, macroblocks_wide, references, frame.B_frame, output.compressed_blocks, output.uncompressed_blocks);
+            STATS_COUNT(P_blocks, 1);
+            STATS_COUNT(static_blocks, 1);
+            output.num_P_blocks++;
+            return;
+        }
+
+        // create 16x16 Y-block, the blocks are those of the row
+        u32 col = macro_idx % macroblocks_wide;
+        u32 Y_idx = 4 * col;
+        Block16x16 macroblock = dct::create_macroblock(blocks.Y.at(Y_idx), blocks.Y.at(Y_idx+1), blocks.Y.at(Y_idx+2), blocks.Y.at(Y_idx+3));
+
+        // Look for motion vector (assume non found), there is nothing to search in an I-frame.
+        // The search starts from the vector predicted from the neighbours, the vector of the
+        // co-located block in the previous reference frame and no motion.
+        motion::BlockMotion& motion = field.at(macro_idx);
+        bool good_motion_vector = false;
+        if(frame.skip_sad > 0 && !frame.B_frame && !frame.intra_frame &&
+            helper::try_skip_block(field, macro_idx, macroblocks_wide, references, macroblock, frame.skip_sad, scratch.prediction, output.uncompressed_blocks)){
+            STATS_COUNT(P_blocks, 1);
+            output.num_P_blocks++;
+            return;
+        }
+        std::vector<std::pair<int,int>>& candidates = scratch.forward_candidates;
+        std::vector<std::pair<int,int>>& backward_candidates = scratch.backward_candidates;
+        if(frame.B_frame){
+            candidates.assign({motion::predict_vector(field, macro_idx, macroblocks_wide, false), {0, 0}});
+            backward_candidates.assign({motion::predict_vector(field, macro_idx, macroblocks_wide, true), {0, 0}});
+            if(frame.source_field && frame.source_field->at(macro_idx).inter){
+                // the vectors found on the input frames are only refined
+                const motion::BlockMotion& source = frame.source_field->at(macro_idx);
+                candidates.push_back(source.vector);
+                backward_candidates.push_back(source.backward_vector);
+                good_motion_vector = helper::find_B_prediction(macroblock, references, macro_idx, candidates, backward_candidates,
+                    helper::refine_settings(frame.search), motion, scratch.prediction);
+            }else{
+                good_motion_vector = helper::find_B_prediction(macroblock, references, macro_idx, candidates, backward_candidates, frame.search, motion,
+                    scratch.prediction);
+            }
+        }else if(!frame.intra_frame){
+            candidates.assign({motion::predict_vector(field, macro_idx, macroblocks_wide, false), {0, 0}});
+            if(previous_field.at(macro_idx).inter)
+                candidates.push_back(previous_field.at(macro_idx).vector);
+            if(frame.source_field && frame.source_field->at(macro_idx).inter)
+                good_motion_vector = helper::refine_reference(macroblock, references, macro_idx, frame.source_field->at(macro_idx), candidates, frame.search, motion);
+            else
+                good_motion_vector = helper::find_reference(macroblock, references, macro_idx, candidates, frame.search, motion);
+        }
+        if(!good_motion_vector && !frame.intra_frame)
+            output.num_bad_motion_vectors++;
+        motion.inter = good_motion_vector;
+
+        if(frame.rdo && !frame.intra_frame){
+            // every searched vector is a candidate, the decision is made on the bits and distortion
+            motion.inter = true;
+            helper::rd_compress_macroblock(field, macro_idx, col, macroblocks_wide, references, blocks.Y, blocks.Cb, blocks.Cr, rd_settings, scratch,
+                output.compressed_blocks, output.uncompressed_blocks);
+            if(motion.inter){
+                STATS_COUNT(P_blocks, 1);
+                output.num_P_blocks++;
+            }else{
+                STATS_COUNT(I_blocks, 1);
+            }
+        }else if (good_motion_vector){
+            STATS_COUNT(P_blocks, 1);
+            output.num_P_blocks++;
+            scratch.prediction.clear();
+            helper::get_prediction(macro_idx, references, motion, scratch.prediction);
+            helper::compress_P_block(output.compressed_blocks, output.uncompressed_blocks, col, blocks.Y, blocks.Cb, blocks.Cr,
+                rd_settings.quality, scratch.prediction, rd_settings.P_scale);
+        }else{
+            STATS_COUNT(I_blocks, 1);
+            helper::compress_I_block(output.compressed_blocks, output.uncompressed_blocks, col, blocks.Y, blocks.Cb, blocks.Cr,
+                rd_settings.quality, rd_settings.I_scale);
+        }
+    }
+
+    Encoder::Encoder(const EncoderParams& params): impl{std::make_unique<Impl>(params)} {
+    }
+
+    Encoder::~Encoder() = default;
+
+    void Encoder::push_frame(const u8* Y, const u8* Cb, const u8* Cr){
+        YUVFrame420& frame = impl->next_slot();
+        u32 luma_size = frame.get_Width() * frame.get_Height();
+        std::copy(Y, Y + luma_size, frame.Y_plane());
+        std::copy(Cb, Cb + luma_size/4, frame.Cb_plane());
+        std::copy(Cr, Cr + luma_size/4, frame.Cr_plane());
+        impl->frame_pushed();
+    }
+
+    void Encoder::push_frame(YUVFrame420& frame){
+        std::swap(impl->next_slot(), frame);
+        impl->frame_pushed();
+    }
+
+    void Encoder::finish(){
+        impl->finish();
+    }
+
+    bool Encoder::pull_packet(std::vector<u8>& packet){
+        packet.clear();
+        packet.swap(impl->packet_bytes());
+        return !packet.empty();
+    }
+
+    u32 Encoder::buffer_overflows() const{
+        return impl->buffer_overflows();
+    }
+
+    u64 Encoder::telemetry_dropped() const{
+        return impl->telemetry_dropped();
+    }
+
+} // namespace uvid
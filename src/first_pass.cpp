@@ -0,0 +1,110 @@
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include "first_pass.hpp"
+
+namespace first_pass{
+
+    namespace{
+        // an inter block has to pay for its motion vector
+        const u32 inter_penalty = 16;
+        const char* stats_header = "uvid-pass1";
+    }
+
+    Analyzer::Analyzer(u32 width, u32 height): has_previous{false} {
+        // half resolution, rounded up to whole 8x8 blocks like the macro-blocks
+        this->width = (width / analysis_scale + 7) / 8 * 8;
+        this->height = (height / analysis_scale + 7) / 8 * 8;
+        samples.resize(this->width * this->height);
+        previous_samples.resize(this->width * this->height);
+    }
+
+    FrameCost Analyzer::analyze(YUVFrame420& frame, bool keyframe){
+        samples.swap(previous_samples);
+        // the samples past the edge of the frame repeat the last row and column
+        u32 frame_width = frame.get_Width(), frame_height = frame.get_Height();
+        for(u32 y = 0; y < height; y++){
+            u32 y0 = std::min(analysis_scale * y, frame_height - 2);
+            for(u32 x = 0; x < width; x++){
+                u32 x0 = std::min(analysis_scale * x, frame_width - 2);
+                u32 sum = frame.Y(x0, y0) + frame.Y(x0+1, y0) + frame.Y(x0, y0+1) + frame.Y(x0+1, y0+1);
+                samples[y * width + x] = (sum + 2) / 4;
+            }
+        }
+
+        FrameCost result {};
+        result.keyframe = keyframe;
+        for(u32 y = 0; y < height; y += 8){
+            for(u32 x = 0; x < width; x += 8){
+                u32 intra = intra_cost(x, y);
+                result.intra_cost += intra;
+                u32 cost = intra;
+                if(!keyframe && has_previous)
+                    cost = std::min(cost, inter_cost(x, y, intra));
+                if(cost == intra)
+                    result.intra_blocks++;
+                result.cost += cost;
+            }
+        }
+        has_previous = true;
+        return result;
+    }
+
+    u32 Analyzer::intra_cost(u32 x, u32 y) const{
+        u32 sum = 0;
+        for(u32 r = 0; r < 8; r++)
+            for(u32 c = 0; c < 8; c++)
+                sum += samples[(y + r) * width + x + c];
+        int mean = (sum + 32) / 64;
+        u32 cost = 0;
+        for(u32 r = 0; r < 8; r++)
+            for(u32 c = 0; c < 8; c++)
+                cost += std::abs(int(samples[(y + r) * width + x + c]) - mean);
+        return cost;
+    }
+
+    u32 Analyzer::inter_cost(u32 x, u32 y, u32 limit) const{
+        u32 best = limit;
+        int min_y = std::max(0, int(y) - search_radius), max_y = std::min(int(height) - 8, int(y) + search_radius);
+        int min_x = std::max(0, int(x) - search_radius), max_x = std::min(int(width) - 8, int(x) + search_radius);
+        for(int ref_y = min_y; ref_y <= max_y; ref_y++){
+            for(int ref_x = min_x; ref_x <= max_x; ref_x++){
+                // the penalty is part of the cost, so the SAD stops once it can no longer win
+                u32 sad = inter_penalty;
+                for(u32 r = 0; r < 8 && sad < best; r++){
+                    const u8* block = &samples[(y + r) * width + x];
+                    const u8* reference = &previous_samples[(ref_y + r) * width + ref_x];
+                    for(u32 c = 0; c < 8; c++)
+                        sad += std::abs(int(block[c]) - int(reference[c]));
+                }
+                best = std::min(best, sad);
+            }
+        }
+        return best;
+    }
+
+    bool write_stats(const std::string& path, u32 width, u32 height, const std::vector<FrameCost>& frames){
+        std::ofstream out {path};
+        if(!out)
+            return false;
+        out << stats_header << " " << width << " " << height << " " << frames.size() << std::endl;
+        for(const FrameCost& frame : frames)
+            out << frame.keyframe << " " << frame.scene_cut << " " << frame.intra_cost << " " << frame.cost << " " << frame.intra_blocks << "\n";
+        return bool(out);
+    }
+
+    bool read_stats(const std::string& path, u32 width, u32 height, std::vector<FrameCost>& frames){
+        std::ifstream in {path};
+        std::string header;
+        u32 file_width = 0, file_height = 0;
+        size_t num_frames = 0;
+        if(!(in >> header >> file_width >> file_height >> num_frames) || header != stats_header || file_width != width || file_height != height)
+            return false;
+        frames.resize(num_frames);
+        for(FrameCost& frame : frames)
+            if(!(in >> frame.keyframe >> frame.scene_cut >> frame.intra_cost >> frame.cost >> frame.intra_blocks))
+                return false;
+        return true;
+    }
+
+} // namespace first_pass
@@ -0,0 +1,883 @@
+#include <iostream>
+#include "helper.hpp"
+#include "uvid.hpp"
+
+namespace helper{
+
+    dct::Quality get_quality(std::string input_quality){
+        if(input_quality == "low")
+            return dct::Quality::low;
+        else if(input_quality == "medium")
+            return dct::Quality::medium;
+        else if(input_quality == "high")
+            return dct::Quality::high;
+        else
+            return dct::Quality::ERROR;
+    }
+
+    bool parse_stats_option(int argc, char** argv, int& idx){
+        if(std::string(argv[idx]) != "--stats")
+            return false;
+        std::string path = "-";
+        if(idx+1 < argc && argv[idx+1][0] != '-')
+            path = argv[++idx];
+#ifdef UVID_STATS
+        stats::enable(path);
+#else
+        std::cerr << "Warning: built without UVID_STATS, --stats is ignored" << std::endl;
+#endif
+        return true;
+    }
+
+    bool parse_frame_rate(const std::string& input, u32& numerator, u32& denominator){
+        std::size_t separator = input.find_first_of("/:.");
+        std::string whole = input.substr(0, separator);
+        std::string rest = (separator == std::string::npos) ? "" : input.substr(separator + 1);
+        auto is_number = [](const std::string& digits){
+            return !digits.empty() && digits.size() <= 9 && digits.find_first_not_of("0123456789") == std::string::npos;
+        };
+        if(!is_number(whole) || (separator != std::string::npos && !is_number(rest)))
+            return false;
+        u32 num = std::stoul(whole), den = 1;
+        if(separator != std::string::npos && input.at(separator) != '.'){
+            den = std::stoul(rest);
+        }else if(separator != std::string::npos){
+            // 29.97 is 2997/100, the encoder reduces the fraction
+            if(rest.size() > 4 || whole.size() + rest.size() > 9)
+                return false;
+            for(char digit: rest){
+                num = 10 * num + (digit - '0');
+                den *= 10;
+            }
+        }
+        if(num == 0 || den == 0)
+            return false;
+        numerator = num;
+        denominator = den;
+        return true;
+    }
+
+    Y4MHeader y4m_header(const uvid::Decoder& decoder){
+        Y4MHeader header;
+        header.width = decoder.width();
+        header.height = decoder.height();
+        header.fps_numerator = decoder.fps_numerator();
+        header.fps_denominator = decoder.fps_denominator();
+        return header;
+    }
+
+    bool parse_encoder_option(int argc, char** argv, int& idx, uvid::EncoderParams& params){
+        std::string arg = argv[idx];
+        if(arg == "--telemetry" && idx+1 < argc){
+            params.telemetry_path = argv[++idx];
+        }else if(arg == "--dump-recon" && idx+1 < argc){
+            params.recon_path = argv[++idx];
+        }else if(arg == "--mv-precision" && idx+1 < argc && motion::get_precision(argv[idx+1]) != motion::Precision::ERROR){
+            params.precision = motion::get_precision(argv[++idx]);
+        }else if(arg == "--refs" && idx+1 < argc && std::stoi(argv[idx+1]) >= 1 && std::stoi(argv[idx+1]) <= 8){
+            params.num_references = std::stoi(argv[++idx]);
+        }else if(arg == "--bframes" && idx+1 < argc && std::stoi(argv[idx+1]) >= 0 && std::stoi(argv[idx+1]) <= 7){
+            params.max_B_frames = std::stoi(argv[++idx]);
+        }else if(arg == "--qscale" && idx+1 < argc && std::stoi(argv[idx+1]) >= 0 && std::stoi(argv[idx+1]) <= int(dct::max_qscale)){
+            params.qscale = std::stoi(argv[++idx]);
+        }else if(arg == "--bitrate" && idx+1 < argc && std::stod(argv[idx+1]) > 0){
+            params.bitrate_kbps = std::stod(argv[++idx]);
+        }else if(arg == "--rate-control" && idx+1 < argc && rate::get_mode(argv[idx+1]) != rate::Mode::ERROR){
+            params.rate_mode = rate::get_mode(argv[++idx]);
+        }else if(arg == "--vbv-size" && idx+1 < argc && std::stod(argv[idx+1]) > 0){
+            params.vbv_kbits = std::stod(argv[++idx]);
+        }else if(arg == "--fps" && idx+1 < argc && parse_frame_rate(argv[idx+1], params.fps_numerator, params.fps_denominator)){
+            idx++;
+        }else if(arg == "--pass" && idx+1 < argc && std::stoi(argv[idx+1]) >= 1 && std::stoi(argv[idx+1]) <= 2){
+            params.pass = std::stoi(argv[++idx]);
+        }else if(arg == "--pass-file" && idx+1 < argc){
+            params.pass_path = argv[++idx];
+        }else if(arg == "--target-size" && idx+1 < argc && std::stod(argv[idx+1]) > 0){
+            params.target_kbytes = std::stod(argv[++idx]);
+        }else if(arg == "--partitions"){
+            params.partitions = true;
+        }else if(arg == "--rdo"){
+            params.rdo = true;
+        }else if(arg == "--low-latency"){
+            params.low_latency = true;
+        }else if(arg == "--static"){
+            params.static_skip = true;
+        }else if(arg == "--realtime" && idx+1 < argc && std::stod(argv[idx+1]) > 0){
+            params.realtime_fps = std::stod(argv[++idx]);
+        }else if(arg == "--early-exit" && idx+1 < argc && std::stoi(argv[idx+1]) >= 0 && std::stoi(argv[idx+1]) <= 255){
+            params.early_exit = std::stoi(argv[++idx]);
+        }else if(arg == "--keyint-min" && idx+1 < argc && std::stoi(argv[idx+1]) >= 1){
+            params.keyint_min = std::stoi(argv[++idx]);
+        }else if(arg == "--keyint-max" && idx+1 < argc && std::stoi(argv[idx+1]) >= 1){
+            params.keyint_max = std::stoi(argv[++idx]);
+        }else if(arg == "--long-term" && idx+1 < argc && std::stoi(argv[idx+1]) >= 0){
+            params.long_term_interval = std::stoi(argv[++idx]);
+        }else{
+            return false;
+        }
+        return true;
+    }
+
+    void partition_row(YUVFrame420& frame, u32 row, std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks){
+        STATS_TIMER(partition);
+        u32 macroblocks_wide = (frame.get_Width() + 15) / 16;
+        Y_blocks.resize(4 * macroblocks_wide);
+        Cb_blocks.resize(macroblocks_wide);
+        Cr_blocks.resize(macroblocks_wide);
+        // the frame repeats its last row and column for samples past the edges
+        for(u32 col = 0; col < macroblocks_wide; col++){
+            for(u32 block = 0; block < 4; block++){
+                u32 left = 16 * col + 8 * (block % 2), top = 16 * row + 8 * (block / 2);
+                Block8x8& Y_block = Y_blocks.at(4 * col + block);
+                for(u32 r = 0; r < 8; r++)
+                    for(u32 c = 0; c < 8; c++)
+                        Y_block[r][c] = frame.Y(left + c, top + r);
+            }
+            for(u32 r = 0; r < 8; r++)
+                for(u32 c = 0; c < 8; c++){
+                    Cb_blocks.at(col)[r][c] = frame.Cb(8 * col + c, 8 * row + r);
+                    Cr_blocks.at(col)[r][c] = frame.Cr(8 * col + c, 8 * row + r);
+                }
+        }
+    }
+
+    void write_block(YUVFrame420& frame, u32 plane, u32 x, u32 y, const Block8x8& block, u32 size){
+        u32 width = (plane == 0) ? frame.get_Width() : frame.get_Width() / 2;
+        u32 height = (plane == 0) ? frame.get_Height() : frame.get_Height() / 2;
+        u8* samples = (plane == 0) ? frame.Y_plane() : (plane == 1) ? frame.Cb_plane() : frame.Cr_plane();
+        if(x >= width || y >= height)
+            return;
+        u32 cols = std::min(size, width - x), rows = std::min(size, height - y);
+        for(u32 r = 0; r < rows; r++)
+            for(u32 c = 0; c < cols; c++)
+                samples[(y + r) * width + x + c] = dct::round_and_clamp_to_char(block[r][c]);
+    }
+
+    u32 find_motion_vector(const Block16x16& block, const motion::ReferenceFrame& reference, u32 macro_idx, std::pair<int,int>& vector,
+    const std::vector<std::pair<int,int>>& candidates, const SearchSettings& settings){
+        STATS_TIMER(motion_search);
+        int width = reference.get_Width();
+        int height = reference.get_Height();
+        u32 macroblocks_wide = (width + 15) / 16;
+        int radius = settings.radius;
+
+        // (0,0) coordinate of active block in the frame
+        int B_x = (macro_idx % macroblocks_wide) * 16;
+        int B_y = (macro_idx / macroblocks_wide) * 16;
+
+        std::array<std::array<u8, 16>, 16> samples;
+        u32 block_sum = 0;
+        for(u32 r = 0; r < 16; r++)
+            for(u32 c = 0; c < 16; c++){
+                samples[r][c] = u8(block.at(r).at(c));
+                block_sum += samples[r][c];
+            }
+
+        u32 min_sad {UINT32_MAX};
+        // Candidates are kept inside the same region as the full search
+        for(const std::pair<int,int>& candidate : candidates){
+            int v_x = std::clamp(candidate.first, -4*B_x, 4*(width-1-B_x));
+            int v_y = std::clamp(candidate.second, -4*B_y, 4*(height-1-B_y));
+            u32 sad = reference.sad_16x16_subpel(samples, 4*B_x + v_x, 4*B_y + v_y, min_sad);
+            if(sad < min_sad){
+                min_sad = sad;
+                vector = {v_x, v_y};
+            }
+        }
+        bool early_exit = min_sad <= settings.early_exit_sad || !settings.full_search;
+        if(early_exit)
+            STATS_COUNT(early_exits, 1);
+
+        if(!early_exit){
+            // Search region boundaries (radius of 8)
+            int v_x_min = (B_x-radius < 0)? 0 : B_x-radius;
+            int v_x_max = (B_x+radius < width) ? B_x+radius : width;
+            int v_y_min = (B_y-radius < 0)? 0 : B_y-radius;
+            int v_y_max = (B_y+radius < height) ? B_y+radius : height;
+
+            // Look for motion vectors
+            u64 num_candidates {0};
+            u64 num_eliminated {0};
+            u64 num_aborted {0};
+            for(int v_x = v_x_min; v_x < v_x_max && min_sad > settings.early_exit_sad; v_x++){
+                for(int v_y = v_y_min; v_y < v_y_max && min_sad > settings.early_exit_sad; v_y++){
+                    num_candidates++;
+                    // |sum(block) - sum(reference)| is a lower bound of the SAD
+                    u32 bound = std::abs(int(block_sum) - int(reference.sum_16x16(v_x, v_y)));
+                    if(bound >= min_sad){
+                        num_eliminated++;
+                        continue;
+                    }
+                    u32 sad = reference.sad_16x16(samples, v_x, v_y, min_sad);
+                    if(sad >= min_sad)
+                        num_aborted++;
+                    // update the minimum value
+                    if(sad < min_sad){
+                        min_sad = sad;
+                        vector.first = 4*(v_x - B_x);
+                        vector.second= 4*(v_y - B_y);
+                    }
+                }
+            }
+            STATS_COUNT(search_candidates, num_candidates);
+            STATS_COUNT(candidates_eliminated, num_eliminated);
+            STATS_COUNT(candidates_aborted, num_aborted);
+        }
+
+        // Refine around the best vector (in whole pixel steps first after an early exit)
+        // in half-pel and then quarter-pel steps
+        int first_step = settings.finest_step_only ? motion::precision_step(reference.get_precision()) : early_exit ? 4 : 2;
+        for(int step = first_step; step >= motion::precision_step(reference.get_precision()); step /= 2){
+            std::pair<int, int> centre = vector;
+            for(int d_y = -1; d_y <= 1; d_y++){
+                for(int d_x = -1; d_x <= 1; d_x++){
+                    if(d_x == 0 && d_y == 0)
+                        continue;
+                    int v_x = centre.first + d_x*step;
+                    int v_y = centre.second + d_y*step;
+                    u32 sad = reference.sad_16x16_subpel(samples, 4*B_x + v_x, 4*B_y + v_y, min_sad);
+                    if(sad < min_sad){
+                        min_sad = sad;
+                        vector = {v_x, v_y};
+                    }
+                }
+            }
+        }
+
+        return min_sad;
+    }
+
+    u32 find_partitions(const Block16x16& block, const motion::ReferenceFrame& reference, u32 macro_idx, u32 whole_sad,
+    const SearchSettings& settings, motion::BlockMotion& motion){
+        STATS_TIMER(motion_search);
+        // roughly the SAD worth one bit, a vector costs about 6 bits
+        const u32 bit_cost = 32;
+        const u32 vector_cost = 6*bit_cost;
+        int width = reference.get_Width();
+        int height = reference.get_Height();
+        u32 macroblocks_wide = (width + 15) / 16;
+        int radius = settings.radius;
+        int B_x = (macro_idx % macroblocks_wide) * 16;
+        int B_y = (macro_idx / macroblocks_wide) * 16;
+
+        std::array<std::array<u8, 16>, 16> samples;
+        for(u32 r = 0; r < 16; r++)
+            for(u32 c = 0; c < 16; c++)
+                samples[r][c] = u8(block.at(r).at(c));
+
+        // Shapes are the top, bottom, left and right halves followed by the four quarters,
+        // each made of the quarters in its mask
+        const std::array<u32, 8> masks {0b0011, 0b1100, 0b0101, 0b1010, 0b0001, 0b0010, 0b0100, 0b1000};
+        std::array<u32, 8> best_sad;
+        best_sad.fill(UINT32_MAX);
+        std::array<std::pair<int, int>, 8> best_vector {};
+
+        int v_x_min = (B_x-radius < 0)? 0 : B_x-radius;
+        int v_x_max = (B_x+radius < width) ? B_x+radius : width;
+        int v_y_min = (B_y-radius < 0)? 0 : B_y-radius;
+        int v_y_max = (B_y+radius < height) ? B_y+radius : height;
+        std::array<u32, 4> quarter_sads;
+        for(int v_x = v_x_min; v_x < v_x_max; v_x++){
+            for(int v_y = v_y_min; v_y < v_y_max; v_y++){
+                reference.sad_8x8_quarters(samples, v_x, v_y, quarter_sads);
+                for(u32 shape = 0; shape < 8; shape++){
+                    u32 sad = 0;
+                    for(u32 quarter = 0; quarter < 4; quarter++)
+                        if(masks[shape] & (1 << quarter))
+                            sad += quarter_sads[quarter];
+                    if(sad < best_sad[shape]){
+                        best_sad[shape] = sad;
+                        best_vector[shape] = {4*(v_x - B_x), 4*(v_y - B_y)};
+                    }
+                }
+            }
+        }
+
+        // shapes which make up each partition, in the order of the partitions
+        static const std::array<std::vector<u32>, 4> partition_shapes {{ {}, {0, 1}, {2, 3}, {4, 5, 6, 7} }};
+        motion::Partition partition = motion::Partition::whole;
+        u32 min_cost = UINT32_MAX;
+        for(u32 candidate = motion::Partition::horizontal; candidate <= motion::Partition::quarters; candidate++){
+            u32 cost = (candidate + 1)*bit_cost + (partition_shapes[candidate].size() - 1)*vector_cost;
+            for(u32 shape : partition_shapes[candidate])
+                cost += best_sad[shape];
+            if(cost < min_cost){
+                min_cost = cost;
+                partition = motion::Partition(candidate);
+            }
+        }
+
+        // Refine each partition in half-pel and then quarter-pel steps
+        u32 partition_sad = 0;
+        std::array<std::pair<int, int>, 4> vectors {};
+        for(u32 idx = 0; idx < partition_shapes[partition].size(); idx++){
+            u32 shape = partition_shapes[partition][idx];
+            // the region of the shape within the macro-block
+            u32 mask = masks[shape];
+            int left = (mask & 0b0101) ? 0 : 8;
+            int top = (mask & 0b0011) ? 0 : 8;
+            int cols = ((mask & 0b0101) && (mask & 0b1010)) ? 16 : 8;
+            int rows = ((mask & 0b0011) && (mask & 0b1100)) ? 16 : 8;
+
+            std::pair<int, int> vector = best_vector[shape];
+            u32 min_sad = best_sad[shape];
+            for(int step = 2; step >= motion::precision_step(reference.get_precision()); step /= 2){
+                std::pair<int, int> centre = vector;
+                for(int d_y = -1; d_y <= 1; d_y++){
+                    for(int d_x = -1; d_x <= 1; d_x++){
+                        if(d_x == 0 && d_y == 0)
+                            continue;
+                        int v_x = centre.first + d_x*step;
+                        int v_y = centre.second + d_y*step;
+                        u32 sad = reference.sad_region_subpel(samples, 4*B_x + v_x, 4*B_y + v_y, left, top, cols, rows);
+                        if(sad < min_sad){
+                            min_sad = sad;
+                            vector = {v_x, v_y};
+                        }
+                    }
+                }
+            }
+            vectors[idx] = vector;
+            partition_sad += min_sad;
+        }
+
+        u32 cost = partition_sad + (partition + 1)*bit_cost + (partition_shapes[partition].size() - 1)*vector_cost;
+        if(cost >= whole_sad + bit_cost)
+            return whole_sad;
+        motion.partition = partition;
+        motion.partition_vectors = vectors;
+        motion.vector = vectors[0];
+        return partition_sad;
+    }
+
+    bool find_reference(const Block16x16& block, const motion::ReferenceBuffer& references, u32 macro_idx,
+    const std::vector<std::pair<int,int>>& candidates, const SearchSettings& settings, motion::BlockMotion& motion){
+        // roughly the SAD worth one extra bit of reference index
+        const u32 index_cost = 32;
+        u32 min_cost {UINT32_MAX};
+        u32 min_sad {UINT32_MAX};
+        for(u32 idx = 0; idx < std::min(references.size(), settings.search_references); idx++){
+            std::pair<int, int> candidate {0, 0};
+            u32 sad = find_motion_vector(block, references.at(idx), macro_idx, candidate, candidates, settings);
+            u32 cost = sad + idx*index_cost;
+            if(cost < min_cost){
+                min_cost = cost;
+                min_sad = sad;
+                motion.reference_idx = idx;
+                motion.vector = candidate;
+            }
+        }
+        motion.mode = motion::PredictionMode::forward;
+        motion.partition = motion::Partition::whole;
+        // only a macro-block which is not already predicted well is worth splitting
+        if(settings.partitions && min_sad > settings.early_exit_sad)
+            min_sad = find_partitions(block, references.at(motion.reference_idx), macro_idx, min_sad, settings, motion);
+        return min_sad <= max_P_block_sad;
+    }
+
+    bool refine_reference(const Block16x16& block, const motion::ReferenceBuffer& references, u32 macro_idx, const motion::BlockMotion& source,
+    std::vector<std::pair<int,int>>& candidates, const SearchSettings& settings, motion::BlockMotion& motion){
+        if(source.reference_idx >= references.size())
+            return find_reference(block, references, macro_idx, candidates, settings, motion);
+        candidates.push_back(source.vector);
+        motion.reference_idx = source.reference_idx;
+        motion.mode = motion::PredictionMode::forward;
+        motion.partition = motion::Partition::whole;
+        u32 min_sad = find_motion_vector(block, references.at(motion.reference_idx), macro_idx, motion.vector, candidates, refine_settings(settings));
+        if(min_sad > 4 * settings.early_exit_sad)
+            return find_reference(block, references, macro_idx, candidates, settings, motion);
+        if(settings.partitions && min_sad > settings.early_exit_sad)
+            min_sad = find_partitions(block, references.at(motion.reference_idx), macro_idx, min_sad, settings, motion);
+        return min_sad <= max_P_block_sad;
+    }
+
+    u32 prediction_sad(const Block16x16& block, const std::vector<Block8x8>& prediction){
+        u32 sad = 0;
+        for(u32 count = 0; count < 4; count++)
+            for(u32 r = 0; r < 8; r++)
+                for(u32 c = 0; c < 8; c++)
+                    sad += std::abs(block.at(8*(count/2) + r).at(8*(count%2) + c) - prediction.at(count).at(r).at(c));
+        return sad;
+    }
+
+    void get_prediction(u32 macro_idx, const motion::ReferenceBuffer& references, const motion::BlockMotion& motion, std::vector<Block8x8>& prediction, u32 downscale){
+        auto prev_blocks = [&](const motion::ReferenceFrame& reference, const std::array<std::pair<int, int>, 4>& vectors, std::vector<Block8x8>& blocks){
+            if(downscale > 1)
+                dct::get_downscaled_prev_blocks(macro_idx, reference, vectors, downscale, blocks);
+            else
+                dct::get_prev_blocks(macro_idx, reference, vectors, blocks);
+        };
+        const std::pair<int, int>& backward = motion.backward_vector;
+        if(motion.mode == motion::PredictionMode::forward){
+            prev_blocks(references.at(motion.reference_idx), motion::block_vectors(motion), prediction);
+        }else if(motion.mode == motion::PredictionMode::backward){
+            prev_blocks(references.at(0), {backward, backward, backward, backward}, prediction);
+        }else{
+            // both predictions are pushed and the forward blocks are replaced by the averages
+            std::size_t start = prediction.size();
+            prev_blocks(references.at(motion.reference_idx), {motion.vector, motion.vector, motion.vector, motion.vector}, prediction);
+            prev_blocks(references.at(0), {backward, backward, backward, backward}, prediction);
+            for(u32 count = 0; count < 6; count++)
+                prediction.at(start + count) = dct::average_block(prediction.at(start + count), prediction.at(start + 6 + count));
+            prediction.resize(start + 6);
+        }
+    }
+
+    bool find_B_prediction(const Block16x16& block, const motion::ReferenceBuffer& references, u32 macro_idx,
+    const std::vector<std::pair<int,int>>& forward_candidates, const std::vector<std::pair<int,int>>& backward_candidates,
+    const SearchSettings& settings, motion::BlockMotion& motion, std::vector<Block8x8>& average){
+        // roughly the SAD worth one bit
+        const u32 bit_cost = 32;
+        u32 forward_cost {UINT32_MAX};
+        u32 forward_sad {UINT32_MAX};
+        // reference 0 is the future frame and is searched on top of the past references
+        for(u32 idx = 1; idx <= std::min(references.size() - 1, settings.search_references); idx++){
+            std::pair<int, int> candidate {0, 0};
+            u32 sad = find_motion_vector(block, references.at(idx), macro_idx, candidate, forward_candidates, settings);
+            u32 cost = sad + (idx-1)*bit_cost;
+            if(cost < forward_cost){
+                forward_cost = cost;
+                forward_sad = sad;
+                motion.reference_idx = idx;
+                motion.vector = candidate;
+            }
+        }
+        u32 backward_sad = find_motion_vector(block, references.at(0), macro_idx, motion.backward_vector, backward_candidates, settings);
+
+        average.clear();
+        motion.mode = motion::PredictionMode::bidirectional;
+        get_prediction(macro_idx, references, motion, average);
+        u32 average_sad = prediction_sad(block, average);
+
+        // mode codes are 0 (forward), 10 (backward) and 11 (bidirectional), a second vector costs a few more bits
+        u32 min_cost = forward_cost + bit_cost;
+        u32 min_sad = forward_sad;
+        motion.mode = motion::PredictionMode::forward;
+        if(backward_sad + 2*bit_cost < min_cost){
+            min_cost = backward_sad + 2*bit_cost;
+            min_sad = backward_sad;
+            motion.mode = motion::PredictionMode::backward;
+        }
+        if(average_sad + (forward_cost - forward_sad) + 6*bit_cost < min_cost){
+            min_sad = average_sad;
+            motion.mode = motion::PredictionMode::bidirectional;
+        }
+        return min_sad <= max_P_block_sad;
+    }
+
+    void compress_I_block(std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks, u32 C_idx,
+    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks, dct::Quality quality, double scale){
+        STATS_TIMER(transform);
+        u32 Y_idx = 4 * C_idx;
+        for(u32 count = 0; count < 4; count++){
+            // Take the DCT and quantize
+            Block8x8 quantized_block = dct::quantize_block(dct::get_dct(Y_blocks.at(Y_idx+count)), quality, true, false, scale);
+            // Push in array format
+            compressed_blocks.push_back(quantized_block);
+            // Unquantize and take the inverse DCT
+            uncompressed_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, true, false, scale)));
+        }
+
+        Block8x8 quantized_Cb_block = dct::quantize_block(dct::get_dct(Cb_blocks.at(C_idx)), quality, false, false, scale);
+        compressed_blocks.push_back(quantized_Cb_block);
+        uncompressed_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(quantized_Cb_block, quality, false, false, scale)));
+
+        Block8x8 quantized_Cr_block = dct::quantize_block(dct::get_dct(Cr_blocks.at(C_idx)), quality, false, false, scale);
+        compressed_blocks.push_back(quantized_Cr_block);
+        uncompressed_blocks.push_back(dct::get_inverse_dct(dct::unquantize_block(quantized_Cr_block, quality, false, false, scale)));
+    }
+
+    void compress_P_block(std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks, u32 block_idx,
+    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks, dct::Quality quality,
+    const std::vector<Block8x8>& prev_blocks, double scale){
+        STATS_TIMER(transform);
+        u32 Y_idx = 4 * block_idx;
+        for(u32 count = 0; count < 4; count++){
+            //Get the delta values 
+            Block8x8 delta_block = dct::get_delta_block(Y_blocks.at(Y_idx+count), prev_blocks.at(count));
+            // Take the DCT and quantize the delta values
+            Block8x8 quantized_block = dct::quantize_block(dct::get_dct(delta_block), quality, true, true, scale);
+            // Push in array format
+            compressed_blocks.push_back(quantized_block);
+            // Unquantize and take the inverse DCT of the delta values 
+            Block8x8 uncompressed_delta = dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, true, true, scale));
+            // Unquantize and take the inverse DCT
+            uncompressed_blocks.push_back(dct::add_delta_block(prev_blocks.at(count), uncompressed_delta));
+        }
+
+        Block8x8 delta_block = dct::get_delta_block(Cb_blocks.at(block_idx), prev_blocks.at(4));
+        Block8x8 quantized_block = dct::quantize_block(dct::get_dct(delta_block), quality, false, true, scale);
+        compressed_blocks.push_back(quantized_block);
+        Block8x8 uncompressed_delta = dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, false, true, scale));
+        uncompressed_blocks.push_back(dct::add_delta_block(prev_blocks.at(4), uncompressed_delta));
+
+        delta_block = dct::get_delta_block(Cr_blocks.at(block_idx), prev_blocks.at(5));
+        quantized_block = dct::quantize_block(dct::get_dct(delta_block), quality, false, true, scale);
+        compressed_blocks.push_back(quantized_block);
+        uncompressed_delta = dct::get_inverse_dct(dct::unquantize_block(quantized_block, quality, false, true, scale));
+        uncompressed_blocks.push_back(dct::add_delta_block(prev_blocks.at(5), uncompressed_delta));
+    }
+
+    void push_block_motion(const motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, motion::Precision precision,
+    u32 num_references, bool B_frame, bool partitions, bool skip, OutputBitStream& output_stream){
+        const motion::BlockMotion& motion = field.at(macro_idx);
+        // Push block-type bit (0=I-block and 1=P-block)
+        output_stream.push_bit(motion.inter);
+        STATS_COUNT(block_flag_bits, 1);
+        if(!motion.inter)
+            return;
+        if(skip && !B_frame){
+            output_stream.push_bit(motion.skip);
+            STATS_COUNT(block_flag_bits, 1);
+            if(motion.skip){
+                STATS_COUNT(skipped_blocks, 1);
+                return;
+            }
+        }
+
+        STATS_BITS_BEGIN(reference_index, output_stream.bits_written());
+        if(!B_frame){
+            stream::push_reference_index(output_stream, motion.reference_idx, num_references);
+        }else{
+            stream::push_prediction_mode(output_stream, motion.mode);
+            if(motion.mode != motion::PredictionMode::backward)
+                stream::push_reference_index(output_stream, motion.reference_idx - 1, num_references - 1);
+        }
+        STATS_BITS_END(reference_index, reference_index_bits, output_stream.bits_written());
+        if(partitions && !B_frame){
+            STATS_BITS_BEGIN(partition, output_stream.bits_written());
+            stream::push_partition(output_stream, motion.partition);
+            STATS_BITS_END(partition, partition_bits, output_stream.bits_written());
+            if(motion.partition != motion::Partition::whole)
+                STATS_COUNT(partitioned_blocks, 1);
+        }
+
+        STATS_BITS_BEGIN(motion_vector, output_stream.bits_written());
+        int step = motion::precision_step(precision);
+        // bidirectional blocks send the forward vector followed by the backward vector
+        if(motion.mode != motion::PredictionMode::backward){
+            std::pair<int, int> predicted = motion::predict_vector(field, macro_idx, macroblocks_wide, false);
+            stream::push_delta_value(output_stream, (motion.vector.first - predicted.first)/step);
+            stream::push_delta_value(output_stream, (motion.vector.second - predicted.second)/step);
+            STATS_MOTION_VECTOR(motion.vector.first, motion.vector.second);
+            for(u32 idx = 1; idx < motion::num_partitions(motion.partition); idx++){
+                const std::pair<int, int>& previous = motion.partition_vectors[idx-1];
+                const std::pair<int, int>& vector = motion.partition_vectors[idx];
+                stream::push_delta_value(output_stream, (vector.first - previous.first)/step);
+                stream::push_delta_value(output_stream, (vector.second - previous.second)/step);
+                STATS_MOTION_VECTOR(vector.first, vector.second);
+            }
+        }
+        if(motion.mode != motion::PredictionMode::forward){
+            std::pair<int, int> predicted = motion::predict_vector(field, macro_idx, macroblocks_wide, true);
+            stream::push_delta_value(output_stream, (motion.backward_vector.first - predicted.first)/step);
+            stream::push_delta_value(output_stream, (motion.backward_vector.second - predicted.second)/step);
+            STATS_MOTION_VECTOR(motion.backward_vector.first, motion.backward_vector.second);
+        }
+        STATS_BITS_END(motion_vector, motion_vector_bits, output_stream.bits_written());
+    }
+
+    u32 block_motion_bits(const motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, motion::Precision precision,
+    u32 num_references, bool B_frame, bool partitions, bool skip){
+        const motion::BlockMotion& motion = field.at(macro_idx);
+        u32 bits = 1;
+        if(!motion.inter)
+            return bits;
+        if(skip && !B_frame){
+            bits++;
+            if(motion.skip)
+                return bits;
+        }
+        if(!B_frame){
+            bits += stream::reference_index_bits(motion.reference_idx, num_references);
+        }else{
+            bits += stream::prediction_mode_bits(motion.mode);
+            if(motion.mode != motion::PredictionMode::backward)
+                bits += stream::reference_index_bits(motion.reference_idx - 1, num_references - 1);
+        }
+        if(partitions && !B_frame)
+            bits += stream::partition_bits(motion.partition);
+
+        int step = motion::precision_step(precision);
+        if(motion.mode != motion::PredictionMode::backward){
+            std::pair<int, int> predicted = motion::predict_vector(field, macro_idx, macroblocks_wide, false);
+            bits += stream::delta_value_bits((motion.vector.first - predicted.first)/step);
+            bits += stream::delta_value_bits((motion.vector.second - predicted.second)/step);
+            for(u32 idx = 1; idx < motion::num_partitions(motion.partition); idx++){
+                const std::pair<int, int>& previous = motion.partition_vectors[idx-1];
+                const std::pair<int, int>& vector = motion.partition_vectors[idx];
+                bits += stream::delta_value_bits((vector.first - previous.first)/step);
+                bits += stream::delta_value_bits((vector.second - previous.second)/step);
+            }
+        }
+        if(motion.mode != motion::PredictionMode::forward){
+            std::pair<int, int> predicted = motion::predict_vector(field, macro_idx, macroblocks_wide, true);
+            bits += stream::delta_value_bits((motion.backward_vector.first - predicted.first)/step);
+            bits += stream::delta_value_bits((motion.backward_vector.second - predicted.second)/step);
+        }
+        return bits;
+    }
+
+    double macroblock_ssd(u32 block_idx, const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks,
+    const std::vector<Block8x8>& Cr_blocks, std::vector<Block8x8>::const_iterator reconstructed){
+        double ssd = 0;
+        for(u32 count = 0; count < 6; count++, reconstructed++){
+            const Block8x8& source = (count < 4) ? Y_blocks.at(4*block_idx + count) : (count == 4) ? Cb_blocks.at(block_idx) : Cr_blocks.at(block_idx);
+            for(u32 r = 0; r < 8; r++)
+                for(u32 c = 0; c < 8; c++){
+                    double error = source[r][c] - (*reconstructed)[r][c];
+                    ssd += error * error;
+                }
+        }
+        return ssd;
+    }
+
+    void rd_compress_macroblock(motion::MotionField& field, u32 macro_idx, u32 block_idx, u32 macroblocks_wide, const motion::ReferenceBuffer& references,
+    const std::vector<Block8x8>& Y_blocks, const std::vector<Block8x8>& Cb_blocks, const std::vector<Block8x8>& Cr_blocks,
+    const RDSettings& settings, MacroblockScratch& scratch, std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks){
+        motion::BlockMotion& motion = field.at(macro_idx);
+        motion::BlockMotion searched = motion;
+        motion::BlockMotion best_motion;
+        // the best blocks trade buffers with those of a better mode, none are allocated once they are big enough
+        std::vector<Block8x8>& compressed = scratch.compressed;
+        std::vector<Block8x8>& uncompressed = scratch.uncompressed;
+        std::vector<Block8x8>& best_compressed = scratch.best_compressed;
+        std::vector<Block8x8>& best_uncompressed = scratch.best_uncompressed;
+        double best_cost = std::numeric_limits<double>::max();
+
+        auto consider = [&](){
+            u32 bits = block_motion_bits(field, macro_idx, macroblocks_wide, settings.precision, settings.num_references, settings.B_frame, settings.partitions, settings.skip);
+            for(const Block8x8& block : compressed)
+                bits += stream::quantized_array_delta_bits(dct::block_to_array(block));
+            double cost = macroblock_ssd(block_idx, Y_blocks, Cb_blocks, Cr_blocks, uncompressed.cbegin()) + settings.lambda * bits;
+            if(cost < best_cost){
+                best_cost = cost;
+                best_motion = motion;
+                best_compressed.swap(compressed);
+                best_uncompressed.swap(uncompressed);
+            }
+        };
+
+        {
+            motion = motion::BlockMotion{};
+            compressed.clear();
+            uncompressed.clear();
+            compress_I_block(compressed, uncompressed, block_idx, Y_blocks, Cb_blocks, Cr_blocks, settings.quality, settings.I_scale);
+            consider();
+        }
+        if(searched.inter){
+            motion = searched;
+            scratch.prediction.clear();
+            get_prediction(macro_idx, references, motion, scratch.prediction);
+            compressed.clear();
+            uncompressed.clear();
+            compress_P_block(compressed, uncompressed, block_idx, Y_blocks, Cb_blocks, Cr_blocks, settings.quality, scratch.prediction, settings.P_scale);
+            consider();
+        }
+        if(settings.skip && !settings.B_frame && references.size() > 0){
+            motion = motion::BlockMotion{};
+            motion.inter = true;
+            motion.skip = true;
+            motion.vector = motion::predict_vector(field, macro_idx, macroblocks_wide, false);
+            motion.partition_vectors[0] = motion.vector;
+            // nothing is sent, the prediction is the reconstruction
+            compressed.clear();
+            uncompressed.clear();
+            get_prediction(macro_idx, references, motion, uncompressed);
+            consider();
+        }
+
+        motion = best_motion;
+        compressed_blocks.insert(compressed_blocks.end(), best_compressed.begin(), best_compressed.end());
+        uncompressed_blocks.insert(uncompressed_blocks.end(), best_uncompressed.begin(), best_uncompressed.end());
+    }
+
+    bool try_skip_block(motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, const motion::ReferenceBuffer& references,
+    const Block16x16& block, u32 max_sad, std::vector<Block8x8>& prediction, std::vector<Block8x8>& uncompressed_blocks){
+        motion::BlockMotion skipped;
+        skipped.inter = true;
+        skipped.skip = true;
+        skipped.vector = motion::predict_vector(field, macro_idx, macroblocks_wide, false);
+        skipped.partition_vectors[0] = skipped.vector;
+        prediction.clear();
+        get_prediction(macro_idx, references, skipped, prediction);
+        if(prediction_sad(block, prediction) > max_sad)
+            return false;
+        field.at(macro_idx) = skipped;
+        uncompressed_blocks.insert(uncompressed_blocks.end(), prediction.begin(), prediction.end());
+        return true;
+    }
+
+    bool same_macroblock(YUVFrame420& frame, YUVFrame420& other, u32 macro_idx, u32 macroblocks_wide){
+        u32 width = frame.get_Width(), height = frame.get_Height();
+        u32 x = 16 * (macro_idx % macroblocks_wide), y = 16 * (macro_idx / macroblocks_wide);
+        u32 cols = std::min(16u, width - x), rows = std::min(16u, height - y);
+        for(u32 row = 0; row < rows; row++){
+            const u8* samples = frame.Y_plane() + (y + row) * width + x;
+            if(!std::equal(samples, samples + cols, other.Y_plane() + (y + row) * width + x))
+                return false;
+        }
+        for(u32 row = 0; row < rows / 2; row++){
+            u32 start = (y/2 + row) * width/2 + x/2;
+            if(!std::equal(frame.Cb_plane() + start, frame.Cb_plane() + start + cols/2, other.Cb_plane() + start) ||
+                !std::equal(frame.Cr_plane() + start, frame.Cr_plane() + start + cols/2, other.Cr_plane() + start))
+                return false;
+        }
+        return true;
+    }
+
+    void static_block(motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, const motion::ReferenceBuffer& references, bool B_frame,
+    std::vector<Block8x8>& compressed_blocks, std::vector<Block8x8>& uncompressed_blocks){
+        motion::BlockMotion unchanged;
+        unchanged.inter = true;
+        if(B_frame)
+            unchanged.mode = motion::PredictionMode::backward;
+        else
+            unchanged.skip = motion::predict_vector(field, macro_idx, macroblocks_wide, false) == std::pair<int,int>{0, 0};
+        // the prediction is the reconstruction
+        get_prediction(macro_idx, references, unchanged, uncompressed_blocks);
+        field.at(macro_idx) = unchanged;
+        if(!unchanged.skip)
+            compressed_blocks.insert(compressed_blocks.end(), 6, Block8x8{});
+    }
+
+    void push_compressed_row(const motion::MotionField& field, u32 row, u32 macroblocks_wide, motion::Precision precision, u32 num_references, bool B_frame,
+    bool partitions, bool skip, const std::vector<Block8x8>& compressed_blocks, OutputBitStream& output_stream){
+        u32 end_idx = (row + 1) * macroblocks_wide;
+        u32 block = 0;
+        for(u32 macro_idx = row * macroblocks_wide; macro_idx < end_idx; macro_idx++){
+            push_block_motion(field, macro_idx, macroblocks_wide, precision, num_references, B_frame, partitions, skip, output_stream);
+            if(field.at(macro_idx).skip)
+                continue;
+            // Push the macro block (in Y Cb Cr order)
+            for(u32 count = 0; count < 6; count++){
+                STATS_BITS_BEGIN(block, output_stream.bits_written());
+                stream::push_quantized_array_delta(output_stream, dct::block_to_array(compressed_blocks.at(block++)));
+                if(count < 4)
+                    STATS_BITS_END(block, Y_bits, output_stream.bits_written());
+                else if(count == 4)
+                    STATS_BITS_END(block, Cb_bits, output_stream.bits_written());
+                else
+                    STATS_BITS_END(block, Cr_bits, output_stream.bits_written());
+            }
+        }
+    }
+
+    void reconstruct_row(const std::vector<Block8x8>& uncompressed_blocks, u32 row, u32 macroblocks_wide, YUVFrame420& frame){
+        STATS_TIMER(reconstruct);
+        for(u32 col = 0; col < macroblocks_wide; col++){
+            for(u32 block = 0; block < 4; block++)
+                write_block(frame, 0, 16 * col + 8 * (block % 2), 16 * row + 8 * (block / 2), uncompressed_blocks.at(6 * col + block));
+            for(u32 plane = 1; plane <= 2; plane++)
+                write_block(frame, plane, 8 * col, 8 * row, uncompressed_blocks.at(6 * col + 3 + plane));
+        }
+    }
+
+    void read_quantized_blocks(std::array<Block8x8, 6>& quantized_blocks, InputBitStream& input_stream){
+        STATS_TIMER(entropy);
+        for(u32 count = 0; count < 6; count++){
+            STATS_BITS_BEGIN(block, input_stream.bits_read());
+            quantized_blocks.at(count) = dct::array_to_block(stream::read_quantized_array_delta(input_stream));
+            if(count < 4)
+                STATS_BITS_END(block, Y_bits, input_stream.bits_read());
+            else if(count == 4)
+                STATS_BITS_END(block, Cb_bits, input_stream.bits_read());
+            else
+                STATS_BITS_END(block, Cr_bits, input_stream.bits_read());
+        }
+    }
+
+    void decompress_I_block(std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks, dct::Quality quality, const std::array<Block8x8, 6>& quantized_blocks,
+    double scale, u32 block_size){
+        STATS_TIMER(transform);
+        for(u32 count = 0; count < 4; count++){
+            // Unquantize and take the inverse dct
+            Y_blocks.push_back(dct::get_reduced_inverse_dct(dct::unquantize_block(quantized_blocks.at(count), quality, true, false, scale), block_size));
+        }
+        Cb_blocks.push_back(dct::get_reduced_inverse_dct(dct::unquantize_block(quantized_blocks.at(4), quality, false, false, scale), block_size));
+        Cr_blocks.push_back(dct::get_reduced_inverse_dct(dct::unquantize_block(quantized_blocks.at(5), quality, false, false, scale), block_size));
+    }
+
+    void decompress_P_block(std::vector<Block8x8>& Y_blocks, std::vector<Block8x8>& Cb_blocks, std::vector<Block8x8>& Cr_blocks, dct::Quality quality, const std::array<Block8x8, 6>& quantized_blocks,
+    const std::vector<Block8x8>& prev_blocks, double scale, u32 block_size){
+        STATS_TIMER(transform);
+        for(u32 count = 0; count < 4; count++){
+            // Unquantize and take the inverse dct
+            Block8x8 delta_block = dct::get_reduced_inverse_dct(dct::unquantize_block(quantized_blocks.at(count), quality, true, true, scale), block_size);
+            // Add delta_values to previous block
+            Y_blocks.push_back(dct::add_delta_block(prev_blocks.at(count), delta_block));
+        }
+
+        Block8x8 delta_block = dct::get_reduced_inverse_dct(dct::unquantize_block(quantized_blocks.at(4), quality, false, true, scale), block_size);
+        Cb_blocks.push_back(dct::add_delta_block(prev_blocks.at(4), delta_block));
+
+        delta_block = dct::get_reduced_inverse_dct(dct::unquantize_block(quantized_blocks.at(5), quality, false, true, scale), block_size);
+        Cr_blocks.push_back(dct::add_delta_block(prev_blocks.at(5), delta_block));
+    }
+
+    void read_block_motion(motion::MotionField& field, u32 macro_idx, u32 macroblocks_wide, motion::Precision precision,
+    u32 num_references, bool B_frame, bool partitions, bool skip, InputBitStream& input_stream){
+        STATS_TIMER(entropy);
+        motion::BlockMotion& motion = field.at(macro_idx);
+        motion.inter = input_stream.read_bit();
+        STATS_COUNT(block_flag_bits, 1);
+        if(!motion.inter)
+            return;
+
+        motion.mode = motion::PredictionMode::forward;
+        motion.reference_idx = 0;
+        motion.partition = motion::Partition::whole;
+        motion.skip = false;
+        if(skip && !B_frame){
+            motion.skip = input_stream.read_bit();
+            STATS_COUNT(block_flag_bits, 1);
+            if(motion.skip){
+                STATS_COUNT(skipped_blocks, 1);
+                motion.vector = motion::predict_vector(field, macro_idx, macroblocks_wide, false);
+                motion.partition_vectors[0] = motion.vector;
+                return;
+            }
+        }
+
+        STATS_BITS_BEGIN(reference_index, input_stream.bits_read());
+        if(!B_frame){
+            motion.reference_idx = stream::read_reference_index(input_stream, num_references);
+        }else{
+            motion.mode = stream::read_prediction_mode(input_stream);
+            if(motion.mode != motion::PredictionMode::backward)
+                motion.reference_idx = stream::read_reference_index(input_stream, num_references - 1) + 1;
+        }
+        STATS_BITS_END(reference_index, reference_index_bits, input_stream.bits_read());
+        if(partitions && !B_frame){
+            STATS_BITS_BEGIN(partition, input_stream.bits_read());
+            motion.partition = stream::read_partition(input_stream);
+            STATS_BITS_END(partition, partition_bits, input_stream.bits_read());
+            if(motion.partition != motion::Partition::whole)
+                STATS_COUNT(partitioned_blocks, 1);
+        }
+
+        STATS_BITS_BEGIN(motion_vector, input_stream.bits_read());
+        int step = motion::precision_step(precision);
+        if(motion.mode != motion::PredictionMode::backward){
+            std::pair<int, int> predicted = motion::predict_vector(field, macro_idx, macroblocks_wide, false);
+            motion.vector.first = predicted.first + step*stream::read_delta_value(input_stream);
+            motion.vector.second = predicted.second + step*stream::read_delta_value(input_stream);
+            STATS_MOTION_VECTOR(motion.vector.first, motion.vector.second);
+            motion.partition_vectors[0] = motion.vector;
+            for(u32 idx = 1; idx < motion::num_partitions(motion.partition); idx++){
+                std::pair<int, int>& vector = motion.partition_vectors[idx];
+                vector.first = motion.partition_vectors[idx-1].first + step*stream::read_delta_value(input_stream);
+                vector.second = motion.partition_vectors[idx-1].second + step*stream::read_delta_value(input_stream);
+                STATS_MOTION_VECTOR(vector.first, vector.second);
+            }
+        }
+        if(motion.mode != motion::PredictionMode::forward){
+            std::pair<int, int> predicted = motion::predict_vector(field, macro_idx, macroblocks_wide, true);
+            motion.backward_vector.first = predicted.first + step*stream::read_delta_value(input_stream);
+            motion.backward_vector.second = predicted.second + step*stream::read_delta_value(input_stream);
+            STATS_MOTION_VECTOR(motion.backward_vector.first, motion.backward_vector.second);
+        }
+        STATS_BITS_END(motion_vector, motion_vector_bits, input_stream.bits_read());
+    }
+
+} // namespace helper
@@ -0,0 +1,285 @@
+#include <cstdlib>
+#include <algorithm>
+#include "motion.hpp"
+
+namespace motion {
+
+    namespace{
+        const u32 luma_border = 32;
+        const u32 chroma_border = 16;
+
+        u8 clip(int value){
+            if(value < 0)
+                return 0;
+            if(value > 255)
+                return 255;
+            return value;
+        }
+
+        // 6-tap half-pel filter (not normalized)
+        int six_tap(int e, int f, int g, int h, int i, int j){
+            return e - 5*f + 20*g + 20*h - 5*i + j;
+        }
+
+        // Partial distortion elimination: the sum is checked against the limit after every row
+        u32 sad_plane(const std::array<std::array<u8, 16>, 16>& block, const Plane& plane, int x, int y, u32 limit){
+            u32 sad = 0;
+            for(int r = 0; r < 16; r++){
+                const u8* reference = plane.row(y + r) + x;
+                for(int c = 0; c < 16; c++)
+                    sad += std::abs(int(block[r][c]) - int(reference[c]));
+                if(sad >= limit)
+                    return sad;
+            }
+            return sad;
+        }
+    }
+
+    Precision get_precision(const std::string& input_precision){
+        if(input_precision == "integer")
+            return integer;
+        else if(input_precision == "half")
+            return half;
+        else if(input_precision == "quarter")
+            return quarter;
+        return ERROR;
+    }
+
+    std::pair<int, int> predict_vector(const MotionField& field, u32 macro_idx, u32 macroblocks_wide, bool backward){
+        u32 col = macro_idx % macroblocks_wide;
+        u32 row = macro_idx / macroblocks_wide;
+        auto neighbour = [&](u32 idx) -> std::pair<int, int> {
+            const BlockMotion& motion = field.at(idx);
+            if(!motion.inter)
+                return {0, 0};
+            if(backward)
+                return (motion.mode != forward) ? motion.backward_vector : std::pair<int, int>{0, 0};
+            return (motion.mode != PredictionMode::backward) ? motion.vector : std::pair<int, int>{0, 0};
+        };
+
+        std::pair<int, int> left {0, 0}, top {0, 0}, diagonal {0, 0};
+        if(col > 0)
+            left = neighbour(macro_idx - 1);
+        if(row == 0)
+            return left;
+        top = neighbour(macro_idx - macroblocks_wide);
+        if(col + 1 < macroblocks_wide)
+            diagonal = neighbour(macro_idx - macroblocks_wide + 1);
+        else if(col > 0)
+            diagonal = neighbour(macro_idx - macroblocks_wide - 1);
+
+        auto median = [](int a, int b, int c){
+            return std::max(std::min(a, b), std::min(std::max(a, b), c));
+        };
+        return {median(left.first, top.first, diagonal.first), median(left.second, top.second, diagonal.second)};
+    }
+
+    void Plane::extend_edges(){
+        int w = width, h = height, b = border;
+        for(int y = 0; y < h; y++){
+            for(int x = -b; x < 0; x++)
+                at(x, y) = at(0, y);
+            for(int x = w; x < w + b; x++)
+                at(x, y) = at(w-1, y);
+        }
+        for(int y = -b; y < 0; y++)
+            for(int x = -b; x < w + b; x++)
+                at(x, y) = at(x, 0);
+        for(int y = h; y < h + b; y++)
+            for(int x = -b; x < w + b; x++)
+                at(x, y) = at(x, h-1);
+    }
+
+    ReferenceFrame::ReferenceFrame(u32 width, u32 height, bool search): width{width}, height{height}, precision{integer},
+        luma_planes{{ {width, height, luma_border}, {width, height, luma_border}, {width, height, luma_border}, {width, height, luma_border} }},
+        chroma_planes{{ {width/2, height/2, chroma_border}, {width/2, height/2, chroma_border} }},
+        integral_stride{width + 2*luma_border + 1} {
+        if(search)
+            integral.resize(integral_stride * (height + 2*luma_border + 1));
+    }
+
+    void ReferenceFrame::get_frame(YUVFrame420& frame) const{
+        for(u32 y = 0; y < height; y++)
+            std::copy(luma_planes[0].row(y), luma_planes[0].row(y) + width, frame.Y_plane() + y * width);
+        for(u32 y = 0; y < height/2; y++){
+            std::copy(chroma_planes[0].row(y), chroma_planes[0].row(y) + width/2, frame.Cb_plane() + y * width/2);
+            std::copy(chroma_planes[1].row(y), chroma_planes[1].row(y) + width/2, frame.Cr_plane() + y * width/2);
+        }
+    }
+
+    void ReferenceFrame::set_frame(YUVFrame420& frame, Precision precision){
+        this->precision = precision;
+        Plane& full = luma_planes[0];
+        for(u32 y = 0; y < height; y++)
+            for(u32 x = 0; x < width; x++)
+                full.at(x, y) = frame.Y(x, y);
+        full.extend_edges();
+        // The sums wrap around on large frames, but the sum of a 16x16 block always fits
+        // in 32 bits so the difference of the four corners is still exact
+        int b = luma_border, w = width, h = height;
+        for(int y = -b; y < h + b && !integral.empty(); y++){
+            u32 row_sum = 0;
+            u32* above = &integral[(y + b) * integral_stride];
+            u32* current = above + integral_stride;
+            for(int x = -b; x < w + b; x++){
+                row_sum += full.at(x, y);
+                current[x + b + 1] = above[x + b + 1] + row_sum;
+            }
+        }
+        for(u32 y = 0; y < height/2; y++)
+            for(u32 x = 0; x < width/2; x++){
+                chroma_planes[0].at(x, y) = frame.Cb(x, y);
+                chroma_planes[1].at(x, y) = frame.Cr(x, y);
+            }
+        chroma_planes[0].extend_edges();
+        chroma_planes[1].extend_edges();
+
+        if(precision == integer)
+            return;
+
+        // The half-pel planes are computed everywhere the filter taps stay inside the padded
+        // plane, which is far more than any motion vector can reach
+        int stride = w + 2*b;
+        Plane& horizontal = luma_planes[1];
+        Plane& vertical = luma_planes[2];
+        Plane& centre = luma_planes[3];
+        // the centre plane filters the unclipped horizontal output vertically,
+        // so only the last 6 rows of it are needed at any time
+        filter_rows.resize(6 * stride);
+        auto unclipped = [&](int x, int y) -> int& { return filter_rows[((y + b) % 6) * stride + (x + b)]; };
+
+        for(int y = -b; y < h + b; y++){
+            for(int x = -b + 2; x < w + b - 3; x++){
+                int sum = six_tap(full.at(x-2, y), full.at(x-1, y), full.at(x, y), full.at(x+1, y), full.at(x+2, y), full.at(x+3, y));
+                unclipped(x, y) = sum;
+                horizontal.at(x, y) = clip((sum + 16) >> 5);
+            }
+            // rows y-5 to y are available for the centre row y-3
+            int c_y = y - 3;
+            if(c_y < -b + 2)
+                continue;
+            for(int x = -b + 2; x < w + b - 3; x++)
+                centre.at(x, c_y) = clip((six_tap(unclipped(x, c_y-2), unclipped(x, c_y-1), unclipped(x, c_y), unclipped(x, c_y+1), unclipped(x, c_y+2), unclipped(x, c_y+3)) + 512) >> 10);
+        }
+        for(int y = -b + 2; y < h + b - 3; y++)
+            for(int x = -b; x < w + b; x++)
+                vertical.at(x, y) = clip((six_tap(full.at(x, y-2), full.at(x, y-1), full.at(x, y), full.at(x, y+1), full.at(x, y+2), full.at(x, y+3)) + 16) >> 5);
+    }
+
+    int ReferenceFrame::luma(int qx, int qy) const{
+        int hx = qx >> 1;
+        int hy = qy >> 1;
+        bool odd_x = qx & 1;
+        bool odd_y = qy & 1;
+        if(!odd_x && !odd_y)
+            return half_sample(hx, hy);
+        if(odd_x && !odd_y)
+            return (half_sample(hx, hy) + half_sample(hx+1, hy) + 1) >> 1;
+        if(!odd_x && odd_y)
+            return (half_sample(hx, hy) + half_sample(hx, hy+1) + 1) >> 1;
+        return (half_sample(hx, hy) + half_sample(hx+1, hy) + half_sample(hx, hy+1) + half_sample(hx+1, hy+1) + 2) >> 2;
+    }
+
+    int ReferenceFrame::chroma(u32 plane, int ex, int ey) const{
+        const Plane& samples = chroma_planes[plane];
+        int x = ex >> 3, fx = ex & 7;
+        int y = ey >> 3, fy = ey & 7;
+        return ((8-fx)*(8-fy)*samples.at(x, y) + fx*(8-fy)*samples.at(x+1, y)
+              + (8-fx)*fy*samples.at(x, y+1) + fx*fy*samples.at(x+1, y+1) + 32) >> 6;
+    }
+
+    int ReferenceFrame::bilinear(u32 plane, int x, int y, int units) const{
+        const Plane& samples = (plane == 0) ? luma_planes[0] : chroma_planes[plane - 1];
+        // floor division, the positions can be left of or above the frame
+        int ix = (x >= 0) ? x / units : -((-x + units - 1) / units), fx = x - ix * units;
+        int iy = (y >= 0) ? y / units : -((-y + units - 1) / units), fy = y - iy * units;
+        return ((units-fx)*(units-fy)*samples.at(ix, iy) + fx*(units-fy)*samples.at(ix+1, iy)
+              + (units-fx)*fy*samples.at(ix, iy+1) + fx*fy*samples.at(ix+1, iy+1) + units*units/2) / (units*units);
+    }
+
+    u32 ReferenceFrame::sad_16x16(const std::array<std::array<u8, 16>, 16>& block, int x, int y, u32 limit) const{
+        return sad_plane(block, luma_planes[0], x, y, limit);
+    }
+
+    u32 ReferenceFrame::sad_16x16_subpel(const std::array<std::array<u8, 16>, 16>& block, int qx, int qy, u32 limit) const{
+        // positions on the half-pel grid read one of the cached planes directly
+        if((qx & 1) == 0 && (qy & 1) == 0){
+            const Plane& plane = luma_planes[(((qy >> 1) & 1) << 1) | ((qx >> 1) & 1)];
+            return sad_plane(block, plane, qx >> 2, qy >> 2, limit);
+        }
+        u32 sad = 0;
+        for(int r = 0; r < 16; r++){
+            for(int c = 0; c < 16; c++)
+                sad += std::abs(int(block[r][c]) - luma(qx + 4*c, qy + 4*r));
+            if(sad >= limit)
+                return sad;
+        }
+        return sad;
+    }
+
+    void ReferenceFrame::sad_8x8_quarters(const std::array<std::array<u8, 16>, 16>& block, int x, int y, std::array<u32, 4>& sads) const{
+        sads.fill(0);
+        const Plane& plane = luma_planes[0];
+        for(int r = 0; r < 16; r++){
+            const u8* reference = plane.row(y + r) + x;
+            u32* row_sads = &sads[(r / 8) * 2];
+            for(int c = 0; c < 8; c++)
+                row_sads[0] += std::abs(int(block[r][c]) - int(reference[c]));
+            for(int c = 8; c < 16; c++)
+                row_sads[1] += std::abs(int(block[r][c]) - int(reference[c]));
+        }
+    }
+
+    u32 ReferenceFrame::sad_region_subpel(const std::array<std::array<u8, 16>, 16>& block, int qx, int qy, int left, int top, int cols, int rows) const{
+        u32 sad = 0;
+        // positions on the half-pel grid read one of the cached planes directly
+        if((qx & 1) == 0 && (qy & 1) == 0){
+            const Plane& plane = luma_planes[(((qy >> 1) & 1) << 1) | ((qx >> 1) & 1)];
+            for(int r = top; r < top + rows; r++){
+                const u8* reference = plane.row((qy >> 2) + r) + (qx >> 2);
+                for(int c = left; c < left + cols; c++)
+                    sad += std::abs(int(block[r][c]) - int(reference[c]));
+            }
+            return sad;
+        }
+        for(int r = top; r < top + rows; r++)
+            for(int c = left; c < left + cols; c++)
+                sad += std::abs(int(block[r][c]) - luma(qx + 4*c, qy + 4*r));
+        return sad;
+    }
+
+    u32 ReferenceFrame::sum_16x16(int x, int y) const{
+        auto corner = [&](int cx, int cy){
+            return integral[(cy + luma_border) * integral_stride + (cx + luma_border)];
+        };
+        return corner(x + 16, y + 16) - corner(x, y + 16) - corner(x + 16, y) + corner(x, y);
+    }
+
+    ReferenceBuffer::ReferenceBuffer(u32 width, u32 height, u32 num_short_term, bool long_term, bool search): num_short_term{num_short_term}, long_term{-1} {
+        assert(num_short_term >= 1);
+        // one slot per short-term frame plus one for the long-term frame, allocated once
+        u32 num_slots = num_short_term + (long_term ? 1 : 0);
+        pool.reserve(num_slots);
+        for(u32 slot = 0; slot < num_slots; slot++)
+            pool.emplace_back(width, height, search);
+    }
+
+    void ReferenceBuffer::push(YUVFrame420& frame, Precision precision, bool mark_long_term){
+        if(short_term.size() == num_short_term)
+            short_term.pop_back();
+        // reuse a slot which is neither a short-term nor the long-term reference
+        u32 slot = 0;
+        while(std::find(short_term.begin(), short_term.end(), slot) != short_term.end() || int(slot) == long_term)
+            slot++;
+        assert(slot < pool.size());
+        pool.at(slot).set_frame(frame, precision);
+        short_term.push_front(slot);
+        if(mark_long_term && pool.size() > num_short_term)
+            long_term = slot;
+
+        active.assign(short_term.begin(), short_term.end());
+        if(long_term >= 0 && std::find(short_term.begin(), short_term.end(), u32(long_term)) == short_term.end())
+            active.push_back(long_term);
+    }
+
+} // namespace motion
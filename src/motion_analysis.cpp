@@ -0,0 +1,85 @@
+#include <cassert>
+#include "motion_analysis.hpp"
+#include "stats.hpp"
+
+namespace motion_analysis{
+
+    SharedAnalysis::SharedAnalysis(): num_users{0}, macroblocks_wide{0}, num_searched{0} {
+    }
+
+    bool SharedAnalysis::attach(const uvid::EncoderParams& encoder_params){
+        if(num_users == 0){
+            params = encoder_params;
+            macroblocks_wide = (params.width + 15) / 16;
+            u32 macroblocks_high = (params.height + 15) / 16;
+            settings.early_exit_sad = 256 * params.early_exit;
+            references = std::make_unique<motion::ReferenceBuffer>(params.width, params.height, params.num_references, params.long_term_interval > 0, true);
+            previous_field.assign(macroblocks_wide * macroblocks_high, motion::BlockMotion{});
+        }else if(encoder_params.width != params.width || encoder_params.height != params.height || encoder_params.precision != params.precision ||
+            encoder_params.num_references != params.num_references || encoder_params.long_term_interval != params.long_term_interval ||
+            encoder_params.max_B_frames != params.max_B_frames || encoder_params.keyint_min != params.keyint_min ||
+            encoder_params.keyint_max != params.keyint_max || encoder_params.early_exit != params.early_exit){
+            return false;
+        }
+        num_users++;
+        return true;
+    }
+
+    const motion::MotionField& SharedAnalysis::frame(u64 frame_idx, YUVFrame420& frame, bool B_frame, bool keyframe, bool mark_long_term){
+        // the frames before are done once every encoder has asked for them
+        while(!frames.empty() && frames.front().remaining == 0 && frames.front().frame_idx < frame_idx){
+            spare_fields.push_back(std::move(frames.front().field));
+            frames.erase(frames.begin());
+        }
+        for(AnalysedFrame& analysed: frames){
+            if(analysed.frame_idx == frame_idx){
+                analysed.remaining--;
+                return analysed.field;
+            }
+        }
+        // the first encoder to send the frame searches it, the frames are sent in the same order by all
+        assert(frames.empty() || frames.back().frame_idx + 1 == frame_idx);
+        frames.push_back({frame_idx, num_users - 1, {}});
+        if(!spare_fields.empty()){
+            frames.back().field.swap(spare_fields.back());
+            spare_fields.pop_back();
+        }
+        search(frame, B_frame, keyframe, mark_long_term, frames.back().field);
+        return frames.back().field;
+    }
+
+    // The same search as the encoder's at its highest effort, on the input frames
+    void SharedAnalysis::search(YUVFrame420& frame, bool B_frame, bool keyframe, bool mark_long_term, motion::MotionField& field){
+        num_searched++;
+        STATS_COUNT(shared_searches, 1);
+        if(keyframe)
+            references->clear();
+        field.assign(previous_field.size(), motion::BlockMotion{});
+        if(!keyframe){
+            for(u32 macro_idx = 0; macro_idx < field.size(); macro_idx++){
+                // the blocks of one row at a time
+                if(macro_idx % macroblocks_wide == 0)
+                    helper::partition_row(frame, macro_idx / macroblocks_wide, Y_blocks, Cb_blocks, Cr_blocks);
+                u32 Y_idx = 4 * (macro_idx % macroblocks_wide);
+                Block16x16 macroblock = dct::create_macroblock(Y_blocks.at(Y_idx), Y_blocks.at(Y_idx+1), Y_blocks.at(Y_idx+2), Y_blocks.at(Y_idx+3));
+                motion::BlockMotion& motion = field.at(macro_idx);
+                std::vector<std::pair<int,int>>& candidates = scratch.forward_candidates;
+                candidates.assign({motion::predict_vector(field, macro_idx, macroblocks_wide, false), {0, 0}});
+                if(B_frame){
+                    scratch.backward_candidates.assign({motion::predict_vector(field, macro_idx, macroblocks_wide, true), {0, 0}});
+                    motion.inter = helper::find_B_prediction(macroblock, *references, macro_idx, candidates, scratch.backward_candidates, settings, motion,
+                        scratch.prediction);
+                }else{
+                    if(previous_field.at(macro_idx).inter)
+                        candidates.push_back(previous_field.at(macro_idx).vector);
+                    motion.inter = helper::find_reference(macroblock, *references, macro_idx, candidates, settings, motion);
+                }
+            }
+        }
+        if(!B_frame){
+            references->push(frame, params.precision, mark_long_term);
+            previous_field = field;
+        }
+    }
+
+} // namespace motion_analysis
@@ -0,0 +1,173 @@
+#include <cmath>
+#include <algorithm>
+#include "rate_control.hpp"
+#include "discrete_cosine_transform.hpp"
+
+namespace rate{
+
+    namespace{
+        // how fast the bits above the floor fall as the quantizer gets coarser
+        const double scale_exponent = 1.3;
+        // share of a frame's bits for keyframes, P-frames, B-frames and the first P-frame after a keyframe in CBR
+        const std::array<double, 4> type_weight {2.0, 1.0, 0.75, 1.0};
+        // largest change of qscale between two CBR frames of the same type
+        const int max_qscale_step = 6;
+        // part of the free buffer a frame is allowed to fill, a margin for the model
+        const double buffer_margin = 0.9;
+        // Coarser quantizers save almost nothing over the block floor and the poor references
+        // they leave behind cost more bits in the following frames than they save
+        const u32 max_rate_qscale = 48;
+
+        // qscale ~ cost^(1 - qcompress) between frames of a two-pass encode (0 would spend the same
+        // bits on every frame, 1 would give every frame the same qscale)
+        const double qcompress = 0.6;
+        // keyframes are predicted from by every frame until the next one, so they are quantized finer
+        const double keyframe_offset = -4;
+        // complexity per unit of first pass cost before any frame was sent (keyframes and other frames)
+        const std::array<double, 2> default_complexity_per_cost {0.05, 0.05};
+
+        double frame_cost(const first_pass::FrameCost& frame){
+            return std::max(1.0, frame.keyframe ? frame.intra_cost : frame.cost);
+        }
+    }
+
+    Mode get_mode(const std::string& input_mode){
+        if(input_mode == "cbr")
+            return cbr;
+        else if(input_mode == "vbr")
+            return vbr;
+        return ERROR;
+    }
+
+    RateController::RateController(Mode mode, u32 base_qscale, double bitrate_kbps, double fps, double buffer_kbits, u32 num_blocks):
+        mode{mode}, base_qscale{base_qscale}, fps{fps}, bits_per_frame{1000 * bitrate_kbps / fps}, buffer_bits{1000 * buffer_kbits},
+        complexity{}, has_complexity{}, last_qscale{}, fullness{buffer_bits / 2}, num_overflows{0}, type{0}, last_type{0}, qscale{base_qscale},
+        pass_sum{}, complexity_per_cost{default_complexity_per_cost}, remaining_bits{0}, remaining_frames{0}, num_sent{}, frame_idx{0} {
+        // one block flag bit per macro-block on top of the blocks
+        floor_bits = num_blocks * (min_block_bits + 1.0/6);
+    }
+
+    double RateController::predicted_bits(u32 type, u32 qscale) const{
+        double frame_complexity = floor_bits;
+        if(has_complexity.at(type))
+            frame_complexity = complexity.at(type);
+        else if((type == 2 || type == 3) && has_complexity.at(1))
+            frame_complexity = (type == 3 ? 1.5 : 1.0) * complexity.at(1);
+        else if((type == 1 || type == 3) && has_complexity.at(0))
+            frame_complexity = complexity.at(0) / 2;
+        return floor_bits + frame_complexity / std::pow(dct::qscale_to_scale(qscale), scale_exponent);
+    }
+
+    void RateController::set_first_pass(const std::vector<first_pass::FrameCost>& frames){
+        pass_frames = frames;
+        pass_offset.assign(frames.size(), 0);
+        pass_sent.assign(frames.size(), false);
+        remaining_bits = bits_per_frame * frames.size();
+        remaining_frames = frames.size();
+
+        // offsets are relative to the average cost of the frames of the same kind
+        std::array<double, 2> log_sum {}, count {};
+        for(const first_pass::FrameCost& frame : frames){
+            log_sum.at(!frame.keyframe) += std::log2(frame_cost(frame));
+            count.at(!frame.keyframe)++;
+        }
+        for(u32 idx = 0; idx < frames.size(); idx++){
+            u32 kind = !frames.at(idx).keyframe;
+            double offset = 8 * (1 - qcompress) * (std::log2(frame_cost(frames.at(idx))) - log_sum.at(kind) / count.at(kind));
+            if(frames.at(idx).keyframe)
+                offset += keyframe_offset;
+            pass_offset.at(idx) = offset;
+            pass_sum.at(kind) += frame_cost(frames.at(idx)) / std::pow(dct::qscale_to_scale(32 + offset), scale_exponent);
+        }
+    }
+
+    u32 RateController::planned_qscale() const{
+        // solve  remaining_bits = remaining_frames * floor + sum(complexity_per_cost * pass_sum) / scale(q)^1.3  for q
+        double texture_bits = remaining_bits - remaining_frames * floor_bits;
+        double frames_complexity = complexity_per_cost.at(0) * pass_sum.at(0) + complexity_per_cost.at(1) * pass_sum.at(1);
+        if(texture_bits <= 0 || frames_complexity <= 0)
+            return max_rate_qscale;
+        double common_qscale = 32 + 8 * std::log2(frames_complexity / texture_bits) / scale_exponent;
+        return std::clamp(std::round(common_qscale + pass_offset.at(frame_idx)), 0.0, double(max_rate_qscale));
+    }
+
+    u32 RateController::frame_qscale(u32 frame_idx, bool keyframe, bool B_frame){
+        this->frame_idx = frame_idx;
+        if(keyframe)
+            type = 0;
+        else if(B_frame)
+            type = 2;
+        else
+            type = (last_type == 0) ? 3 : 1;
+        if(!B_frame)
+            last_type = type;
+        qscale = base_qscale;
+        if(mode == constant_quality)
+            return qscale;
+
+        if(mode == two_pass){
+            // frames past the end of the first pass keep the qscale of the last frame of their type
+            if(frame_idx < pass_frames.size() && !pass_sent.at(frame_idx))
+                qscale = planned_qscale();
+            else if(has_complexity.at(type))
+                qscale = last_qscale.at(type);
+        }else if(mode == cbr){
+            // the frame's share of the bitrate, corrected to bring the buffer back to half full
+            // over the next second
+            double target = type_weight.at(type) * (bits_per_frame + (buffer_bits/2 - fullness) / fps);
+            qscale = 0;
+            while(qscale < max_rate_qscale && predicted_bits(type, qscale) > target)
+                qscale++;
+            if(has_complexity.at(type))
+                qscale = std::clamp<int>(qscale, int(last_qscale.at(type)) - max_qscale_step, int(last_qscale.at(type)) + max_qscale_step);
+        }
+
+        // never let a frame (as far as the model can tell) take more than the free buffer
+        while(buffer_bits > 0 && qscale < std::max(max_rate_qscale, base_qscale) && fullness + predicted_bits(type, qscale) > buffer_margin * buffer_bits)
+            qscale++;
+        return qscale;
+    }
+
+    void RateController::frame_done(u64 bits){
+        if(mode == constant_quality)
+            return;
+        if(buffer_bits > 0 && fullness + bits > buffer_bits)
+            num_overflows++;
+        fullness = std::max(0.0, fullness + bits - bits_per_frame);
+
+        double texture_bits = std::max(bits - floor_bits, 0.01 * floor_bits);
+        double frame_complexity = texture_bits * std::pow(dct::qscale_to_scale(qscale), scale_exponent);
+        complexity.at(type) = has_complexity.at(type) ? (complexity.at(type) + frame_complexity) / 2 : frame_complexity;
+        has_complexity.at(type) = true;
+        last_qscale.at(type) = qscale;
+
+        if(mode == two_pass && frame_idx < pass_frames.size() && !pass_sent.at(frame_idx)){
+            const first_pass::FrameCost& frame = pass_frames.at(frame_idx);
+            u32 kind = !frame.keyframe;
+            pass_sent.at(frame_idx) = true;
+            pass_sum.at(kind) = std::max(0.0, pass_sum.at(kind) - frame_cost(frame) / std::pow(dct::qscale_to_scale(32 + pass_offset.at(frame_idx)), scale_exponent));
+            remaining_bits -= bits;
+            remaining_frames--;
+            // the ratio moves slowly, a single frame the first pass got wrong should not swing the plan
+            double weight = (num_sent.at(kind) == 0) ? 1.0 : 0.2;
+            complexity_per_cost.at(kind) = (1 - weight) * complexity_per_cost.at(kind) + weight * frame_complexity / frame_cost(frame);
+            num_sent.at(kind)++;
+        }
+    }
+
+    void RateController::frame_repeated(u32 frame_idx, u64 bits){
+        if(mode == constant_quality)
+            return;
+        fullness = std::max(0.0, fullness + bits - bits_per_frame);
+        // the bits planned for it go to the frames left
+        if(mode == two_pass && frame_idx < pass_frames.size() && !pass_sent.at(frame_idx)){
+            const first_pass::FrameCost& frame = pass_frames.at(frame_idx);
+            u32 kind = !frame.keyframe;
+            pass_sent.at(frame_idx) = true;
+            pass_sum.at(kind) = std::max(0.0, pass_sum.at(kind) - frame_cost(frame) / std::pow(dct::qscale_to_scale(32 + pass_offset.at(frame_idx)), scale_exponent));
+            remaining_bits -= bits;
+            remaining_frames--;
+        }
+    }
+
+} // namespace rate
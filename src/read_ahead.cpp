@@ -0,0 +1,64 @@
+#include "read_ahead.hpp"
+#include "stats.hpp"
+
+namespace read_ahead{
+
+    AsyncReader::AsyncReader(std::istream& stream, u32 width, u32 height, u32 depth, bool y4m):
+        reader{stream, width, height, y4m}, buffers(depth + 1, YUVFrame420{width, height}), frames_read{0}, frames_released{0},
+        stopping{false}, holding{false}, num_waits{0} {
+        // reading std::cin flushes std::cout first unless it is untied, which would race with the encoder
+        stream.tie(nullptr);
+        worker = std::thread {&AsyncReader::run, this};
+    }
+
+    AsyncReader::~AsyncReader(){
+        stopping = true;
+        // a reader waiting for room has to wake up to see it should stop
+        frames_released.fetch_add(1);
+        frames_released.notify_one();
+        worker.join();
+    }
+
+    YUVFrame420* AsyncReader::next_frame(){
+        u64 released = frames_released.load(std::memory_order_relaxed);
+        if(holding){
+            frames_released.store(++released, std::memory_order_release);
+            frames_released.notify_one();
+            holding = false;
+        }
+        u64 read = frames_read.load(std::memory_order_acquire);
+        if((read & ~end_of_input) == released && !(read & end_of_input)){
+            STATS_COUNT(input_waits, 1);
+            num_waits++;
+            while((read & ~end_of_input) == released && !(read & end_of_input)){
+                frames_read.wait(read, std::memory_order_acquire);
+                read = frames_read.load(std::memory_order_acquire);
+            }
+        }
+        if((read & ~end_of_input) == released)
+            return nullptr;
+        holding = true;
+        return &buffers.at(released % buffers.size());
+    }
+
+    void AsyncReader::run(){
+        u64 read = 0;
+        while(true){
+            // the buffer the encoder holds is not released yet, so at most depth frames are ahead of it
+            u64 released = frames_released.load(std::memory_order_acquire);
+            while(read - released == buffers.size() && !stopping){
+                frames_released.wait(released, std::memory_order_acquire);
+                released = frames_released.load(std::memory_order_acquire);
+            }
+            if(stopping)
+                return;
+            if(!reader.read_frame(buffers.at(read % buffers.size())))
+                break;
+            frames_read.store(++read, std::memory_order_release);
+            frames_read.notify_one();
+        }
+        frames_read.store(read | end_of_input, std::memory_order_release);
+        frames_read.notify_one();
+    }
+
+} // namespace read_ahead
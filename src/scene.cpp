@@ -0,0 +1,65 @@
+#include <cstdlib>
+#include <algorithm>
+#include "scene.hpp"
+
+namespace scene{
+
+    namespace{
+        // Average difference of the thumbnail samples needed for a cut
+        const double thumbnail_threshold = 20;
+        // Fraction of the histogram which has to move to other bins for a cut
+        const double histogram_threshold = 0.1;
+    }
+
+    SceneDetector::SceneDetector(u32 width, u32 height): width{width}, height{height},
+        thumbnail_width{(width + thumbnail_scale - 1) / thumbnail_scale}, thumbnail_height{(height + thumbnail_scale - 1) / thumbnail_scale},
+        histogram{}, previous_histogram{}, has_previous{false}, thumbnail_difference{0}, histogram_difference{0} {
+        thumbnail.resize(thumbnail_width * thumbnail_height);
+        previous_thumbnail.resize(thumbnail_width * thumbnail_height);
+    }
+
+    bool SceneDetector::is_scene_cut(YUVFrame420& frame){
+        thumbnail.swap(previous_thumbnail);
+        histogram.swap(previous_histogram);
+        std::fill(thumbnail.begin(), thumbnail.end(), 0);
+        histogram.fill(0);
+
+        // one pass over the luma for both the thumbnail sums and the histogram
+        for(u32 y = 0; y < height; y++){
+            u32* thumbnail_row = &thumbnail[(y / thumbnail_scale) * thumbnail_width];
+            for(u32 x = 0; x < width; x++){
+                unsigned char sample = frame.Y(x, y);
+                thumbnail_row[x / thumbnail_scale] += sample;
+                histogram[sample * histogram_bins / 256]++;
+            }
+        }
+        // the last row and column of thumbnails can cover fewer samples
+        for(u32 t_y = 0; t_y < thumbnail_height; t_y++){
+            u32 rows = std::min(thumbnail_scale, height - t_y * thumbnail_scale);
+            for(u32 t_x = 0; t_x < thumbnail_width; t_x++){
+                u32 columns = std::min(thumbnail_scale, width - t_x * thumbnail_scale);
+                thumbnail[t_y * thumbnail_width + t_x] /= rows * columns;
+            }
+        }
+
+        if(!has_previous){
+            has_previous = true;
+            thumbnail_difference = 0;
+            histogram_difference = 0;
+            return false;
+        }
+
+        u32 sad = 0;
+        for(u32 idx = 0; idx < thumbnail.size(); idx++)
+            sad += std::abs(int(thumbnail[idx]) - int(previous_thumbnail[idx]));
+        thumbnail_difference = double(sad) / thumbnail.size();
+
+        u32 moved = 0;
+        for(u32 bin = 0; bin < histogram_bins; bin++)
+            moved += std::abs(int(histogram[bin]) - int(previous_histogram[bin]));
+        histogram_difference = double(moved) / (2.0 * width * height);
+
+        return thumbnail_difference >= thumbnail_threshold && histogram_difference >= histogram_threshold;
+    }
+
+} // namespace scene
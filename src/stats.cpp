@@ -0,0 +1,177 @@
+#include <iostream>
+#include <fstream>
+#include <array>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <sys/resource.h>
+#include "stats.hpp"
+
+namespace stats{
+
+    bool active {false};
+
+    namespace{
+        const std::array<const char*, NUM_STAGES> stage_names {
+            "read", "analysis", "partition", "motion_search", "transform", "entropy", "reconstruct", "write"
+        };
+        const std::array<const char*, NUM_COUNTERS> counter_names {
+            "frames", "keyframes", "skipped_frames", "repeated_frames", "scene_cuts", "I_blocks", "P_blocks", "partitioned_blocks", "skipped_blocks", "static_blocks", "Y_bits", "Cb_bits", "Cr_bits", "motion_vector_bits", "block_flag_bits", "reference_index_bits", "partition_bits", "escape_symbols", "early_exits", "search_candidates", "candidates_eliminated", "candidates_aborted", "input_waits", "shared_searches",
+#ifdef UVID_COUNT_ALLOCATIONS
+            "frame_allocations"
+#endif
+        };
+
+        std::string output_path {};
+        std::chrono::steady_clock::time_point start_time {};
+        std::array<std::chrono::steady_clock::duration, NUM_STAGES> stage_time {};
+        std::array<u64, NUM_STAGES> stage_calls {};
+        std::array<u64, NUM_COUNTERS> counters {};
+        std::map<std::pair<int, int>, u64> motion_vectors {};
+        std::map<int, u64> delta_frequency {};
+        std::map<unsigned int, u64> effort_frequency {};
+        const std::array<const char*, NUM_LATENCIES> latency_names {
+            "first_row", "frame"
+        };
+        std::array<u64, NUM_LATENCIES> latency_count {};
+        std::array<std::chrono::steady_clock::duration, NUM_LATENCIES> latency_total {};
+        std::array<std::chrono::steady_clock::duration, NUM_LATENCIES> latency_max {};
+        // read by every thread that allocates, so it does not use the active flag of the recording thread
+        std::atomic<bool> counting_allocations {false};
+        std::atomic<u64> allocation_count {0};
+        // set while a histogram adds an entry, those allocations are the instrumentation's own
+        thread_local bool histogram_allocation = false;
+
+        double to_seconds(std::chrono::steady_clock::duration d){
+            return std::chrono::duration<double>(d).count();
+        }
+    }
+
+    void enable(const std::string& path){
+        active = true;
+        counting_allocations.store(true, std::memory_order_relaxed);
+        output_path = path;
+        start_time = std::chrono::steady_clock::now();
+    }
+
+    void add_time(Stage stage, std::chrono::steady_clock::duration elapsed){
+        stage_time.at(stage) += elapsed;
+        stage_calls.at(stage)++;
+    }
+
+    void count(Counter counter, u64 amount){
+        counters.at(counter) += amount;
+    }
+
+    void count_motion_vector(int x, int y){
+        histogram_allocation = true;
+        motion_vectors[{x, y}]++;
+        histogram_allocation = false;
+    }
+
+    void count_delta(int delta){
+        histogram_allocation = true;
+        delta_frequency[delta]++;
+        histogram_allocation = false;
+    }
+
+    void count_effort(unsigned int level){
+        histogram_allocation = true;
+        effort_frequency[level]++;
+        histogram_allocation = false;
+    }
+
+    void add_latency(Latency latency, std::chrono::steady_clock::duration elapsed){
+        latency_count.at(latency)++;
+        latency_total.at(latency) += elapsed;
+        latency_max.at(latency) = std::max(latency_max.at(latency), elapsed);
+    }
+
+    u64 allocations(){
+        return allocation_count.load(std::memory_order_relaxed);
+    }
+
+    void count_allocation(){
+        if(counting_allocations.load(std::memory_order_relaxed) && !histogram_allocation)
+            allocation_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void write_report(std::ostream& out, const std::string& program){
+        rusage usage {};
+        getrusage(RUSAGE_SELF, &usage);
+
+        out << "{" << std::endl;
+        out << "  \"program\": \"" << program << "\"," << std::endl;
+        out << "  \"wall_seconds\": " << to_seconds(std::chrono::steady_clock::now() - start_time) << "," << std::endl;
+        out << "  \"peak_rss_kb\": " << usage.ru_maxrss << "," << std::endl;
+#ifdef UVID_COUNT_ALLOCATIONS
+        out << "  \"allocations\": " << allocations() << "," << std::endl;
+#endif
+
+        out << "  \"stages\": {" << std::endl;
+        for(u64 stage = 0; stage < NUM_STAGES; stage++){
+            out << "    \"" << stage_names.at(stage) << "\": {\"seconds\": " << to_seconds(stage_time.at(stage))
+                << ", \"calls\": " << stage_calls.at(stage) << "}" << ((stage+1 < NUM_STAGES) ? "," : "") << std::endl;
+        }
+        out << "  }," << std::endl;
+
+        out << "  \"counters\": {" << std::endl;
+        for(u64 counter = 0; counter < NUM_COUNTERS; counter++){
+            out << "    \"" << counter_names.at(counter) << "\": " << counters.at(counter)
+                << ((counter+1 < NUM_COUNTERS) ? "," : "") << std::endl;
+        }
+        out << "  }," << std::endl;
+
+        // keys are "x,y" since JSON object keys must be strings
+        out << "  \"motion_vectors\": {";
+        bool first = true;
+        for(const auto& [vector, frequency] : motion_vectors){
+            out << (first ? "" : ", ") << "\"" << vector.first << "," << vector.second << "\": " << frequency;
+            first = false;
+        }
+        out << "}," << std::endl;
+
+        out << "  \"delta_histogram\": {";
+        first = true;
+        for(const auto& [value, frequency] : delta_frequency){
+            out << (first ? "" : ", ") << "\"" << value << "\": " << frequency;
+            first = false;
+        }
+        out << "}," << std::endl;
+
+        // frames per effort level, empty unless the compressor ran in real-time mode
+        out << "  \"effort_levels\": {";
+        first = true;
+        for(const auto& [level, frequency] : effort_frequency){
+            out << (first ? "" : ", ") << "\"" << level << "\": " << frequency;
+            first = false;
+        }
+        out << "}," << std::endl;
+
+        out << "  \"latency_ms\": {" << std::endl;
+        for(u64 latency = 0; latency < NUM_LATENCIES; latency++){
+            u64 count = latency_count.at(latency);
+            double mean = count > 0 ? 1000 * to_seconds(latency_total.at(latency)) / count : 0;
+            out << "    \"" << latency_names.at(latency) << "\": {\"count\": " << count << ", \"mean\": " << mean
+                << ", \"max\": " << 1000 * to_seconds(latency_max.at(latency)) << "}" << ((latency+1 < NUM_LATENCIES) ? "," : "") << std::endl;
+        }
+        out << "  }" << std::endl;
+        out << "}" << std::endl;
+    }
+
+    void report(const std::string& program){
+        if(!active)
+            return;
+        if(output_path == "-"){
+            write_report(std::cerr, program);
+            return;
+        }
+        std::ofstream out {output_path};
+        if(!out){
+            std::cerr << "Unable to write stats to " << output_path << std::endl;
+            return;
+        }
+        write_report(out, program);
+    }
+
+} // namespace stats
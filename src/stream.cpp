@@ -1,12 +1,11 @@
 #include <vector>
 #include <array>
+#include <cstdlib>
 #include "stream.hpp"
+#include "stats.hpp"
 
 namespace stream{
 
-    std::map<int,int> delta_frequency {};
-    std::map<int,int> RLE_frequency {}; 
-
     std::map<int, u32> symbol_length {
         {-100, 9},  // negative escape symbol
         {-5, 9},
@@ -61,38 +60,20 @@ namespace stream{
         {2, 150}    // EOB - the rest of the block is zeros
     };
 
-    void print_histograms(){
-        std::cerr << "delta histogram" << std::endl;
-        int sum_delta {0};
-        int neg_x {};
-        int pos_x {};
-        for (const auto& [value, frequency] : delta_frequency){
-            if(value < -5)
-                neg_x += frequency;
-            else if(value > 5)
-                pos_x += frequency;
-            sum_delta+=frequency;
-        }
-        for(int value = -5; value <= 5; value++){
-            std::cerr << value << " " << delta_frequency[value] << std::endl;
-        }
-        std::cerr << "neg_x" << neg_x << std::endl;
-        std::cerr << "neg_y" << pos_x << std::endl;
-        std::cerr << "sum delta " << sum_delta << std::endl;
-        std::cerr << "------------------------------------------------" << std::endl;
-        int sum_RLE {0};
-        std::cerr << "RLE histogram" << std::endl;
-        for (const auto& [value, frequency] : RLE_frequency){
-            std::cerr << "RLE: " << value+1 << " with frequency " << frequency << std::endl;
-            sum_RLE+=frequency;
-        }
-        std::cerr << "sum RLE " << sum_RLE << std::endl;
-    }
-
-    void push_header(OutputBitStream& stream, dct::Quality q, u16 height, u16 width){
-        stream.push_bits(q, 2);
-        stream.push_u16(height);
-        stream.push_u16(width);
+    void push_header(OutputBitStream& stream, const Header& header){
+        stream.push_bits(header.quality, 2);
+        stream.push_bits(header.precision, 2);
+        stream.push_bits(header.num_references - 1, 3);
+        stream.push_bit(header.long_term);
+        stream.push_bits(header.max_B_frames, 3);
+        stream.push_bit(header.partitions);
+        stream.push_bit(header.skip);
+        stream.push_bit(header.low_latency);
+        stream.push_bit(header.repeat);
+        stream.push_u16(header.height);
+        stream.push_u16(header.width);
+        stream.push_u16(header.fps_numerator);
+        stream.push_u16(header.fps_denominator);
     }
 
     void push_value(OutputBitStream& stream, int num){
@@ -119,6 +100,32 @@ namespace stream{
         }
     }
 
+    void push_reference_index(OutputBitStream& stream, u32 index, u32 num_references){
+        // truncated unary code (index ones followed by a zero unless it is the last reference)
+        for(u32 count = 0; count < index; count++)
+            stream.push_bit(1);
+        if(index + 1 < num_references)
+            stream.push_bit(0);
+    }
+
+    void push_prediction_mode(OutputBitStream& stream, motion::PredictionMode mode){
+        // 0=forward 10=backward 11=bidirectional
+        if(mode == motion::PredictionMode::forward){
+            stream.push_bit(0);
+        }else{
+            stream.push_bit(1);
+            stream.push_bit(mode == motion::PredictionMode::bidirectional);
+        }
+    }
+
+    void push_partition(OutputBitStream& stream, motion::Partition partition){
+        // 0=16x16 10=16x8 110=8x16 111=8x8
+        for(u32 count = 0; count < u32(partition); count++)
+            stream.push_bit(1);
+        if(partition != motion::Partition::quarters)
+            stream.push_bit(0);
+    }
+
     void push_delta_value(OutputBitStream& stream, int num){
         if(num > 0){
             // positive start with 10
@@ -130,7 +137,7 @@ namespace stream{
             stream.push_bit(1);
             num *= -1;
         }
-        for(u16 i = 0; i < num-1; i++){
+        for(int i = 0; i < num-1; i++){
             stream.push_bit(1);
         }
         stream.push_bit(0);
@@ -181,8 +188,7 @@ namespace stream{
     void push_quantized_array_delta(OutputBitStream& stream, const Array64& array){
 
         Array64 delta_values = quantized_to_delta(array);
-        for(double delta : delta_values)
-            delta_frequency[delta]++;
+        STATS_DELTAS(delta_values);
 
         // Send first 2 values as normal
         push_value(stream, delta_values.at(0));
@@ -192,9 +198,11 @@ namespace stream{
         u32 idx = 2;
         while(idx < 64){
             if(delta_values.at(idx) < -5){
+                STATS_COUNT(escape_symbols, 1);
                 push_symbol_huffman(stream, -100);
                 push_unary(stream, -1 * delta_values.at(idx++));
             }else if(delta_values.at(idx) > 5){
+                STATS_COUNT(escape_symbols, 1);
                 push_symbol_huffman(stream, 100);
                 push_unary(stream, delta_values.at(idx++));
             }else if(delta_values.at(idx) != 0){
@@ -220,20 +228,95 @@ namespace stream{
         }
     }
 
+    /* ----- Bit cost estimation -----*/
+
+    u32 reference_index_bits(u32 index, u32 num_references){
+        return index + ((index + 1 < num_references) ? 1 : 0);
+    }
+
+    u32 prediction_mode_bits(motion::PredictionMode mode){
+        return (mode == motion::PredictionMode::forward) ? 1 : 2;
+    }
+
+    u32 partition_bits(motion::Partition partition){
+        return u32(partition) + ((partition != motion::Partition::quarters) ? 1 : 0);
+    }
+
+    u32 delta_value_bits(int num){
+        // sign code (none for 0) followed by |num| in unary
+        return (num == 0) ? 1 : 2 + std::abs(num);
+    }
+
+    u32 quantized_array_delta_bits(const Array64& array){
+        // lengths of the Huffman codes of the deltas -5 to 5, copied out of the map once
+        static const std::array<u32, 11> delta_length = []{
+            std::array<u32, 11> lengths;
+            for(int delta = -5; delta <= 5; delta++)
+                lengths.at(delta + 5) = symbol_length.at(delta);
+            return lengths;
+        }();
+        const u32 escape_length = symbol_length.at(100);
+        const u32 eight_zeros_length = symbol_length.at(120);
+        const u32 EOB_length = symbol_length.at(150);
+
+        // the first 2 values are sent with a sign bit and 16 bits
+        u32 bits = 2 * 17;
+        u32 idx = 2;
+        while(idx < 64){
+            int delta = array[idx] - array[idx-1];
+            if(delta < -5 || delta > 5){
+                // escape symbol followed by the magnitude in unary
+                bits += escape_length + std::abs(delta) + 1;
+                idx++;
+            }else if(delta != 0){
+                bits += delta_length[delta + 5];
+                idx++;
+            }else{
+                u32 num_zeros = 0;
+                while(idx < 64 && array[idx] == array[idx-1]){
+                    num_zeros++;
+                    idx++;
+                }
+                if(idx == 64)
+                    return bits + EOB_length;
+                bits += (num_zeros / 8) * eight_zeros_length + (num_zeros % 8) * delta_length[5];
+            }
+        }
+        return bits;
+    }
+
     /* ----- Decompressor code -----*/
 
-    void read_header(InputBitStream& stream, dct::Quality& quality, u16& height, u16& width){
+    void read_header(InputBitStream& stream, Header& header){
         u32 q = stream.read_bits(2);
         if(q == 0){
-            quality = dct::Quality::low;
+            header.quality = dct::Quality::low;
         }else if (q == 1){
-            quality = dct::Quality::medium;
+            header.quality = dct::Quality::medium;
+        }else{
+            header.quality = dct::Quality::high;
+        }
+
+        u32 p = stream.read_bits(2);
+        if(p == 0){
+            header.precision = motion::Precision::integer;
+        }else if(p == 1){
+            header.precision = motion::Precision::half;
         }else{
-            quality = dct::Quality::high;
+            header.precision = motion::Precision::quarter;
         }
 
-       height = stream.read_u16();
-       width = stream.read_u16();
+        header.num_references = stream.read_bits(3) + 1;
+        header.long_term = stream.read_bit();
+        header.max_B_frames = stream.read_bits(3);
+        header.partitions = stream.read_bit();
+        header.skip = stream.read_bit();
+        header.low_latency = stream.read_bit();
+        header.repeat = stream.read_bit();
+        header.height = stream.read_u16();
+        header.width = stream.read_u16();
+        header.fps_numerator = stream.read_u16();
+        header.fps_denominator = stream.read_u16();
     }
 
     int read_value(InputBitStream& stream){
@@ -252,6 +335,28 @@ namespace stream{
         return num;
     }
 
+    u32 read_reference_index(InputBitStream& stream, u32 num_references){
+        u32 index = 0;
+        while(index + 1 < num_references && stream.read_bit())
+            index++;
+        return index;
+    }
+
+    motion::PredictionMode read_prediction_mode(InputBitStream& stream){
+        if(stream.read_bit() == 0)
+            return motion::PredictionMode::forward;
+        if(stream.read_bit() == 0)
+            return motion::PredictionMode::backward;
+        return motion::PredictionMode::bidirectional;
+    }
+
+    motion::Partition read_partition(InputBitStream& stream){
+        u32 partition = 0;
+        while(partition < motion::Partition::quarters && stream.read_bit())
+            partition++;
+        return motion::Partition(partition);
+    }
+
     int read_delta_value(InputBitStream& stream){
         if(stream.read_bit() == 0){
             return 0;
@@ -317,8 +422,10 @@ namespace stream{
         while(idx < 64){
             int curr_symbol = read_symbol_huffman(stream);
             if(curr_symbol == -100){
+                STATS_COUNT(escape_symbols, 1);
                 delta_values.at(idx++) = -1 * read_unary(stream);
             }else if(curr_symbol == 100){
+                STATS_COUNT(escape_symbols, 1);
                 delta_values.at(idx++) = 1 * read_unary(stream);
             }else if(curr_symbol == 120){
                 for(u32 i = 0; i < 8; i++)
@@ -0,0 +1,135 @@
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "telemetry.hpp"
+
+namespace telemetry{
+
+    TelemetryWriter::TelemetryWriter(const std::string& destination, std::size_t capacity):
+        destination{destination}, capacity{capacity}, fd{-1}, owns_fd{false}, stopping{false}, num_dropped{0} {
+        queue.reserve(capacity);
+        worker = std::thread {&TelemetryWriter::run, this};
+    }
+
+    TelemetryWriter::~TelemetryWriter(){
+        finish();
+    }
+
+    void TelemetryWriter::finish(){
+        if(!worker.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock {queue_mutex};
+            stopping = true;
+        }
+        queue_ready.notify_one();
+        worker.join();
+        if(owns_fd && fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+
+    void TelemetryWriter::push(const FrameRecord& record){
+        {
+            std::lock_guard<std::mutex> lock {queue_mutex};
+            if(queue.size() >= capacity){
+                num_dropped++;
+                return;
+            }
+            queue.push_back(record);
+        }
+        queue_ready.notify_one();
+    }
+
+    // Opens the destination without blocking, returns false if it is not ready yet
+    // (a named pipe which nobody is reading from)
+    bool TelemetryWriter::open_destination(){
+        if(destination.rfind("fd:", 0) == 0){
+            fd = std::stoi(destination.substr(3));
+            return true;
+        }
+        fd = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+        if(fd < 0)
+            return false;
+        owns_fd = true;
+        // only the open should be non-blocking, writes happen on this thread anyway
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        return true;
+    }
+
+    void TelemetryWriter::write_record(const FrameRecord& record){
+        std::ostringstream line;
+        u32 num_blocks = record.I_blocks + record.P_blocks;
+        line << "{\"frame\":" << record.frame
+             << ",\"latency_ms\":" << record.latency_ms
+             << ",\"bits\":" << record.bits
+             << ",\"I_blocks\":" << record.I_blocks
+             << ",\"P_blocks\":" << record.P_blocks
+             << ",\"P_ratio\":" << (num_blocks ? double(record.P_blocks) / num_blocks : 0)
+             << ",\"bad_motion_vectors\":" << record.bad_motion_vectors
+             << ",\"intra_frame\":" << (record.intra_frame ? "true" : "false")
+             << ",\"scene_cut\":" << (record.scene_cut ? "true" : "false")
+             << ",\"B_frame\":" << (record.B_frame ? "true" : "false")
+             << ",\"qscale\":" << record.qscale
+             << ",\"buffer_bits\":" << record.buffer_bits
+             << "}\n";
+        std::string text = line.str();
+        std::size_t offset = 0;
+        while(fd >= 0 && offset < text.size()){
+            ssize_t written = write(fd, text.data() + offset, text.size() - offset);
+            if(written < 0 && errno == EINTR)
+                continue;
+            if(written < 0){
+                // the reader went away, stop writing but keep the encoder running
+                if(owns_fd)
+                    close(fd);
+                fd = -1;
+                return;
+            }
+            offset += written;
+        }
+    }
+
+    void TelemetryWriter::run(){
+        // A closed pipe should make write() fail on this thread instead of
+        // delivering SIGPIPE to the whole process
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        std::vector<FrameRecord> batch;
+        batch.reserve(capacity);
+        bool opened = false;
+        bool done = false;
+        while(!done){
+            {
+                std::unique_lock<std::mutex> lock {queue_mutex};
+                // until the destination is open, poll for it every 100ms
+                if(opened)
+                    queue_ready.wait(lock, [this]{ return stopping || !queue.empty(); });
+                else
+                    queue_ready.wait_for(lock, std::chrono::milliseconds(100), [this]{ return stopping; });
+                done = stopping;
+                // swapping keeps the preallocated storage of both vectors
+                batch.swap(queue);
+            }
+            if(!opened)
+                opened = open_destination();
+            if(opened){
+                for(const FrameRecord& record : batch)
+                    write_record(record);
+            }else{
+                // nobody is listening yet, live records are not worth keeping
+                num_dropped += batch.size();
+            }
+            batch.clear();
+        }
+    }
+
+} // namespace telemetry
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include "thread_pool.hpp"
+
+namespace thread_pool{
+
+    namespace{
+        // the pool and queue of the worker running on this thread
+        thread_local const ThreadPool* current_pool = nullptr;
+        thread_local u32 current_worker = 0;
+    }
+
+    ThreadPool::ThreadPool(u32 num_threads): pending{0}, num_waiting{0}, next_queue{0}, num_steals{0}, stopping{false} {
+        num_threads = std::max(num_threads, 1u);
+        for(u32 idx = 0; idx < num_threads; idx++)
+            queues.push_back(std::make_unique<Queue>());
+        for(u32 idx = 0; idx < num_threads; idx++)
+            workers.emplace_back(&ThreadPool::run, this, idx);
+    }
+
+    ThreadPool::~ThreadPool(){
+        {
+            std::lock_guard<std::mutex> lock {sleep_mutex};
+            stopping = true;
+        }
+        wake.notify_all();
+        for(std::thread& worker: workers)
+            worker.join();
+    }
+
+    void ThreadPool::submit(std::function<void()> task){
+        u32 queue_idx = (current_pool == this) ? current_worker : next_queue.fetch_add(1) % queues.size();
+        // counted first, a worker which sees the count but not the task yet looks again
+        pending.fetch_add(1);
+        {
+            Queue& queue = *queues.at(queue_idx);
+            std::lock_guard<std::mutex> lock {queue.mutex};
+            queue.tasks.push_back(std::move(task));
+        }
+        std::lock_guard<std::mutex> lock {sleep_mutex};
+        wake.notify_one();
+    }
+
+    void ThreadPool::wait_until(const std::function<bool()>& done){
+        // a thread which is not a worker of this pool only steals
+        u32 worker_idx = (current_pool == this) ? current_worker : queues.size();
+        while(!done()){
+            if(run_one(worker_idx))
+                continue;
+            // counted before done() is checked again, so a task which ends now sees the waiter
+            num_waiting.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lock {sleep_mutex};
+                wake.wait(lock, [&]{ return stopping || pending.load() > 0 || done(); });
+            }
+            num_waiting.fetch_sub(1);
+        }
+    }
+
+    void ThreadPool::run(u32 worker_idx){
+        current_pool = this;
+        current_worker = worker_idx;
+        while(true){
+            if(run_one(worker_idx))
+                continue;
+            std::unique_lock<std::mutex> lock {sleep_mutex};
+            wake.wait(lock, [&]{ return stopping || pending.load() > 0; });
+            if(stopping)
+                return;
+        }
+    }
+
+    bool ThreadPool::run_one(u32 worker_idx){
+        if(pending.load() == 0)
+            return false;
+        u32 num_queues = queues.size();
+        std::function<void()> task;
+        if(worker_idx < num_queues){
+            Queue& own = *queues.at(worker_idx);
+            std::lock_guard<std::mutex> lock {own.mutex};
+            if(!own.tasks.empty()){
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+            }
+        }
+        for(u32 offset = 1; !task && offset <= num_queues; offset++){
+            u32 idx = (worker_idx + offset) % num_queues;
+            if(idx == worker_idx)
+                continue;
+            Queue& other = *queues.at(idx);
+            std::lock_guard<std::mutex> lock {other.mutex};
+            if(!other.tasks.empty()){
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                if(worker_idx < num_queues)
+                    num_steals.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if(!task)
+            return false;
+        pending.fetch_sub(1);
+        task();
+        task_done();
+        return true;
+    }
+
+    // A thread in wait_until may be waiting for what the task did
+    void ThreadPool::task_done(){
+        if(num_waiting.load() == 0)
+            return;
+        std::lock_guard<std::mutex> lock {sleep_mutex};
+        wake.notify_all();
+    }
+
+} // namespace thread_pool
@@ -0,0 +1,302 @@
+/* uvid_batch.cpp
+
+   Runs many encodes and decodes in one process on one shared work-stealing
+   thread pool, instead of one single-threaded uvid_compress or
+   uvid_decompress process per stream.
+
+     ./uvid_batch <manifest> [--threads <n>]
+
+   Every line of the manifest is one stream (blank lines and lines starting
+   with # are skipped):
+
+     encode <input.raw> <output.uvi> <width> <height> <low/medium/high> [options of uvid_compress]
+     encode <input.y4m> <output.uvi> <low/medium/high> [options of uvid_compress]
+     decode <input.uvi> <output.raw or output.y4m>
+
+   As with uvid_compress, an encode with the quality right after the paths
+   reads a Y4M input, and a decode writes Y4M if the output ends in .y4m.
+
+   Each stream is a task which handles one frame and then submits itself
+   again, and each frame splits into tasks for its rows of macro-blocks, so
+   the streams share the workers and a stream with a large frame still uses
+   all of them. The outputs are the same as those of uvid_compress and
+   uvid_decompress. At the end the aggregate throughput and the latency of
+   the frames of each stream (the time a frame took to encode or decode and
+   write) are printed on stderr.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <cstdint>
+#include "uvid.hpp"
+#include "helper.hpp"
+#include "thread_pool.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+void print_usage(const char* program){
+    std::cerr << "Usage: " << program << " <manifest> [--threads <n>]" << std::endl;
+    std::cerr << "Manifest lines:" << std::endl;
+    std::cerr << "  encode <input.raw> <output.uvi> <width> <height> <low/medium/high> [options of uvid_compress]" << std::endl;
+    std::cerr << "  encode <input.y4m> <output.uvi> <low/medium/high> [options of uvid_compress]" << std::endl;
+    std::cerr << "  decode <input.uvi> <output.raw or output.y4m>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --threads <n>        workers of the thread pool (default the number of cores)" << std::endl;
+}
+
+// One line of the manifest, the input and output files stay open while it runs
+struct Stream {
+    u32 line;
+    bool encode;
+    bool y4m;
+    std::string input_path, output_path;
+    std::ifstream input;
+    std::ofstream output;
+    std::unique_ptr<uvid::Encoder> encoder;
+    std::unique_ptr<YUVStreamReader> reader;
+    std::unique_ptr<uvid::Decoder> decoder;
+    std::unique_ptr<YUVStreamWriter> writer;
+    std::vector<u8> buffer;     // packet of the encoder, chunk of input of the decoder
+    std::string error;
+
+    u32 frames {0};
+    u64 pixels {0};
+    double total_ms {0};
+    double max_ms {0};
+    clock_type::time_point start, end;
+};
+
+// Splits a manifest line into words, the encoder options are parsed from them like argv
+std::vector<std::string> split_words(const std::string& line){
+    std::istringstream words {line};
+    std::vector<std::string> result;
+    for(std::string word; words >> word;)
+        result.push_back(word);
+    return result;
+}
+
+// Opens the files and sets up the encoder or decoder of a manifest line, returns an error message
+std::string open_stream(Stream& stream, std::vector<std::string>& words, thread_pool::ThreadPool& pool){
+    stream.encode = words.at(0) == "encode";
+    if(!stream.encode && words.at(0) != "decode")
+        return "unknown command " + words.at(0);
+    // a quality right after the paths means the input is Y4M
+    stream.y4m = stream.encode ? words.size() >= 4 && helper::get_quality(words.at(3)) != dct::Quality::ERROR
+                               : words.size() == 3 && words.at(2).size() > 4 && words.at(2).substr(words.at(2).size() - 4) == ".y4m";
+    if((stream.encode && words.size() < (stream.y4m ? 4u : 6u)) || (!stream.encode && words.size() != 3))
+        return "wrong number of arguments";
+    stream.input_path = words.at(1);
+    stream.output_path = words.at(2);
+
+    stream.input.open(stream.input_path, std::ios::binary);
+    if(!stream.input)
+        return "unable to open " + stream.input_path;
+    if(stream.encode){
+        uvid::EncoderParams params;
+        u32 first_option = 6;
+        if(stream.y4m){
+            Y4MHeader header;
+            std::string error;
+            if(!read_y4m_header(stream.input, header, error))
+                return stream.input_path + ": " + error;
+            params.width = header.width;
+            params.height = header.height;
+            params.fps_numerator = header.fps_numerator;
+            params.fps_denominator = header.fps_denominator;
+            first_option = 4;
+        }else{
+            params.width = std::stoi(words.at(3));
+            params.height = std::stoi(words.at(4));
+        }
+        params.quality = helper::get_quality(words.at(first_option - 1));
+        if(params.quality == dct::Quality::ERROR)
+            return "invalid quality " + words.at(first_option - 1);
+        std::vector<char*> argv;
+        for(std::string& word: words)
+            argv.push_back(word.data());
+        int argc = argv.size();
+        for(int idx = first_option; idx < argc; idx++)
+            if(!helper::parse_encoder_option(argc, argv.data(), idx, params))
+                return "invalid option " + words.at(idx);
+        params.pool = &pool;
+        try{
+            stream.encoder = std::make_unique<uvid::Encoder>(params);
+        }catch(const std::exception& error){
+            return error.what();
+        }
+        stream.reader = std::make_unique<YUVStreamReader>(stream.input, params.width, params.height, stream.y4m);
+    }else{
+        stream.decoder = std::make_unique<uvid::Decoder>(&pool);
+    }
+
+    stream.output.open(stream.output_path, std::ios::binary);
+    if(!stream.output)
+        return "unable to open " + stream.output_path;
+    return "";
+}
+
+// Encodes the next frame and writes the packets it gave, false at the end of the input
+bool encode_step(Stream& stream){
+    if(!stream.reader->read_next_frame()){
+        stream.encoder->finish();
+        while(stream.encoder->pull_packet(stream.buffer))
+            stream.output.write(reinterpret_cast<const char*>(stream.buffer.data()), stream.buffer.size());
+        return false;
+    }
+    YUVFrame420& frame = stream.reader->frame();
+    stream.pixels += u64(frame.get_Width()) * frame.get_Height();
+    stream.encoder->push_frame(frame);
+    while(stream.encoder->pull_packet(stream.buffer))
+        stream.output.write(reinterpret_cast<const char*>(stream.buffer.data()), stream.buffer.size());
+    return true;
+}
+
+// Pushes input until the decoder gives the next frame and writes it, false at the end of the stream
+bool decode_step(Stream& stream){
+    const std::size_t chunk_size = 1 << 16;
+    uvid::Decoder& decoder = *stream.decoder;
+    while(true){
+        if(decoder.has_header()){
+            if(!stream.writer && stream.y4m)
+                stream.writer = std::make_unique<YUVStreamWriter>(stream.output, helper::y4m_header(decoder));
+            else if(!stream.writer)
+                stream.writer = std::make_unique<YUVStreamWriter>(stream.output, decoder.width(), decoder.height());
+            // the writer's frame and the decoded frame trade buffers
+            if(decoder.pull_frame(stream.writer->frame())){
+                stream.writer->write_frame();
+                stream.pixels += u64(decoder.width()) * decoder.height();
+                return true;
+            }
+        }
+        if(decoder.done() || !stream.input)
+            return false;
+        stream.buffer.resize(chunk_size);
+        stream.input.read(reinterpret_cast<char*>(stream.buffer.data()), stream.buffer.size());
+        decoder.push_packet(stream.buffer.data(), stream.input.gcount());
+        if(!stream.input)
+            decoder.finish();
+    }
+}
+
+int main(int argc, char** argv){
+
+    if(argc < 2){
+        print_usage(argv[0]);
+        return 1;
+    }
+    u32 num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for(int idx = 2; idx < argc; idx++){
+        std::string arg = argv[idx];
+        if(arg == "--threads" && idx+1 < argc && std::stoi(argv[idx+1]) >= 1){
+            num_threads = std::stoi(argv[++idx]);
+        }else{
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::ifstream manifest {argv[1]};
+    if(!manifest){
+        std::cerr << "Unable to open " << argv[1] << std::endl;
+        return 1;
+    }
+    thread_pool::ThreadPool pool {num_threads};
+
+    // The streams are never moved once they are set up, the tasks refer to them
+    std::vector<std::unique_ptr<Stream>> streams;
+    u32 line_number = 0;
+    for(std::string line; std::getline(manifest, line);){
+        line_number++;
+        std::vector<std::string> words = split_words(line);
+        if(words.empty() || words.at(0).at(0) == '#')
+            continue;
+        auto stream = std::make_unique<Stream>();
+        stream->line = line_number;
+        std::string error;
+        try{
+            error = open_stream(*stream, words, pool);
+        }catch(const std::logic_error&){
+            // std::stoi of a size which is not a number
+            error = "invalid number";
+        }
+        if(!error.empty()){
+            std::cerr << argv[1] << ":" << line_number << ": " << error << std::endl;
+            return 1;
+        }
+        streams.push_back(std::move(stream));
+    }
+    if(streams.empty()){
+        std::cerr << argv[1] << ": no streams" << std::endl;
+        return 1;
+    }
+
+    // Each step handles one frame of a stream and submits the next step, so a stream
+    // is only ever run by one thread at a time
+    std::atomic<u32> streams_done {0};
+    std::function<void(Stream&)> step = [&](Stream& stream){
+        auto frame_start = clock_type::now();
+        bool more = false;
+        try{
+            more = stream.encode ? encode_step(stream) : decode_step(stream);
+        }catch(const std::exception& error){
+            stream.error = error.what();
+        }
+        auto frame_end = clock_type::now();
+        if(more){
+            std::chrono::duration<double, std::milli> latency = frame_end - frame_start;
+            stream.frames++;
+            stream.total_ms += latency.count();
+            stream.max_ms = std::max(stream.max_ms, latency.count());
+            pool.submit([&step, &stream]{ step(stream); });
+            return;
+        }
+        stream.output.flush();
+        if(!stream.output && stream.error.empty())
+            stream.error = "unable to write " + stream.output_path;
+        stream.end = frame_end;
+        streams_done.fetch_add(1);
+    };
+
+    auto start = clock_type::now();
+    for(auto& stream: streams){
+        stream->start = start;
+        Stream& pumped = *stream;
+        pool.submit([&step, &pumped]{ step(pumped); });
+    }
+    pool.wait_until([&]{ return streams_done.load() == streams.size(); });
+    std::chrono::duration<double> wall = clock_type::now() - start;
+
+    // Per-stream latency, then the aggregate throughput
+    bool failed = false;
+    u64 total_frames = 0, total_pixels = 0;
+    std::cerr << std::fixed << std::setprecision(2);
+    for(auto& stream: streams){
+        std::chrono::duration<double> seconds = stream->end - stream->start;
+        double mean_ms = stream->frames > 0 ? stream->total_ms / stream->frames : 0;
+        std::cerr << (stream->encode ? "encode " : "decode ") << stream->output_path << ": " << stream->frames << " frames in " << seconds.count() << " s, "
+                  << "latency mean " << mean_ms << " ms max " << stream->max_ms << " ms" << std::endl;
+        if(!stream->error.empty()){
+            std::cerr << argv[1] << ":" << stream->line << ": " << stream->error << std::endl;
+            failed = true;
+        }
+        if(stream->encoder && stream->encoder->buffer_overflows() > 0)
+            std::cerr << "  rate control: " << stream->encoder->buffer_overflows() << " frames did not fit in the decoder buffer" << std::endl;
+        total_frames += stream->frames;
+        total_pixels += stream->pixels;
+    }
+    std::cerr << streams.size() << " streams, " << total_frames << " frames in " << wall.count() << " s on " << pool.size() << " threads: "
+              << total_frames / wall.count() << " frames/s, " << total_pixels / wall.count() / 1e6 << " Mpixels/s ("
+              << pool.steals() << " tasks stolen)" << std::endl;
+    return failed ? 1 : 0;
+}
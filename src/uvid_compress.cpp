@@ -13,124 +13,197 @@
    Note that since the width/height of each frame is not encoded into the raw
    video stream, those values must be provided to the program as arguments.
 
+   A YUV4MPEG2 (.y4m) stream can also be read directly, the frame size and
+   rate then come from its header and only the quality is given:
+
+     ./this_program <low/medium/high> [options] < videofile.y4m
+
    B. Bird - 2023-07-08
 */
 
 #include <iostream>
 #include <fstream>
-#include <array>
 #include <string>
+#include <vector>
 #include <cassert>
 #include <cstdint>
-#include <tuple>
-#include <queue>
-#include <map>
-#include "output_stream.hpp"
-#include "stream.hpp"
-#include "yuv_stream.hpp"
-#include "discrete_cosine_transform.hpp"
+#include <memory>
+#include <stdexcept>
+#include "uvid.hpp"
 #include "helper.hpp"
-
+#include "stats.hpp"
+#include "read_ahead.hpp"
+#include "motion_analysis.hpp"
+
+
+void print_usage(const char* program){
+    std::cerr << "Usage: " << program << " <width> <height> <low/medium/high> [options] < input.raw" << std::endl;
+    std::cerr << "       " << program << " <low/medium/high> [options] < input.y4m" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --mv-precision <integer/half/quarter>  motion vector precision (default quarter)" << std::endl;
+    std::cerr << "  --refs <1-8>         number of previous frames used as references (default 2)" << std::endl;
+    std::cerr << "  --long-term <n>      keep every n-th frame as a long-term reference (default 0, disabled)" << std::endl;
+    std::cerr << "  --bframes <0-7>      B-frames between reference frames, frames are delayed by as many (default 0)" << std::endl;
+    std::cerr << "  --qscale <0-63>      quantizer scale, every 8 steps double the quantization step (default 32, the step of the quality)" << std::endl;
+    std::cerr << "  --bitrate <kbps>     target bitrate, the qscale of each frame is chosen by the rate control" << std::endl;
+    std::cerr << "  --rate-control <cbr/vbr>  cbr follows the bitrate, vbr keeps --qscale unless the buffer would overflow (default cbr)" << std::endl;
+    std::cerr << "  --vbv-size <kbits>   decoder buffer size the stream must fit (default one second of the bitrate, none for --pass 2)" << std::endl;
+    std::cerr << "  --pass <1/2>         1 only analyses the input and writes the pass file, 2 uses it to share out the bits" << std::endl;
+    std::cerr << "  --pass-file <path>   first pass statistics (default uvid_pass.log)" << std::endl;
+    std::cerr << "  --target-size <kB>   size of the output of --pass 2, instead of --bitrate" << std::endl;
+    std::cerr << "  --fps <n>            frame rate (n, n/d or 29.97) stored in the stream and used by the rate control (default 30 or that of the .y4m)" << std::endl;
+    std::cerr << "  --partitions         also try 16x8, 8x16 and 8x8 motion partitions in P-frames" << std::endl;
+    std::cerr << "  --rdo                choose between I, P and skipped blocks by estimated bits and distortion" << std::endl;
+    std::cerr << "  --low-latency        pad every row of macro-blocks to a byte and write it out as soon as it is encoded" << std::endl;
+    std::cerr << "  --realtime <fps>     lower the search effort of frames whenever the encoder falls behind this frame rate" << std::endl;
+    std::cerr << "  --static             copy the unchanged macro-blocks of P-frames without a search, repeat unchanged frames" << std::endl;
+    std::cerr << "  --early-exit <n>     stop the motion search at an average difference of at most n (default 4, 0 searches every position)" << std::endl;
+    std::cerr << "  --keyint-min <n>     fewest frames between keyframes, closer scene cuts are not keyframes (default 8)" << std::endl;
+    std::cerr << "  --keyint-max <n>     most frames between keyframes (default 250)" << std::endl;
+    std::cerr << "  --read-ahead <1-64>  frames read ahead of the encoder by the input thread (default 4)" << std::endl;
+    std::cerr << "  --rendition <low/medium/high> <path>  also write the input at this quality to a file, the motion search is shared (repeatable)" << std::endl;
+    std::cerr << "  --stats [path]       write a JSON report of timers and counters (stderr without a path)" << std::endl;
+    std::cerr << "  --telemetry <path>   write one JSON line per frame to a file, named pipe or fd:<n>" << std::endl;
+    std::cerr << "  --dump-recon <path>  write the reconstructed frames (what the decompressor outputs) as raw YUV" << std::endl;
+}
 
 int main(int argc, char** argv){
 
-    if (argc < 4){
-        std::cerr << "Usage: " << argv[0] << " <width> <height> <low/medium/high>" << std::endl;
+    // A quality as the first argument means the input is Y4M
+    bool y4m = argc >= 2 && helper::get_quality(argv[1]) != dct::Quality::ERROR;
+    if (!y4m && argc < 4){
+        print_usage(argv[0]);
         return 1;
     }
 
-    // Parse command line arguments
-    u16 width = std::stoi(argv[1]);
-    u16 height = std::stoi(argv[2]);
-    dct::Quality quality = helper::get_quality(argv[3]);
-    if(quality == dct::Quality::ERROR){
-        std::cerr << "Usage: " << argv[0] << " <width> <height> <low/medium/high>" << std::endl;
+    // Parse command line arguments, the options come after the header of a Y4M input so --fps wins over it
+    uvid::EncoderParams params;
+    if(y4m){
+        params.quality = helper::get_quality(argv[1]);
+        Y4MHeader header;
+        std::string error;
+        if(!read_y4m_header(std::cin, header, error)){
+            std::cerr << "Invalid Y4M input: " << error << std::endl;
+            return 1;
+        }
+        params.width = header.width;
+        params.height = header.height;
+        params.fps_numerator = header.fps_numerator;
+        params.fps_denominator = header.fps_denominator;
+        if(header.interlace == 't' || header.interlace == 'b' || header.interlace == 'm')
+            std::cerr << "Warning: the input is interlaced, both fields are encoded together as progressive frames" << std::endl;
+    }else{
+        params.width = std::stoi(argv[1]);
+        params.height = std::stoi(argv[2]);
+        params.quality = helper::get_quality(argv[3]);
+    }
+    if(params.quality == dct::Quality::ERROR){
+        print_usage(argv[0]);
         return 1;
     }
+    u32 read_ahead_depth = 4;
+    std::vector<std::pair<dct::Quality, std::string>> renditions;
+    for(int idx = y4m ? 2 : 4; idx < argc; idx++){
+        std::string arg = argv[idx];
+        if(helper::parse_stats_option(argc, argv, idx)){
+            continue;
+        }else if(helper::parse_encoder_option(argc, argv, idx, params)){
+            continue;
+        }else if(arg == "--read-ahead" && idx+1 < argc && std::stoi(argv[idx+1]) >= 1 && std::stoi(argv[idx+1]) <= 64){
+            read_ahead_depth = std::stoi(argv[++idx]);
+        }else if(arg == "--rendition" && idx+2 < argc && helper::get_quality(argv[idx+1]) != dct::Quality::ERROR){
+            renditions.push_back({helper::get_quality(argv[idx+1]), argv[idx+2]});
+            idx += 2;
+        }else{
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
 
-    // calculate number of macro blocks expected
-    u16 scaled_height = height/2;
-    u16 scaled_width = width/2; 
-    u16 C_blocks_wide = (scaled_width%8 == 0) ? scaled_width/8 : (scaled_width/8)+1;
-    u16 C_blocks_high = (scaled_height%8 == 0) ? scaled_height/8 : (scaled_height/8)+1;
-    u16 num_macro_blocks = C_blocks_wide * C_blocks_high;
-
-    YUVStreamReader reader {std::cin, width, height};
-    OutputBitStream output_stream {std::cout};
-
-    stream::push_header(output_stream, quality, height, width);
-
-    // To manage previous frame 
-    YUVFrame420 previous_frame {width, height};
-    u32 frame_number {0};
-
-    while (reader.read_next_frame()){
-        // Get the active frame
-        YUVFrame420& active_frame = reader.frame();
-        output_stream.push_bit(1);
-
-        // Separate Y Cb and Cr channels
-        auto Y_matrix = helper::create_2d_vector<unsigned char>(height, width);
-        auto Cb_matrix = helper::create_2d_vector<unsigned char>(height/2, width/2);
-        auto Cr_matrix = helper::create_2d_vector<unsigned char>(height/2, width/2);
-        for (u32 y = 0; y < height; y++)
-            for (u32 x = 0; x < width; x++)
-                Y_matrix.at(y).at(x) = active_frame.Y(x,y);
-        for (u32 y = 0; y < height/2; y++)
-            for (u32 x = 0; x < width/2; x++){
-                Cb_matrix.at(y).at(x) = active_frame.Cb(x,y);
-                Cr_matrix.at(y).at(x) = active_frame.Cr(x,y);
-            }
-        
-        // Partition color channels into 8x8 blocks
-        std::vector<Block8x8> Y_blocks, Cb_blocks, Cr_blocks;
-        dct::partition_Y_channel(Y_blocks, height, width, Y_matrix);
-        dct::partition_C_channel(Cb_blocks, height/2, width/2, Cb_matrix);
-        dct::partition_C_channel(Cr_blocks, height/2, width/2, Cr_matrix);
-
-        // To manage previous frame
-        std::list<Block8x8> uncompressed_blocks;
-
-        // To manage active frame
-        std::list<bool> flags;
-        std::list<Block8x8> compressed_blocks;
-        std::list<std::pair<int, int>> motion_vectors;
-        double num_bad_motion_vectors {0};
-        for(u32 macro_idx = 0; macro_idx < num_macro_blocks; macro_idx++){
-            // create 16x16 Y-block
-            u32 Y_idx = 4 * macro_idx;
-            Block16x16 macroblock = dct::create_macroblock(Y_blocks.at(Y_idx), Y_blocks.at(Y_idx+1), Y_blocks.at(Y_idx+2), Y_blocks.at(Y_idx+3));
-
-            // Look for motion vector (assume non found)
-            std::pair<int, int> vector {0, 0};
-            bool good_motion_vector = helper::find_motion_vector(macroblock, previous_frame, macro_idx, vector);
-            if(!good_motion_vector)
-                num_bad_motion_vectors++;
-            if (frame_number && good_motion_vector){
-                flags.push_back(1);
-                motion_vectors.push_back(vector);
-                helper::compress_P_block(compressed_blocks, uncompressed_blocks, macro_idx, Y_blocks, Cb_blocks, Cr_blocks, quality, previous_frame, vector);
-
-            }else{
-                flags.push_back(0);
-                helper::compress_I_block(compressed_blocks, uncompressed_blocks, macro_idx, Y_blocks, Cb_blocks, Cr_blocks, quality);
-            }
+    // Every rendition has its own encoder and output file, only the telemetry and the
+    // reconstruction are of the main output
+    std::unique_ptr<uvid::Encoder> encoder;
+    std::vector<std::unique_ptr<uvid::Encoder>> rendition_encoders;
+    std::vector<std::ofstream> rendition_files;
+    if(!renditions.empty())
+        params.analysis = std::make_shared<motion_analysis::SharedAnalysis>();
+    // In low-latency mode each row of the main output goes out as soon as it is encoded
+    std::vector<u8> row_packet;
+    if(params.low_latency)
+        params.row_sent = [&encoder, &row_packet]{
+            STATS_TIMER(write);
+            while(encoder->pull_packet(row_packet))
+                std::cout.write(reinterpret_cast<const char*>(row_packet.data()), row_packet.size());
+            std::cout.flush();
+        };
+    try{
+        encoder = std::make_unique<uvid::Encoder>(params);
+        for(auto& [quality, path]: renditions){
+            uvid::EncoderParams rendition_params = params;
+            rendition_params.quality = quality;
+            rendition_params.telemetry_path.clear();
+            rendition_params.recon_path.clear();
+            rendition_params.row_sent = nullptr;
+            rendition_encoders.push_back(std::make_unique<uvid::Encoder>(rendition_params));
+            rendition_files.emplace_back(path, std::ios::binary);
+            if(!rendition_files.back())
+                throw std::runtime_error("Unable to open " + path);
         }
-        // Begin to push the frame
-        helper::push_motion_vectors(motion_vectors, output_stream);
-        // send compressed blocks
-        helper::push_compressed_blocks(flags, compressed_blocks, output_stream);
-        // reconstruct prev frame
-        previous_frame = helper::reconstruct_prev_frame(uncompressed_blocks, num_macro_blocks, height, width);
-
-        // Send an I-frame every 120 frames or if too many bad motion vectors
-        if(frame_number > 175 && (num_bad_motion_vectors/num_macro_blocks) >= 0.35)
-            frame_number = 0;
-        else    
-            frame_number++;
+    }catch(const std::invalid_argument& error){
+        std::cerr << "Invalid options: " << error.what() << std::endl;
+        print_usage(argv[0]);
+        return 1;
+    }catch(const std::runtime_error& error){
+        std::cerr << error.what() << std::endl;
+        return 1;
     }
 
-    output_stream.push_bit(0); //Flag to indicate end of data
-    output_stream.flush_to_byte();
+    // The input is read on its own thread, so a stalled pipe does not stall the encoder right away
+    read_ahead::AsyncReader reader {std::cin, params.width, params.height, read_ahead_depth, y4m};
+    std::vector<u8> packet;
+    auto write_packets = [&](){
+        STATS_TIMER(write);
+        while(encoder->pull_packet(packet))
+            std::cout.write(reinterpret_cast<const char*>(packet.data()), packet.size());
+        for(u32 idx = 0; idx < rendition_encoders.size(); idx++)
+            while(rendition_encoders.at(idx)->pull_packet(packet))
+                rendition_files.at(idx).write(reinterpret_cast<const char*>(packet.data()), packet.size());
+    };
+    while(true){
+        YUVFrame420* frame = nullptr;
+        {
+            STATS_TIMER(read);
+            frame = reader.next_frame();
+        }
+        if(!frame)
+            break;
+        // the renditions copy the frame, then the frame and a free lookahead buffer of the
+        // encoder trade buffers and the reader reuses the old one
+        for(auto& rendition: rendition_encoders)
+            rendition->push_frame(frame->Y_plane(), frame->Cb_plane(), frame->Cr_plane());
+        encoder->push_frame(*frame);
+        write_packets();
+    }
+    try{
+        encoder->finish();
+        for(auto& rendition: rendition_encoders)
+            rendition->finish();
+    }catch(const std::runtime_error& error){
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    write_packets();
+    std::cout.flush();
+    for(std::ofstream& file: rendition_files)
+        file.flush();
+
+    stats::report("uvid_compress");
+    for(auto& rendition: rendition_encoders)
+        if(rendition->buffer_overflows() > 0)
+            std::cerr << "Rate control: " << rendition->buffer_overflows() << " frames of a rendition did not fit in the decoder buffer" << std::endl;
+    if(encoder->buffer_overflows() > 0)
+        std::cerr << "Rate control: " << encoder->buffer_overflows() << " frames did not fit in the decoder buffer, raise --vbv-size or --bitrate" << std::endl;
+    if(encoder->telemetry_dropped() > 0)
+        std::cerr << "Telemetry: dropped " << encoder->telemetry_dropped() << " records" << std::endl;
     return 0;
-}
\ No newline at end of file
+}
@@ -12,90 +12,100 @@
      ffplay -f rawvideo -pixel_format yuv420p -framerate 30 -video_size 352x288 - 2>/dev/null
    (where the resolution is explicitly given as an argument to ffplay).
 
+   With --y4m the output is a YUV4MPEG2 stream with the frame size and rate of
+   the compressed stream, which ffplay and ffmpeg take without any arguments.
+
+   With --scale 1/2, 1/4 or 1/8 the frames are decoded at that fraction of
+   their size (1/8 from the DC coefficients alone), for thumbnails and
+   previews at a fraction of the cost of a full decode.
+
+   With --keyframes only the keyframes are output, and the frames between
+   them are skipped by their lengths without being decoded, to index or
+   scrub through a long stream.
+
+   The input is pushed to the decoder as soon as it arrives, so the rows of a
+   stream from uvid_compress --low-latency are reconstructed while the rest
+   of their frame is still being encoded.
+
    B. Bird - 2023-07-08
 */
 
 #include <iostream>
-#include <fstream>
-#include <array>
-#include <string>
+#include <vector>
 #include <cassert>
-#include <queue>
-#include <list>
 #include <cstdint>
-#include <tuple>
-#include "input_stream.hpp"
-#include "yuv_stream.hpp"
-#include "discrete_cosine_transform.hpp"
-#include "stream.hpp"
+#include <memory>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include "uvid.hpp"
 #include "helper.hpp"
+#include "stats.hpp"
 
 
 int main(int argc, char** argv){
 
-    //Note: This program must not take any command line arguments. (Anything
-    //      it needs to know about the data must be encoded into the bitstream)
-    
-    InputBitStream input_stream {std::cin};
-
-    dct::Quality quality;
-    u16 height, width;
-    stream::read_header(input_stream, quality, height, width);
-
-    // calculate number of macro blocks expected
-    u16 scaled_height = height/2;
-    u16 scaled_width = width/2; 
-    u16 C_blocks_wide = (scaled_width%8 == 0) ? scaled_width/8 : (scaled_width/8)+1;
-    u16 C_blocks_high = (scaled_height%8 == 0) ? scaled_height/8 : (scaled_height/8)+1;
-    u16 num_macro_blocks = C_blocks_wide * C_blocks_high;
-
-    YUVStreamWriter writer {std::cout, width, height};
-
-    // To store uncompressed blocks 
-    YUVFrame420 previous_frame {width, height};
-
-    while (input_stream.read_bit()){
-
-        // Read the motion vectors
-        std::list<std::pair<int, int>> motion_vectors;
-        helper::read_motion_vectors(motion_vectors, input_stream);
-        
-        // read blocks for each color channel in row major order
-        std::vector<Block8x8> Y_blocks, Cb_blocks, Cr_blocks;
+    //Note: Anything the program needs to know about the data must be encoded
+    //      into the bitstream, the only arguments are for instrumentation
+    bool y4m = false;
+    u32 downscale = 1;
+    bool keyframes_only = false;
+    for(int idx = 1; idx < argc; idx++){
+        std::string arg = argv[idx];
+        if(arg == "--y4m"){
+            y4m = true;
+        }else if(arg == "--scale" && idx+1 < argc && (std::string(argv[idx+1]) == "1" || std::string(argv[idx+1]) == "1/2" ||
+            std::string(argv[idx+1]) == "1/4" || std::string(argv[idx+1]) == "1/8")){
+            std::string scale = argv[++idx];
+            downscale = (scale == "1") ? 1 : std::stoi(scale.substr(2));
+        }else if(arg == "--keyframes"){
+            keyframes_only = true;
+        }else if(!helper::parse_stats_option(argc, argv, idx)){
+            std::cerr << "Usage: " << argv[0] << " [--y4m] [--scale <1, 1/2, 1/4 or 1/8>] [--keyframes] [--stats [path]]" << std::endl;
+            return 1;
+        }
+    }
 
-        for(u32 macro_idx = 0; macro_idx < num_macro_blocks; macro_idx++){
-            bool block_type = input_stream.read_bit();
-            if(block_type == 0){
-                // I-block
-                helper::decompress_I_block(Y_blocks, Cb_blocks, Cr_blocks, quality, input_stream);
-            }else{
-                //P-block
-                helper::decompress_P_block(Y_blocks, Cb_blocks, Cr_blocks, quality, input_stream, macro_idx, motion_vectors.front(), previous_frame);
-                motion_vectors.pop_front();
+    // The input is pushed in chunks of whatever has arrived (up to chunk_size), the decoder keeps the
+    // part of a frame which is not complete yet
+    const std::size_t chunk_size = 1 << 16;
+    std::vector<u8> chunk(chunk_size);
+    uvid::Decoder decoder {nullptr, downscale, keyframes_only};
+    std::unique_ptr<YUVStreamWriter> writer;
+    while(true){
+        bool end_of_input = false;
+        {
+            STATS_TIMER(read);
+            ssize_t count = read(STDIN_FILENO, chunk.data(), chunk.size());
+            // a signal arriving while waiting for a pipe is not the end of the stream
+            while(count < 0 && errno == EINTR)
+                count = read(STDIN_FILENO, chunk.data(), chunk.size());
+            if(count < 0){
+                std::cerr << "Unable to read the input: " << std::strerror(errno) << std::endl;
+                return 1;
             }
+            if(count > 0)
+                decoder.push_packet(chunk.data(), count);
+            end_of_input = count == 0;
         }
-
-        auto Y_matrix = helper::create_2d_vector<unsigned char>(height,width);
-        auto Cb_matrix = helper::create_2d_vector<unsigned char>(height/2 ,width/2);
-        auto Cr_matrix = helper::create_2d_vector<unsigned char>(height/2 ,width/2);
-        dct::undo_partition_Y_channel(Y_blocks, height, width, Y_matrix);
-        dct::undo_partition_C_channel(Cb_blocks, height/2 ,width/2, Cb_matrix);
-        dct::undo_partition_C_channel(Cr_blocks, height/2 ,width/2, Cr_matrix);
-
-        // Create and write into frame
-        YUVFrame420& active_frame = writer.frame();
-        writer.write_frame();
-        for (u32 y = 0; y < height; y++)
-            for (u32 x = 0; x < width; x++)
-                active_frame.Y(x,y) = Y_matrix.at(y).at(x);
-        for (u32 y = 0; y < height/2; y++)
-            for (u32 x = 0; x < width/2; x++){
-                active_frame.Cb(x,y) = Cb_matrix.at(y).at(x);
-                active_frame.Cr(x,y) = Cr_matrix.at(y).at(x);
+        if(end_of_input)
+            decoder.finish();
+        if(decoder.has_header()){
+            if(!writer && y4m)
+                writer = std::make_unique<YUVStreamWriter>(std::cout, helper::y4m_header(decoder));
+            else if(!writer)
+                writer = std::make_unique<YUVStreamWriter>(std::cout, decoder.width(), decoder.height());
+            // the writer's frame and the decoded frame trade buffers
+            while(decoder.pull_frame(writer->frame())){
+                STATS_TIMER(write);
+                writer->write_frame();
             }
-
-        previous_frame = active_frame;
+        }
+        if(end_of_input || decoder.done())
+            break;
     }
 
+    stats::report("uvid_decompress");
     return 0;
-}
\ No newline at end of file
+}
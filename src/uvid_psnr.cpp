@@ -0,0 +1,77 @@
+/* uvid_psnr.cpp
+
+   Compares two raw YCbCr (YUV) 4:2:0 files frame by frame and reports the
+   PSNR of each plane, computed from the mean squared error over all frames.
+
+     ./uvid_psnr <width> <height> <reference.raw> <decoded.raw>
+
+   Output is a single line of the form
+     frames <n> Y <dB> Cb <dB> Cr <dB>
+   Identical planes are reported as a PSNR of 99.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+#include "yuv_stream.hpp"
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+double get_psnr(u64 squared_error, u64 num_samples){
+    if(squared_error == 0 || num_samples == 0)
+        return 99;
+    double mse = double(squared_error) / num_samples;
+    return 10 * std::log10(255.0 * 255.0 / mse);
+}
+
+int main(int argc, char** argv){
+
+    if(argc < 5){
+        std::cerr << "Usage: " << argv[0] << " <width> <height> <reference.raw> <decoded.raw>" << std::endl;
+        return 1;
+    }
+
+    u32 width = std::stoi(argv[1]);
+    u32 height = std::stoi(argv[2]);
+    std::ifstream reference_file {argv[3], std::ios::binary};
+    std::ifstream decoded_file {argv[4], std::ios::binary};
+    if(!reference_file || !decoded_file){
+        std::cerr << "Unable to open input files" << std::endl;
+        return 1;
+    }
+
+    YUVStreamReader reference {reference_file, width, height};
+    YUVStreamReader decoded {decoded_file, width, height};
+
+    u64 Y_error {0}, Cb_error {0}, Cr_error {0};
+    u32 num_frames {0};
+    while(reference.read_next_frame() && decoded.read_next_frame()){
+        YUVFrame420& a = reference.frame();
+        YUVFrame420& b = decoded.frame();
+        for(u32 y = 0; y < height; y++)
+            for(u32 x = 0; x < width; x++){
+                int d = int(a.Y(x,y)) - int(b.Y(x,y));
+                Y_error += d*d;
+            }
+        for(u32 y = 0; y < height/2; y++)
+            for(u32 x = 0; x < width/2; x++){
+                int d = int(a.Cb(x,y)) - int(b.Cb(x,y));
+                Cb_error += d*d;
+                d = int(a.Cr(x,y)) - int(b.Cr(x,y));
+                Cr_error += d*d;
+            }
+        num_frames++;
+    }
+
+    u64 luma_samples = u64(num_frames) * width * height;
+    u64 chroma_samples = luma_samples / 4;
+    std::cout << "frames " << num_frames
+              << " Y " << get_psnr(Y_error, luma_samples)
+              << " Cb " << get_psnr(Cb_error, chroma_samples)
+              << " Cr " << get_psnr(Cr_error, chroma_samples) << std::endl;
+    return 0;
+}
@@ -0,0 +1,226 @@
+/* uvid_synth.cpp
+
+   Deterministic synthetic video generator.
+
+   Writes raw YCbCr (YUV) frames with 4:2:0 subsampling to stdout in the same
+   headerless format read by uvid_compress, so that regression runs do not
+   depend on large sample clips being checked in.
+
+     ./uvid_synth <pattern> <size> <num_frames> [seed] > input.raw
+
+   Patterns:
+     static    a fixed textured image
+     pan       the texture translated by a fractional offset every frame
+     zoom      the texture scaled about the centre of the frame
+     noise     a static image with fresh noise added to every frame
+     scenecut  a slow pan which switches to a new scene every 10 frames
+     detail    a slowly panning high-frequency pattern
+
+   Sizes: cif (352x288), 720p (1280x720), 1080p (1920x1080) or <width>x<height>
+
+   The output only depends on the arguments (the texture is built from integer
+   hashes and basic floating point arithmetic), so the same command produces
+   the same bytes on every machine.
+*/
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+#include "yuv_stream.hpp"
+
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+namespace synth{
+
+    enum Pattern {
+        still = 0,
+        pan,
+        zoom,
+        noise,
+        scenecut,
+        detail,
+        ERROR
+    };
+
+    Pattern get_pattern(const std::string& name){
+        if(name == "static")
+            return still;
+        else if(name == "pan")
+            return pan;
+        else if(name == "zoom")
+            return zoom;
+        else if(name == "noise")
+            return noise;
+        else if(name == "scenecut")
+            return scenecut;
+        else if(name == "detail")
+            return detail;
+        return ERROR;
+    }
+
+    bool get_size(const std::string& name, u32& width, u32& height){
+        if(name == "cif"){
+            width = 352; height = 288;
+        }else if(name == "720p"){
+            width = 1280; height = 720;
+        }else if(name == "1080p"){
+            width = 1920; height = 1080;
+        }else{
+            std::size_t split = name.find('x');
+            if(split == std::string::npos)
+                return false;
+            width = std::stoi(name.substr(0, split));
+            height = std::stoi(name.substr(split+1));
+        }
+        return width > 0 && height > 0 && width%2 == 0 && height%2 == 0;
+    }
+
+    // integer hash of a lattice point (a variant of the murmur3 finalizer)
+    u32 hash(int x, int y, u32 seed){
+        u32 h = u32(x) * 0x8da6b343u ^ u32(y) * 0xd8163841u ^ seed * 0xcb1ab31fu;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    // smooth value noise in [0,1] with lattice spacing of cell pixels
+    double value_noise(double x, double y, double cell, u32 seed){
+        x /= cell;
+        y /= cell;
+        int x0 = int(std::floor(x));
+        int y0 = int(std::floor(y));
+        double fx = x - x0;
+        double fy = y - y0;
+        fx = fx*fx*(3 - 2*fx);
+        fy = fy*fy*(3 - 2*fy);
+        double v00 = (hash(x0, y0, seed) & 0xffff) / 65535.0;
+        double v10 = (hash(x0+1, y0, seed) & 0xffff) / 65535.0;
+        double v01 = (hash(x0, y0+1, seed) & 0xffff) / 65535.0;
+        double v11 = (hash(x0+1, y0+1, seed) & 0xffff) / 65535.0;
+        double top = v00 + (v10 - v00)*fx;
+        double bottom = v01 + (v11 - v01)*fx;
+        return top + (bottom - top)*fy;
+    }
+
+    // periodic triangle wave in [0,1]
+    double triangle(double t){
+        t -= std::floor(t);
+        return (t < 0.5) ? 2*t : 2 - 2*t;
+    }
+
+    // texture sample in [0,255] at scene coordinates (x,y), channel 0=Y 1=Cb 2=Cr
+    double texture(double x, double y, u32 channel, u32 scene, bool high_detail){
+        u32 seed = scene * 131 + channel * 7 + 1;
+        double v = 0.45 * value_noise(x, y, 64, seed)
+                 + 0.30 * value_noise(x, y, 16, seed + 1)
+                 + 0.15 * value_noise(x, y, 4, seed + 2);
+        // hard edged shapes give the motion search something to lock on to
+        int cell_x = int(std::floor(x / 96));
+        int cell_y = int(std::floor(y / 96));
+        u32 h = hash(cell_x, cell_y, seed + 3);
+        if((h & 3) == 0){
+            double local_x = x - cell_x * 96;
+            double local_y = y - cell_y * 96;
+            if(local_x > 20 && local_x < 76 && local_y > 20 && local_y < 76)
+                v = 0.2 + 0.6 * ((h >> 8) & 0xff) / 255.0;
+        }
+        if(high_detail)
+            v = 0.4 * v + 0.6 * triangle((x*x + y*y) / 2048.0 + x / 5.0);
+        if(channel != 0)
+            v = 0.5 + 0.4 * (v - 0.5);
+        return 255 * v;
+    }
+
+    unsigned char clamp(double v){
+        int i = int(v + 0.5);
+        if(i < 0)
+            return 0;
+        if(i > 255)
+            return 255;
+        return i;
+    }
+
+    // Maps the pixel (x,y) of frame t to scene coordinates for the pattern
+    void scene_position(Pattern pattern, u32 t, double x, double y, u32 width, u32 height, double& sx, double& sy, u32& scene){
+        scene = 0;
+        sx = x;
+        sy = y;
+        if(pattern == pan){
+            sx = x + 1.75 * t;
+            sy = y + 0.5 * t;
+        }else if(pattern == zoom){
+            double scale = 1;
+            for(u32 i = 0; i < t; i++)
+                scale *= 0.99;
+            sx = width/2.0 + (x - width/2.0) * scale;
+            sy = height/2.0 + (y - height/2.0) * scale;
+        }else if(pattern == scenecut){
+            scene = t / 10;
+            sx = x + 0.5 * t;
+            sy = y + 0.25 * t;
+        }else if(pattern == detail){
+            sx = x + 0.5 * t;
+            sy = y;
+        }
+    }
+
+    void render_frame(YUVFrame420& frame, Pattern pattern, u32 t, u32 seed){
+        u32 width = frame.get_Width();
+        u32 height = frame.get_Height();
+        bool high_detail = (pattern == detail);
+        u32 noise_seed = seed * 977 + t;
+
+        for(u32 y = 0; y < height; y++){
+            for(u32 x = 0; x < width; x++){
+                double sx, sy;
+                u32 scene;
+                scene_position(pattern, t, x, y, width, height, sx, sy, scene);
+                double v = texture(sx, sy, 0, scene + seed, high_detail);
+                if(pattern == noise)
+                    v += int(hash(x, y, noise_seed) % 33) - 16;
+                frame.Y(x,y) = clamp(v);
+            }
+        }
+        for(u32 y = 0; y < height/2; y++){
+            for(u32 x = 0; x < width/2; x++){
+                double sx, sy;
+                u32 scene;
+                // chroma samples sit between the luma samples they cover
+                scene_position(pattern, t, 2*x + 0.5, 2*y + 0.5, width, height, sx, sy, scene);
+                frame.Cb(x,y) = clamp(texture(sx, sy, 1, scene + seed, high_detail));
+                frame.Cr(x,y) = clamp(texture(sx, sy, 2, scene + seed, high_detail));
+            }
+        }
+    }
+
+} // namespace synth
+
+int main(int argc, char** argv){
+
+    if(argc < 4){
+        std::cerr << "Usage: " << argv[0] << " <static/pan/zoom/noise/scenecut/detail> <cif/720p/1080p/WxH> <num_frames> [seed]" << std::endl;
+        return 1;
+    }
+
+    synth::Pattern pattern = synth::get_pattern(argv[1]);
+    u32 width, height;
+    if(pattern == synth::ERROR || !synth::get_size(argv[2], width, height)){
+        std::cerr << "Usage: " << argv[0] << " <static/pan/zoom/noise/scenecut/detail> <cif/720p/1080p/WxH> <num_frames> [seed]" << std::endl;
+        return 1;
+    }
+    u32 num_frames = std::stoi(argv[3]);
+    u32 seed = (argc > 4) ? std::stoi(argv[4]) : 0;
+
+    YUVStreamWriter writer {std::cout, width, height};
+    for(u32 t = 0; t < num_frames; t++){
+        synth::render_frame(writer.frame(), pattern, t, seed);
+        writer.write_frame();
+    }
+    return 0;
+}
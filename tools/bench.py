@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""bench.py
+
+End-to-end throughput and quality regression harness.
+
+Generates deterministic clips with uvid_synth, pipes each one through
+uvid_compress and uvid_decompress at every quality level and records the
+encode/decode speed, compression ratio, per-plane PSNR (via uvid_psnr) and
+the peak resident set size of each process.
+
+    python3 tools/bench.py --build build                 # write bench/baseline.txt
+    python3 tools/bench.py --build build --check         # compare against it
+    python3 tools/bench.py --build build --sizes cif --patterns pan,noise
+
+Results are written as one whitespace separated line per run, sorted in a
+fixed order, so that regressions in speed or size show up as diffs of the
+baseline file.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+PATTERNS = ["static", "pan", "zoom", "noise", "scenecut", "detail"]
+SIZES = {"cif": (352, 288), "720p": (1280, 720), "1080p": (1920, 1080)}
+QUALITIES = ["low", "medium", "high"]
+DEFAULT_FRAMES = {"cif": 30, "720p": 12, "1080p": 12}
+
+COLUMNS = ["pattern", "size", "quality", "frames", "enc_fps", "dec_fps", "ratio",
+           "psnr_y", "psnr_cb", "psnr_cr", "enc_rss_kb", "dec_rss_kb"]
+
+# Allowed change before --check reports a regression
+TOLERANCE = {"enc_fps": 0.80, "dec_fps": 0.80, "ratio": 0.98}
+PSNR_TOLERANCE = 0.05
+
+
+def read_peak_rss(pid):
+    """Returns VmHWM of a running process in kB (0 if it has already exited)"""
+    try:
+        with open("/proc/{}/status".format(pid)) as status:
+            for line in status:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+def run_timed(command, stdin_path, stdout_path):
+    """Runs command with redirected stdin/stdout, returns (seconds, peak rss in kB)
+
+    The rusage returned by wait4 is not used for the peak RSS since Linux
+    carries the high water mark of the forking (python) process over to the
+    child. Instead VmHWM of the child is sampled while it runs.
+    """
+    peak_rss = 0
+    with open(stdin_path, "rb") as stdin, open(stdout_path, "wb") as stdout:
+        start = time.perf_counter()
+        process = subprocess.Popen(command, stdin=stdin, stdout=stdout)
+        while True:
+            peak_rss = max(peak_rss, read_peak_rss(process.pid))
+            pid, status = os.waitpid(process.pid, os.WNOHANG)
+            if pid != 0:
+                break
+            time.sleep(0.002)
+        elapsed = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        raise RuntimeError("{} exited with status {}".format(" ".join(command), process.returncode))
+    return elapsed, peak_rss
+
+
+def run_case(build, workdir, pattern, size, frames):
+    width, height = SIZES[size]
+    raw_path = os.path.join(workdir, "input.raw")
+    with open(raw_path, "wb") as raw:
+        subprocess.run([os.path.join(build, "uvid_synth"), pattern, size, str(frames)], stdout=raw, check=True)
+    raw_size = os.path.getsize(raw_path)
+
+    results = []
+    for quality in QUALITIES:
+        compressed_path = os.path.join(workdir, "compressed.uvi")
+        decoded_path = os.path.join(workdir, "decoded.raw")
+        enc_time, enc_rss = run_timed([os.path.join(build, "uvid_compress"), str(width), str(height), quality],
+                                      raw_path, compressed_path)
+        dec_time, dec_rss = run_timed([os.path.join(build, "uvid_decompress")], compressed_path, decoded_path)
+        psnr = subprocess.run([os.path.join(build, "uvid_psnr"), str(width), str(height), raw_path, decoded_path],
+                              stdout=subprocess.PIPE, check=True, universal_newlines=True).stdout.split()
+        # frames <n> Y <dB> Cb <dB> Cr <dB>
+        if int(psnr[1]) != frames:
+            raise RuntimeError("{} {} {}: decoded {} of {} frames".format(pattern, size, quality, psnr[1], frames))
+        results.append({
+            "pattern": pattern, "size": size, "quality": quality, "frames": str(frames),
+            "enc_fps": "{:.2f}".format(frames / enc_time),
+            "dec_fps": "{:.2f}".format(frames / dec_time),
+            "ratio": "{:.3f}".format(raw_size / max(1, os.path.getsize(compressed_path))),
+            "psnr_y": "{:.3f}".format(float(psnr[3])),
+            "psnr_cb": "{:.3f}".format(float(psnr[5])),
+            "psnr_cr": "{:.3f}".format(float(psnr[7])),
+            "enc_rss_kb": str(enc_rss), "dec_rss_kb": str(dec_rss),
+        })
+        print(" ".join(results[-1][c] for c in COLUMNS), file=sys.stderr)
+    return results
+
+
+def read_baseline(path):
+    rows = {}
+    with open(path) as baseline:
+        for line in baseline:
+            if line.startswith("#") or not line.strip():
+                continue
+            row = dict(zip(COLUMNS, line.split()))
+            rows[(row["pattern"], row["size"], row["quality"])] = row
+    return rows
+
+
+def check(results, baseline_path):
+    """Reports every run that is slower, larger or lower quality than the baseline"""
+    baseline = read_baseline(baseline_path)
+    regressions = 0
+    for row in results:
+        key = (row["pattern"], row["size"], row["quality"])
+        if key not in baseline:
+            continue
+        base = baseline[key]
+        for column, factor in TOLERANCE.items():
+            if float(row[column]) < factor * float(base[column]):
+                print("REGRESSION {} {}: {} -> {}".format(" ".join(key), column, base[column], row[column]))
+                regressions += 1
+        for column in ["psnr_y", "psnr_cb", "psnr_cr"]:
+            if float(row[column]) < float(base[column]) - PSNR_TOLERANCE:
+                print("REGRESSION {} {}: {} -> {}".format(" ".join(key), column, base[column], row[column]))
+                regressions += 1
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--build", default="build", help="directory containing the built binaries")
+    parser.add_argument("--patterns", default=",".join(PATTERNS))
+    parser.add_argument("--sizes", default=",".join(SIZES))
+    parser.add_argument("--frames", type=int, help="frames per clip (default depends on the size)")
+    parser.add_argument("--output", default=os.path.join("bench", "baseline.txt"))
+    parser.add_argument("--check", action="store_true", help="compare against --output instead of overwriting it")
+    args = parser.parse_args()
+
+    results = []
+    with tempfile.TemporaryDirectory() as workdir:
+        for size in args.sizes.split(","):
+            for pattern in args.patterns.split(","):
+                frames = args.frames or DEFAULT_FRAMES[size]
+                results += run_case(args.build, workdir, pattern, size, frames)
+
+    if args.check:
+        sys.exit(1 if check(results, args.output) else 0)
+
+    with open(args.output, "w") as output:
+        output.write("# " + " ".join(COLUMNS) + "\n")
+        for row in results:
+            output.write(" ".join(row[c] for c in COLUMNS) + "\n")
+
+
+if __name__ == "__main__":
+    main()